@@ -0,0 +1,62 @@
+/*
+Subtree aggregates (augmentations) for avltree
+*/
+
+#ifndef AVLAUGMENT_H
+#define AVLAUGMENT_H 1
+
+#include <functional>
+using namespace std;
+
+// an Augment gives every avltree node an aggregate of its whole
+//    subtree, kept up to date wherever the tree's shape changes (at
+//    the same points the heights are), so that range aggregates and
+//    interval searches cost O(log n) rather than a walk
+// it provides
+//    type                   the aggregate
+//    make(key, value)       the aggregate of a single entry
+//    combine(a, b)          the aggregate of a followed (in key order)
+//                           by b, which must be associative
+// no identity is needed; empty subtrees are simply left out
+
+// the default: no aggregate, and no space taken in the nodes
+struct noaugment {
+   struct type { };
+};
+
+// the sum of the values
+template <class Key, class Value>
+struct sumaugment {
+   typedef Value type;
+   static type make(const Key &, const Value &v) { return v; }
+   static type combine(const type &a, const type &b) { return a + b; }
+};
+
+// the smallest and the largest value
+template <class Key, class Value>
+struct minaugment {
+   typedef Value type;
+   static type make(const Key &, const Value &v) { return v; }
+   static type combine(const type &a, const type &b) {
+      return (b < a) ? b : a;
+   }
+};
+template <class Key, class Value>
+struct maxaugment {
+   typedef Value type;
+   static type make(const Key &, const Value &v) { return v; }
+   static type combine(const type &a, const type &b) {
+      return (a < b) ? b : a;
+   }
+};
+
+// the aggregate's slot in a node, which for noaugment is an empty base
+//    and so takes no space
+template <class Augment>
+struct avlaugmentslot {
+   typename Augment::type aggregate;
+};
+template <>
+struct avlaugmentslot<noaugment> { };
+
+#endif
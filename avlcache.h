@@ -0,0 +1,383 @@
+/*
+Bounded cache built on avltree, with LRU and TTL eviction
+*/
+
+#ifndef AVLCACHE_H
+#define AVLCACHE_H 1
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include "avltree.h"
+using namespace std;
+
+// what a cache has been doing since it was made (or last reset)
+struct avlcachestats {
+   unsigned long long hits, misses;
+   unsigned long long loads;          // loader calls made by get_or_load
+   unsigned long long coalesced;      // misses that waited on another
+                                      //    thread's load instead
+   unsigned long long evictions;      // entries dropped for the budget
+   unsigned long long expirations;    // entries dropped for their ttl
+};
+
+// a map for caching values from a slow store, within a budget of
+//    entries and (optionally) bytes, as measured by the sizer given;
+//    when it is over budget, the least recently used entries go
+// an entry may have a time to live, after which it is never returned;
+//    expiry times are kept in a second avltree ordered by time, so the
+//    entries due are found at its front and dropped for O(log n) each
+//    (whenever the cache is written to, or by expire())
+// the entries live in an avltree whose nodes never move, so the
+//    recency list is threaded through them directly
+// every method takes the cache's lock; get_or_load calls its loader
+//    without it, and runs at most one load per key at a time
+template <class Key, class Value, class Compare = less<Key> >
+class avlcache {
+   public:
+      typedef chrono::steady_clock clock;
+      typedef clock::duration duration;
+      typedef function<size_t(const Key &, const Value &)> sizer;
+
+   private:
+      struct entry {
+         Value data;
+         const Key *key;            // the key in this entry's node
+         size_t bytes;
+         clock::time_point expires; // time_point::max() for never
+         entry *newer, *older;      // the recency list
+         entry(const Value &d) :
+            data(d), key(NULL), bytes(0), newer(NULL), older(NULL) { }
+      };
+
+      // the expiry index orders entries by time, then key
+      struct expiry {
+         clock::time_point when;
+         const Key *key;
+      };
+      struct expiryless {
+         Compare comp;
+         expiryless(const Compare &c = Compare()) : comp(c) { }
+         bool operator()(const expiry &a, const expiry &b) const {
+            if (a.when != b.when) return a.when < b.when;
+            return comp(*a.key, *b.key);
+         }
+      };
+
+      // a load in progress, which other misses on the key wait for
+      // a put or remove of the key while it loads makes what the load
+      //    returns stale, so it is handed to the waiters but not cached
+      struct flight {
+         condition_variable done;
+         bool finished, found, stale;
+         Value data;
+         flight() : finished(false), found(false), stale(false) { }
+      };
+
+      mutable mutex m;
+      avltree<Key, entry, Compare> entries;
+      avltree<expiry, entry*, expiryless> expiries;
+      avltree<Key, shared_ptr<flight>, Compare> loading;
+      entry *newest, *oldest;
+      size_t maxentries, maxbytes, bytesused;
+      duration ttl;
+      sizer measure;
+      avlcachestats counts;
+
+      bool lookup(const Key &k, Value &d);
+      bool store(const Key &k, const Value &d, duration life);
+      void drop(entry *e);
+      size_t expirethrough(clock::time_point now);
+      void unlink(entry *e);
+      void pushnewest(entry *e);
+      void invalidateload(const Key &k);
+
+      static size_t defaultsize(const Key &, const Value &) {
+         return sizeof(Key) + sizeof(Value);
+      }
+
+      // the recency list points into the trees, so caches can't be
+      //    copied
+      avlcache(const avlcache &);
+      avlcache &operator=(const avlcache &);
+
+   public:
+      // at most entrylimit entries and bytelimit bytes, 0 meaning no
+      //    limit; the default sizer charges sizeof(Key) + sizeof(Value)
+      //    per entry
+      // entries put without a ttl of their own get life, where
+      //    duration::zero() means they never expire
+      avlcache(size_t entrylimit, size_t bytelimit = 0,
+               duration life = duration::zero(), sizer s = defaultsize,
+               const Compare &c = Compare()) :
+         entries(c), expiries(expiryless(c)), loading(c),
+         newest(NULL), oldest(NULL), maxentries(entrylimit),
+         maxbytes(bytelimit), bytesused(0), ttl(life), measure(s) {
+         memset(&counts, 0, sizeof(counts));
+      }
+
+      // the value cached for k, which becomes the most recently used
+      bool get(const Key &k, Value &d) {
+         lock_guard<mutex> lock(m);
+         return lookup(k, d);
+      }
+      // cache d for k, replacing any value already there, then evict
+      //    down to the budget (so an entry bigger than the whole budget
+      //    isn't kept); returns true if k was added
+      bool put(const Key &k, const Value &d) {
+         lock_guard<mutex> lock(m);
+         invalidateload(k);
+         return store(k, d, ttl);
+      }
+      bool put(const Key &k, const Value &d, duration life) {
+         lock_guard<mutex> lock(m);
+         invalidateload(k);
+         return store(k, d, life);
+      }
+      bool remove(const Key &k);
+
+      // the value cached for k, or else what load(k, d) (returning
+      //    bool) finds, which is then cached
+      // concurrent misses on the same key share a single call to the
+      //    loader: the first caller loads, the others wait for it and
+      //    take its result; a load that returns false caches nothing
+      //    and fails every caller waiting on it
+      // if k is put or removed while it loads, the loaded value is
+      //    still returned but isn't cached over the newer state
+      template <class Loader>
+      bool get_or_load(const Key &k, Value &d, Loader load);
+
+      // drop every expired entry now, returning how many went
+      size_t expire() {
+         lock_guard<mutex> lock(m);
+         return expirethrough(clock::now());
+      }
+      void clear();
+
+      size_t size() const {
+         lock_guard<mutex> lock(m);
+         return entries.size();
+      }
+      size_t bytes() const {
+         lock_guard<mutex> lock(m);
+         return bytesused;
+      }
+      avlcachestats stats() const {
+         lock_guard<mutex> lock(m);
+         return counts;
+      }
+      void resetstats() {
+         lock_guard<mutex> lock(m);
+         memset(&counts, 0, sizeof(counts));
+      }
+};
+
+template <class Key, class Value, class Compare>
+void avlcache<Key, Value, Compare>::unlink(entry *e)
+{
+   if (e->newer) e->newer->older = e->older;
+   else newest = e->older;
+   if (e->older) e->older->newer = e->newer;
+   else oldest = e->newer;
+   e->newer = e->older = NULL;
+}
+
+template <class Key, class Value, class Compare>
+void avlcache<Key, Value, Compare>::pushnewest(entry *e)
+{
+   e->older = newest;
+   e->newer = NULL;
+   if (newest) newest->newer = e;
+   else oldest = e;
+   newest = e;
+}
+
+template <class Key, class Value, class Compare>
+void avlcache<Key, Value, Compare>::invalidateload(const Key &k)
+// mark a load of k under way as stale (under m)
+{
+   shared_ptr<flight> f;
+   if (loading.search(k, f)) f->stale = true;
+}
+
+template <class Key, class Value, class Compare>
+void avlcache<Key, Value, Compare>::drop(entry *e)
+// take e out of the recency list and the expiry index, then out of the
+//    tree; the key is copied first, as the node holding it is freed
+{
+   unlink(e);
+   if (e->expires != clock::time_point::max()) {
+      expiry x = { e->expires, e->key };
+      expiries.remove(x);
+   }
+   bytesused -= e->bytes;
+   Key k = *e->key;
+   entries.remove(k);
+}
+
+template <class Key, class Value, class Compare>
+size_t avlcache<Key, Value, Compare>::expirethrough(clock::time_point now)
+// the entries due are at the front of the expiry index
+{
+   size_t n = 0;
+   while (expiries.size()) {
+      typename avltree<expiry, entry*, expiryless>::iterator first =
+         expiries.begin();
+      if (first.key().when > now) break;
+      drop(first.value());
+      n++;
+   }
+   counts.expirations += n;
+   return n;
+}
+
+template <class Key, class Value, class Compare>
+bool avlcache<Key, Value, Compare>::lookup(const Key &k, Value &d)
+// a hit moves to the front of the recency list; an expired entry is
+//    dropped and counts as a miss
+{
+   typename avltree<Key, entry, Compare>::iterator it = entries.find(k);
+   if (it == entries.end()) {
+      counts.misses++;
+      return false;
+   }
+   entry *e = &it.value();
+   if (e->expires <= clock::now()) {
+      drop(e);
+      counts.expirations++;
+      counts.misses++;
+      return false;
+   }
+   unlink(e);
+   pushnewest(e);
+   d = e->data;
+   counts.hits++;
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+bool avlcache<Key, Value, Compare>::store(const Key &k, const Value &d,
+                                          duration life)
+// replace or add the entry, then make room: first by dropping expired
+//    entries, then the least recently used
+{
+   clock::time_point now = clock::now();
+   typename avltree<Key, entry, Compare>::iterator it = entries.find(k);
+   bool added = (it == entries.end());
+   entry *e;
+   if (added) {
+      if (!entries.try_emplace(k, d)) return false;
+      it = entries.find(k);
+      e = &it.value();
+      e->key = &it.key();
+   } else {
+      e = &it.value();
+      unlink(e);
+      if (e->expires != clock::time_point::max()) {
+         expiry x = { e->expires, e->key };
+         expiries.remove(x);
+      }
+      bytesused -= e->bytes;
+      e->data = d;
+   }
+   e->bytes = measure(k, d);
+   bytesused += e->bytes;
+   e->expires = (life > duration::zero()) ? now + life
+                                          : clock::time_point::max();
+   if (e->expires != clock::time_point::max()) {
+      expiry x = { e->expires, e->key };
+      if (!expiries.insert(x, e)) {
+         // with no room to index it, the entry can't be kept
+         bytesused -= e->bytes;
+         entries.remove(k);
+         return false;
+      }
+   }
+   pushnewest(e);
+
+   expirethrough(now);
+   while (oldest && ((maxentries && entries.size() > maxentries) ||
+                     (maxbytes && bytesused > maxbytes))) {
+      drop(oldest);
+      counts.evictions++;
+   }
+   return added;
+}
+
+template <class Key, class Value, class Compare>
+bool avlcache<Key, Value, Compare>::remove(const Key &k)
+{
+   lock_guard<mutex> lock(m);
+   invalidateload(k);
+   typename avltree<Key, entry, Compare>::iterator it = entries.find(k);
+   if (it == entries.end()) return false;
+   drop(&it.value());
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+void avlcache<Key, Value, Compare>::clear()
+{
+   lock_guard<mutex> lock(m);
+   // loads under way would otherwise put back what was cleared
+   typedef typename avltree<Key, shared_ptr<flight>, Compare>::iterator
+      flightiterator;
+   for (flightiterator it = loading.begin(); it != loading.end(); ++it)
+      it.value()->stale = true;
+   entries.clear();
+   expiries.clear();
+   newest = oldest = NULL;
+   bytesused = 0;
+}
+
+template <class Key, class Value, class Compare>
+template <class Loader>
+bool avlcache<Key, Value, Compare>::get_or_load(const Key &k, Value &d,
+                                                Loader load)
+// a miss either joins the load already under way for k, or registers
+//    its own in the loading tree and runs it unlocked
+// if the loader throws, the waiters are failed and the exception
+//    passed on
+{
+   unique_lock<mutex> lock(m);
+   if (lookup(k, d)) return true;
+   shared_ptr<flight> f;
+   if (loading.search(k, f)) {
+      counts.coalesced++;
+      while (!f->finished) f->done.wait(lock);
+      if (f->found) d = f->data;
+      return f->found;
+   }
+   f = make_shared<flight>();
+   if (!loading.insert(k, f)) return false;
+   counts.loads++;
+   lock.unlock();
+
+   bool found = false;
+   Value loaded;
+   try {
+      found = load(k, loaded);
+   } catch (...) {
+      lock.lock();
+      loading.remove(k);
+      f->finished = true;
+      f->done.notify_all();
+      throw;
+   }
+
+   lock.lock();
+   loading.remove(k);
+   if (found) {
+      if (!f->stale) store(k, loaded, ttl);
+      f->data = loaded;
+      d = loaded;
+   }
+   f->found = found;
+   f->finished = true;
+   f->done.notify_all();
+   return found;
+}
+
+#endif
@@ -0,0 +1,335 @@
+/*
+Binary tree images: the file format written by avltree::save,
+and a read-only tree served straight from a memory mapped image
+*/
+
+#ifndef AVLIMAGE_H
+#define AVLIMAGE_H 1
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+// how keys and values are turned into bytes in an image, and back
+// encode appends the bytes for v to out; decode rebuilds a value from
+//    the n bytes at p; compare orders the n key bytes at p against k
+//    (negative, zero or positive), and must agree with less<T>, since
+//    a mapped image is searched without decoding its keys
+// specialize this for your own types
+template <class T, class Enable = void>
+struct avlcodec;
+
+// arithmetic types are stored as their raw bytes
+template <class T>
+struct avlcodec<T, typename enable_if<is_arithmetic<T>::value>::type> {
+   static void encode(const T &v, string &out) {
+      out.append(reinterpret_cast<const char*>(&v), sizeof(T));
+   }
+   static T decode(const char *p, size_t) {
+      T v;
+      memcpy(&v, p, sizeof(T));
+      return v;
+   }
+   static int compare(const char *p, size_t n, const T &k) {
+      T v = decode(p, n);
+      return (v < k) ? -1 : ((k < v) ? 1 : 0);
+   }
+};
+
+// strings are stored as their characters, and compare the same way
+//    string::compare does
+template <>
+struct avlcodec<string> {
+   static void encode(const string &v, string &out) { out += v; }
+   static string decode(const char *p, size_t n) { return string(p, n); }
+   static int compare(const char *p, size_t n, const string &k) {
+      int c = char_traits<char>::compare(p, k.data(), min(n, k.size()));
+      if (c) return c;
+      return (n < k.size()) ? -1 : ((n > k.size()) ? 1 : 0);
+   }
+};
+
+// the image layout: a header, then one record per entry in preorder
+//    (so the root is record 0), then the blob area holding each
+//    entry's key bytes followed by its value bytes
+// integers are in the writer's byte order, which the header records
+//    so that an image moved to a machine of the other order is refused
+struct avlimageheader {
+   char     magic[8];        // "AVLIMAGE"
+   uint32_t version;
+   uint32_t byteorder;      // avlimagebyteorder as the writer saw it
+   uint64_t count;          // number of records
+   uint64_t recordsoffset;
+   uint64_t blobsoffset;
+   uint64_t blobbytes;
+   uint64_t checksum;       // FNV-1a over everything after the header
+};
+
+struct avlimagerecord {
+   uint64_t blob;           // offset of the key bytes in the blob area
+   uint32_t keybytes, valuebytes;
+   uint32_t left, right;    // record index + 1, or 0 for no child
+   int32_t  height, balance;
+};
+
+static const char avlimagemagic[8] = { 'A','V','L','I','M','A','G','E' };
+static const uint32_t avlimageversion = 1;
+static const uint32_t avlimagebyteorder = 0x01020304;
+
+// 64 bit FNV-1a, fed incrementally
+inline uint64_t avlfnv(const void *data, size_t bytes,
+                       uint64_t h = 14695981039346656037ULL)
+{
+   const unsigned char *p = static_cast<const unsigned char*>(data);
+   for (size_t i = 0; i < bytes; i++) {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+   }
+   return h;
+}
+
+// sync the directory holding path, so that a file just renamed into
+//    it is on disk under its new name
+inline bool avlsyncdirectory(const string &path)
+{
+   size_t slash = path.rfind('/');
+   string dir = (slash == string::npos) ? "." :
+                (slash == 0) ? "/" : path.substr(0, slash);
+   int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+   if (fd < 0) return false;
+   bool ok = (fsync(fd) == 0);
+   return (::close(fd) == 0) && ok;
+}
+
+// a read-only AVL tree map served directly from an image written by
+//    avltree::save, mapped into memory rather than loaded: opening
+//    costs a few system calls, and only the pages a search touches
+//    are ever read from disk
+// keys are compared in their stored form through avlcodec, so the
+//    image must have been saved by a tree ordered by less<Key>
+template <class Key, class Value, class Compare = less<Key> >
+class mappedavltree {
+   static_assert(is_same<Compare, less<Key> >::value,
+                 "mapped images are searched with avlcodec<Key>::compare, "
+                 "which follows less<Key>");
+   private:
+      const char *base;
+      size_t length;
+      const avlimagerecord *records;
+      const char *blobs;
+      uint64_t count;
+
+      // deep enough for any image (AVL height < 1.45 log2 n)
+      static const int maxdepth = 96;
+
+      // the record at index + 1 (as stored in the links), or NULL if
+      //    there is none or the link is out of range
+      const avlimagerecord *at(uint32_t link) const {
+         return (link > 0 && link <= count) ? &records[link - 1] : NULL;
+      }
+      int compare(const avlimagerecord *r, const Key &k) const {
+         return avlcodec<Key>::compare(blobs + r->blob, r->keybytes, k);
+      }
+      bool checkrecords() const;
+
+      // the mapping is owned, so mapped trees can't be copied
+      mappedavltree(const mappedavltree &);
+      mappedavltree &operator=(const mappedavltree &);
+
+   public:
+      mappedavltree() :
+         base(NULL), length(0), records(NULL), blobs(NULL), count(0) { }
+      ~mappedavltree() { close(); }
+
+      // map the image at path, replacing any image already open
+      // returns false if the file can't be mapped or isn't a valid
+      //    image; with verify, the checksum is checked and every record
+      //    bounds checked as well, which reads the whole file once
+      bool open(const string &path, bool verify = true);
+      void close();
+
+      size_t size() const { return count; }
+      bool search(const Key &k, Value &d) const;
+      // call fn(key, value) for every entry from lo to hi inclusive,
+      //    in key order, decoding only the entries visited
+      // returns false if the walk was cut short because the links
+      //    don't form a tree (an image opened without verify can be
+      //    damaged that way): it is too deep, or visits more records
+      //    than there are
+      template <class F>
+      bool for_each_in_range(const Key &lo, const Key &hi, F fn) const;
+      // call fn(key, value) for every entry, in key order
+      // returns false if the links don't form a tree, as above
+      template <class F>
+      bool for_each(F fn) const;
+};
+
+template <class Key, class Value, class Compare>
+bool mappedavltree<Key, Value, Compare>::open(const string &path, bool verify)
+// map the file read-only and check the header; the mapping stays valid
+//    after the descriptor is closed
+{
+   close();
+   int fd = ::open(path.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   struct stat st;
+   if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(avlimageheader))) {
+      ::close(fd);
+      return false;
+   }
+   void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   ::close(fd);
+   if (mem == MAP_FAILED) return false;
+   base = static_cast<const char*>(mem);
+   length = st.st_size;
+
+   avlimageheader h;
+   memcpy(&h, base, sizeof(h));
+   bool ok = (memcmp(h.magic, avlimagemagic, sizeof(h.magic)) == 0) &&
+             (h.version == avlimageversion) &&
+             (h.byteorder == avlimagebyteorder) &&
+             (h.recordsoffset % alignof(avlimagerecord) == 0) &&
+             (h.recordsoffset >= sizeof(h)) &&
+             (h.recordsoffset <= length) &&
+             (h.count <= 0xffffffffULL) &&
+             (h.count <= (length - h.recordsoffset) /
+                         sizeof(avlimagerecord)) &&
+             (h.blobsoffset >= h.recordsoffset +
+                               h.count * sizeof(avlimagerecord)) &&
+             (h.blobsoffset <= length) &&
+             (h.blobbytes <= length - h.blobsoffset);
+   if (ok) {
+      records = reinterpret_cast<const avlimagerecord*>(base +
+                                                         h.recordsoffset);
+      blobs = base + h.blobsoffset;
+      count = h.count;
+      if (verify) {
+         ok = (avlfnv(base + sizeof(h), length - sizeof(h)) == h.checksum) &&
+              checkrecords();
+      }
+   }
+   if (!ok) close();
+   return ok;
+}
+
+template <class Key, class Value, class Compare>
+bool mappedavltree<Key, Value, Compare>::checkrecords() const
+// every record's links and blob must lie inside the image; (blobs
+//    are checked against the whole mapping, which is what matters for
+//    safety)
+{
+   size_t blobspace = length - (blobs - base);
+   for (uint64_t i = 0; i < count; i++) {
+      const avlimagerecord &r = records[i];
+      if ((r.left > count) || (r.right > count)) return false;
+      if (r.blob > blobspace) return false;
+      if ((uint64_t)r.keybytes + r.valuebytes > blobspace - r.blob)
+         return false;
+   }
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+void mappedavltree<Key, Value, Compare>::close()
+{
+   if (base) munmap(const_cast<char*>(base), length);
+   base = NULL;
+   length = 0;
+   records = NULL;
+   blobs = NULL;
+   count = 0;
+}
+
+template <class Key, class Value, class Compare>
+bool mappedavltree<Key, Value, Compare>::search(const Key &k, Value &d) const
+// an ordinary descent over the records, comparing k against the stored
+//    key bytes; only the value found is decoded
+// the depth is capped so that a damaged image can't loop forever
+{
+   const avlimagerecord *r = at(count ? 1 : 0);
+   for (int depth = 0; r && depth < maxdepth; depth++) {
+      int c = compare(r, k);
+      if (c > 0) r = at(r->left);
+      else if (c < 0) r = at(r->right);
+      else {
+         d = avlcodec<Value>::decode(blobs + r->blob + r->keybytes,
+                                     r->valuebytes);
+         return true;
+      }
+   }
+   return false;
+}
+
+template <class Key, class Value, class Compare>
+template <class F>
+bool mappedavltree<Key, Value, Compare>::for_each_in_range(const Key &lo,
+                                                           const Key &hi,
+                                                           F fn) const
+// find the first entry not below lo, keeping the ancestors still to be
+//    visited on a stack, then walk in order until passing hi
+// the stack's depth caps every descent, and the number of records
+//    visited caps the walk, so a damaged image can't loop forever
+{
+   const avlimagerecord *stack[maxdepth];
+   int depth = 0;
+   const avlimagerecord *r = at(count ? 1 : 0);
+   while (r) {
+      if (depth == maxdepth) return false;
+      if (compare(r, lo) < 0) {
+         r = at(r->right);
+      } else {
+         stack[depth++] = r;
+         r = at(r->left);
+      }
+   }
+   for (uint64_t visits = 0; depth > 0; visits++) {
+      if (visits == count) return false;
+      r = stack[--depth];
+      if (compare(r, hi) > 0) return true;
+      const char *p = blobs + r->blob;
+      fn(avlcodec<Key>::decode(p, r->keybytes),
+         avlcodec<Value>::decode(p + r->keybytes, r->valuebytes));
+      for (r = at(r->right); r; r = at(r->left)) {
+         if (depth == maxdepth) return false;
+         stack[depth++] = r;
+      }
+   }
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+template <class F>
+bool mappedavltree<Key, Value, Compare>::for_each(F fn) const
+// records are in preorder, so an in order walk still needs a stack;
+//    capped as for_each_in_range is
+{
+   const avlimagerecord *stack[maxdepth];
+   int depth = 0;
+   const avlimagerecord *r = at(count ? 1 : 0);
+   for (; r; r = at(r->left)) {
+      if (depth == maxdepth) return false;
+      stack[depth++] = r;
+   }
+   for (uint64_t visits = 0; depth > 0; visits++) {
+      if (visits == count) return false;
+      r = stack[--depth];
+      const char *p = blobs + r->blob;
+      fn(avlcodec<Key>::decode(p, r->keybytes),
+         avlcodec<Value>::decode(p + r->keybytes, r->valuebytes));
+      for (r = at(r->right); r; r = at(r->left)) {
+         if (depth == maxdepth) return false;
+         stack[depth++] = r;
+      }
+   }
+   return true;
+}
+
+#endif
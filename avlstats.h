@@ -0,0 +1,93 @@
+/*
+Operation counters for avltree, compiled in with AVLTREE_STATS
+*/
+
+#ifndef AVLSTATS_H
+#define AVLSTATS_H 1
+
+#include <atomic>
+#include <cstring>
+using namespace std;
+
+// what an avltree has been doing since it was made (or last reset)
+// only counted when AVLTREE_STATS is defined before avltree.h is
+//    included; otherwise the counting code isn't compiled at all and
+//    every count reads as zero
+struct avlstats {
+   // path lengths (nodes visited) of maxpath - 1 or more share the
+   //    last histogram bucket
+   static const int maxpath = 48;
+
+   unsigned long long comparisons;     // calls to the key comparator
+   // rotations by type: the single ones, and the double ones named by
+   //    the first rotation then the second
+   unsigned long long rotateleft, rotateright;
+   unsigned long long rotaterightleft, rotateleftright;
+   unsigned long long allocations;     // nodes taken from the pool
+   unsigned long long frees;           // nodes given back to it
+   // nodes whose height, balance and size were recomputed, i.e. the
+   //    node writes rebalancing costs
+   unsigned long long heightupdates;
+   // histograms of how many nodes each operation passed through
+   unsigned long long searchpaths[maxpath];
+   unsigned long long insertpaths[maxpath];
+   unsigned long long removepaths[maxpath];
+};
+
+// the live counters behind avlstats, which may be bumped from several
+//    threads at once (the parallel builds and set operations compare
+//    keys concurrently), so they are relaxed atomics
+struct avlcounters {
+   typedef atomic<unsigned long long> counter;
+
+   counter comparisons;
+   counter rotateleft, rotateright, rotaterightleft, rotateleftright;
+   counter allocations, frees, heightupdates;
+   counter searchpaths[avlstats::maxpath];
+   counter insertpaths[avlstats::maxpath];
+   counter removepaths[avlstats::maxpath];
+
+   avlcounters() { reset(); }
+
+   static void bump(counter &c, unsigned long long n = 1) {
+      c.fetch_add(n, memory_order_relaxed);
+   }
+   static void path(counter *histogram, int length) {
+      if (length >= avlstats::maxpath) length = avlstats::maxpath - 1;
+      bump(histogram[length]);
+   }
+
+   avlstats read() const {
+      avlstats s;
+      s.comparisons = comparisons.load(memory_order_relaxed);
+      s.rotateleft = rotateleft.load(memory_order_relaxed);
+      s.rotateright = rotateright.load(memory_order_relaxed);
+      s.rotaterightleft = rotaterightleft.load(memory_order_relaxed);
+      s.rotateleftright = rotateleftright.load(memory_order_relaxed);
+      s.allocations = allocations.load(memory_order_relaxed);
+      s.frees = frees.load(memory_order_relaxed);
+      s.heightupdates = heightupdates.load(memory_order_relaxed);
+      for (int i = 0; i < avlstats::maxpath; i++) {
+         s.searchpaths[i] = searchpaths[i].load(memory_order_relaxed);
+         s.insertpaths[i] = insertpaths[i].load(memory_order_relaxed);
+         s.removepaths[i] = removepaths[i].load(memory_order_relaxed);
+      }
+      return s;
+   }
+   void reset() {
+      comparisons = 0;
+      rotateleft = rotateright = rotaterightleft = rotateleftright = 0;
+      allocations = frees = heightupdates = 0;
+      for (int i = 0; i < avlstats::maxpath; i++)
+         searchpaths[i] = insertpaths[i] = removepaths[i] = 0;
+   }
+};
+
+// AVLSTAT(x) compiles to x only when statistics are on
+#ifdef AVLTREE_STATS
+#define AVLSTAT(x) x
+#else
+#define AVLSTAT(x)
+#endif
+
+#endif
@@ -1,4 +1,20 @@
 	cmake_minimum_required(VERSION 2.6)
-	add_executable(	avltree /avltree.cpp	)
-	add_executable(	testapp /testapp.cpp	)
-
+	set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -std=c++11")
+	find_package(Threads)
+	add_executable(	testapp testapp.cpp	)
+	add_executable(	benchmark benchmark.cpp	)
+	target_link_libraries(	benchmark ${CMAKE_THREAD_LIBS_INIT}	)
+	add_executable(	difftest difftest.cpp	)
+	target_link_libraries(	difftest ${CMAKE_THREAD_LIBS_INIT}	)
+	enable_testing()
+	add_test(	difftest difftest	)
+	add_test(	difftest-concurrent difftest concurrent	)
+	add_test(	difftest-persistent difftest persistent	)
+	add_test(	difftest-compact difftest compact	)
+	add_test(	difftest-mapped difftest mapped	)
+	add_test(	difftest-durable difftest durable	)
+	add_test(	difftest-sharded difftest sharded	)
+	add_test(	difftest-frozen difftest frozen	)
+	add_test(	difftest-buckets difftest buckets	)
+	add_test(	difftest-arena difftest arena	)
+	add_test(	difftest-cache difftest cache	)
@@ -3,27 +3,36 @@ AVL Tree Function Implementations
 By Dylan Suveges
 */
 
-#include "avltree.h"
+// avltree is a class template, so these definitions are
+//    included at the end of avltree.h rather than compiled alone
 
-void avltree::updateheight(node *n)
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::updateheight(node *n)
 // compute the height of node n, assuming the heights
 //    of n's left and right children are correct
 // n's height is one greater than the height of the
 //    taller of its two children
+// the subtree size (used for order statistics) and the aggregate
+//    (with an Augment) are kept up to date here as well, so every
+//    rotation maintains them for free
 {
    // make sure n isn't null
    if (n == NULL) return;
+   AVLSTAT(avlcounters::bump(counters.heightupdates);)
+
+   n->size = 1 + subtreesize(n->left) + subtreesize(n->right);
 
    // remember one or both of n's children might be null
    if ((!n->left) && (!n->right)) {
       n->height = 0;
       n->balance = 0;
    } else if (!n->left) {
+      // an empty subtree counts as height -1
       n->height = n->right->height + 1;
-      n->balance = 1;
+      n->balance = n->right->height + 1;
    } else if (!n->right) {
       n->height = n->left->height + 1;
-      n->balance = -1;
+      n->balance = -(n->left->height + 1);
    } 
    // general case: both children exist,
    else {
@@ -32,178 +41,329 @@ void avltree::updateheight(node *n)
          n->height = n->right->height + 1;
       n->balance = n->right->height - n->left->height;
    }
+   augment(n);
 }
 
-avltree::node *avltree::search(string k, node *n)
+template <class Key, class Value, class Compare, class Augment>
+template <class K>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::search(const K &k, node *n) const
 // search the subtree rooted at n,
 //    looking for the topmost node whose key matches k
 // if a match is found return a pointer to the node,
 // otherwise return null
+// (the descent is a loop, so k is never copied along the way)
 {
-   if (!n) return NULL;
-   if (n->key == k) return n;
-   else if (n->key > k) return search(k, n->left);
-   else return search(k, n->right);
+   int depth = 0;
+   while (n) {
+      depth++;
+      if (compare(k, n->key)) n = n->left;
+      else if (compare(n->key, k)) n = n->right;
+      else break;
+   }
+   AVLSTAT(avlcounters::path(counters.searchpaths, depth);)
+   return n;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+size_t avltree<Key, Value, Compare, Augment>::search_batch(
+   const Key *keys, size_t count, const Value **out) const
+// checks whether the batch is sorted (one comparison per key,
+//    cheap next to a descent) and picks the lookup strategy
+{
+   bool sorted = true;
+   for (size_t i = 1; i < count && sorted; i++)
+      if (compare(keys[i], keys[i - 1])) sorted = false;
+   if (sorted) return searchmerged(keys, count, out);
+   return searchinterleaved(keys, count, out);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+size_t avltree<Key, Value, Compare, Augment>::searchinterleaved(
+   const Key *keys, size_t count, const Value **out)
+   const
+// asynchronous memory access chaining: a fixed set of lookups in
+//    flight, each advanced one level per turn after prefetching the
+//    node it will look at on its next turn
+// a lookup that finishes hands its slot to the next key in the
+//    batch, so short descents don't leave slots idle
+{
+   const size_t inflight = 16;
+   node *at[inflight];
+   size_t which[inflight];
+   size_t next = 0, active = 0, found = 0;
+
+   for (; active < inflight && next < count; active++, next++) {
+      at[active] = root;
+      which[active] = next;
+   }
+   prefetch(root);
+
+   while (active > 0) {
+      for (size_t s = 0; s < active; ) {
+         node *n = at[s];
+         const Key &k = keys[which[s]];
+         bool done = false;
+         if (!n) {
+            out[which[s]] = NULL;
+            done = true;
+         } else if (compare(k, n->key)) {
+            at[s] = n->left;
+            prefetch(n->left);
+         } else if (compare(n->key, k)) {
+            at[s] = n->right;
+            prefetch(n->right);
+         } else {
+            out[which[s]] = &n->data;
+            found++;
+            done = true;
+         }
+         if (!done) {
+            s++;
+         } else if (next < count) {
+            at[s] = root;
+            which[s] = next++;
+            s++;
+         } else {
+            // no more keys: retire the slot by moving the last
+            //    active lookup into it
+            active--;
+            at[s] = at[active];
+            which[s] = which[active];
+         }
+      }
+   }
+   return found;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+size_t avltree<Key, Value, Compare, Augment>::searchmerged(
+   const Key *keys, size_t count, const Value **out) const
+// look up the ascending keys one tree level at a time: each node on
+//    the frontier splits its run of keys around its own key and passes
+//    the two halves on to its children, so a node shared by several
+//    paths is visited once
+// every child is prefetched as it joins the next frontier, so the
+//    cache misses of a whole level overlap
+{
+   struct frame {
+      node *n;
+      size_t first, last;   // the run of keys bound for n
+   };
+   auto keyless = [this](const Key &a, const Key &b) {
+      return compare(a, b);
+   };
+   vector<frame> level, nextlevel;
+   level.reserve(count);
+   nextlevel.reserve(count);
+   frame top = { root, 0, count };
+   if (count) level.push_back(top);
+   prefetch(root);
+
+   size_t found = 0;
+   while (!level.empty()) {
+      nextlevel.clear();
+      for (size_t i = 0; i < level.size(); i++) {
+         const frame &f = level[i];
+         if (!f.n) {
+            fill(out + f.first, out + f.last, (const Value*)NULL);
+            continue;
+         }
+         size_t low = std::lower_bound(keys + f.first, keys + f.last,
+                                       f.n->key, keyless) - keys;
+         size_t high = std::upper_bound(keys + low, keys + f.last,
+                                        f.n->key, keyless) - keys;
+         fill(out + low, out + high, &f.n->data);
+         found += high - low;
+         if (low > f.first) {
+            frame l = { f.n->left, f.first, low };
+            nextlevel.push_back(l);
+            prefetch(f.n->left);
+         }
+         if (high < f.last) {
+            frame r = { f.n->right, high, f.last };
+            nextlevel.push_back(r);
+            prefetch(f.n->right);
+         }
+      }
+      level.swap(nextlevel);
+   }
+   return found;
 }
 
-void avltree::deallocate(node* &n)
-// delete all nodes in the subtree rooted at n,
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::deallocate(node* &n)
+// destroy all nodes in the subtree rooted at n,
 //    and set n to null
+// the node storage is not returned to the pool one node at a time,
+//    the caller releases the whole pool afterwards
 {
    if (!n) return;
    deallocate(n->left);
    deallocate(n->right);
-   delete n;
+   n->~node();
    n = NULL;
 }
 
-avltree::node *avltree::findsmallest(node *n)
-// in the subtree rooted at n,
-//    find the node with the smallest key value
-// (i.e. go as far left as possible)
+template <class Key, class Value, class Compare, class Augment>
+template <class K, class... Args>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::newnode(K &&k, Args&&... args)
+// create a new leaf node in storage from the pool, constructing
+//    its key from k and its data from args directly in the node
+// returns null if no memory is available
 {
-   if (!n) return NULL;
-   while (n->left) n = n->left;
+   void *mem = pool->allocate();
+   if (!mem) return NULL;
+   AVLSTAT(avlcounters::bump(counters.allocations);)
+   node *n = new (mem) node(std::forward<K>(k), std::forward<Args>(args)...);
+   n->left = NULL;
+   n->right = NULL;
+   n->height = 0;
+   n->balance = 0;
+   n->size = 1;
+   augment(n);
    return n;
 }
 
-bool avltree::insert(string k, string d, node* &n)
-// insert a new node in the binary search tree rooted at n,
-// returning true if successful, false otherwise
-//
-// after a successful insertion below n,
-//    checkrotation is called to determine if the
-//    subtree rooted at n is unbalanced,
-//    and to perform any reconstruction necessary
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::freenode(node *n)
+// destroy node n and put its storage back on the pool's free list
 {
-   // if we've found the end of a chain,
-   //    insert the node here
-   if (!n) {
-      n = new node;
-      if (!n) return false;
-      n->data = d;
-      n->key = k;
-      n->left = NULL;
-      n->right = NULL;
-      n->height = 0;
-      n->balance = 0;
-      return true;
-   }
-
-   // call the insert routine recursively on either
-   //      the left or right subtree,
-   // checking for and performing rotations if it
-   //      was successful
-   if (n->key > k) {
-      if (insert(k, d, n->left)) {
-         checkrotation(n->left);
-         return true;
-      }
-   } else {
-      if (insert(k, d, n->right)) {
-         checkrotation(n->right);
-         return true;
-      }
-   }
-
-   // if we get here then the recursive insert
-   //    was unsuccessful
-   return false;
+   AVLSTAT(avlcounters::bump(counters.frees);)
+   n->~node();
+   pool->deallocate(n);
 }
 
-bool avltree::remove(string k, node* &n)
-// if the subtree rooted at n contains a node whose key
-//    matches k then remove it from the subtree,
-//    then check for any necessary reconstruction of the tree
-// return true if an element is successfully removed,
-//     or false otherwise
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::freetree(node* &n)
+// destroy all nodes in the subtree rooted at n, putting each one
+//    back on the pool's free list, and set n to null
 {
-   // if n is an empty tree then give up
-   if (!n) return false;
+   if (!n) return;
+   freetree(n->left);
+   freetree(n->right);
+   freenode(n);
+   n = NULL;
+}
 
-   // if the matching node must be somewhere in the left subtree
-   //    then make a recursive call and check for any needed rotation
-   if (n->key > k) {
-      if (remove(k, n->left)) {
-         checkrotation(n->left);
-         return true;
-      } 
-   } 
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::copytree(const node *n)
+// make a copy of the subtree rooted at n, with nodes from our pool
+// returns null if memory runs out, having freed whatever it copied
+{
+   if (!n) return NULL;
+   node *c = newnode(n->key, n->data);
+   if (!c) return NULL;
+   c->left = copytree(n->left);
+   c->right = copytree(n->right);
+   if ((n->left && !c->left) || (n->right && !c->right)) {
+      freetree(c);
+      return NULL;
+   }
+   c->height = n->height;
+   c->balance = n->balance;
+   c->size = n->size;
+   augment(c);
+   return c;
+}
 
-   // if the matching node must be somewhere in the right subtree
-   //    then make a recursive call and check for any needed rotation
-   else if (n->key < k) {
-      if (remove(k, n->right)) {
-         checkrotation(n->right);
-         return true;
-      }
-   } 
+template <class Key, class Value, class Compare, class Augment>
+template <class K>
+bool avltree<Key, Value, Compare, Augment>::removekey(const K &k)
+// iteratively find the node whose key matches k and unlink it,
+//    keeping the path from the root on a stack
+// a node with two children is replaced by its successor node itself,
+//    relinked into its place, so no key or value is copied and every
+//    other entry stays where it is
+// then rebalance back up the path, but only while subtree heights
+//    keep changing; above that only the subtree sizes need fixing
+// returns true if an entry was removed, false if k wasn't found
+{
+   node *path[maxdepth];
+   bool right[maxdepth];      // which way the path left path[i]
+   int depth = 0;
 
-   // if the current node is the one that must be removed,
-   //    base the handling on how many children the node has
-   else {
-      // remember which node we'll actually delete
-      node *victim = n;
+   node *n = root;
+   while (n) {
+      if (compare(k, n->key)) right[depth] = false;
+      else if (compare(n->key, k)) right[depth] = true;
+      else break;
+      path[depth++] = n;
+      n = right[depth - 1] ? n->right : n->left;
+   }
+   if (!n) {
+      AVLSTAT(avlcounters::path(counters.removepaths, depth);)
+      return false;
+   }
 
-      // if the node has no children we can simply delete it
-      if ((!n->left) && (!n->right)) {
-         delete n;
-         n = NULL;
-         return true;
-      } 
+   // the link that points at path[i] (or, at i == depth, at the node
+   //    being unlinked)
+   auto linkto = [&](int i) -> node*& {
+      if (i == 0) return root;
+      return right[i - 1] ? path[i - 1]->right : path[i - 1]->left;
+   };
 
-      // if the node has just a right child then we can
-      //    bypass n (i.e. make the pointer to n point
-      //    to its right child instead)
-      else if (!n->left) {
-         n = n->right;
-         delete victim;
-         return true;
+   node *victim = n;
+   if (victim->left && victim->right) {
+      // walk to the successor, then put it where the victim was: it
+      //    inherits the victim's children and (until it is rebalanced)
+      //    the victim's height, so the climb can tell what changed
+      int at = depth;
+      path[depth] = victim;
+      right[depth++] = true;
+      node *succ = victim->right;
+      while (succ->left) {
+         path[depth] = succ;
+         right[depth++] = false;
+         succ = succ->left;
       }
+      linkto(depth) = succ->right;
+      succ->left = victim->left;
+      succ->right = victim->right;
+      succ->height = victim->height;
+      succ->balance = victim->balance;
+      succ->size = victim->size;
+      linkto(at) = succ;
+      path[at] = succ;
+   } else {
+      linkto(depth) = victim->left ? victim->left : victim->right;
+   }
+   AVLSTAT(avlcounters::path(counters.removepaths, depth + 1);)
+   freenode(victim);
 
-      // if the node has just a left child then we can
-      //    bypass n (i.e. make the pointer to n point
-      //    to its left child instead)
-      else if (!n->right) {
-         n = n->left;
-         delete victim;
-         return true;
-      } 
-
-      // if the node has two children then we'll replace the
-      //    node with the smallest node from the right subtree
-      //    (basically copying the other node's key/data values
-      //     over top of n's)
-      // then make a recursive call to remove the duplicate
-      //    element from the right subtree,
-      //    remembering to check for necessary rotation
-      //    once we've altered n's subtrees
-      else {
-         victim = findsmallest(n->right);
-         if (!victim) return false;
-         string vkey = victim->key;
-         string vdata = victim->data;
-         if (!remove(victim->key, n->right)) return false;
-         n->key = vkey;
-         n->data = vdata;
-         checkrotation(n);
-         return true;
+   int i = depth - 1;
+   for (; i >= 0; i--) {
+      node *&link = linkto(i);
+      int before = link->height;
+      checkrotation(link);
+      if (link->height == before) {
+         i--;
+         break;
       }
    }
-   return false;
+   // heights above here are unchanged, each subtree just lost a node
+   //    (and needs its aggregate redone, if there is one)
+   for (; i >= 0; i--) {
+      path[i]->size--;
+      augment(path[i]);
+   }
+   return true;
 }
 
-void avltree::print(node *n)
-// display the key/data contents of the subtree rooted at n,
-// sorted (ascending) by key value
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::display() const
+// display the key/data contents of the tree,
+// sorted (ascending) by key value, flushing once at the end
 {
-   if (!n) return;
-   print(n->left);
-   cout << n->key << ":" << n->data << endl;
-   print(n->right);
+   for (const_iterator it = begin(); it != end(); ++it)
+      cout << it.key() << ":" << it.value() << '\n';
+   cout.flush();
 }
 
-void avltree::debugprint(node *n)
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::debugprint(node *n)
 // display the contents and structure of the subtree rooted at n,
 // performed via preorder traversal
 {
@@ -220,7 +380,8 @@ void avltree::debugprint(node *n)
    debugprint(n->right);
 }
 
-void avltree::rotateleft(node* &n)
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::rotateleft(node* &n)
 // rotates n's right child up, and n down to the left
 //   BEFORE               AFTER
 //      N                   Y
@@ -240,7 +401,8 @@ void avltree::rotateleft(node* &n)
    updateheight(n);       // Y's height has probably changed
 }
 
-void avltree::rotateright(node* &n)
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::rotateright(node* &n)
 // rotates n's left child up, and n down to the right
 //   BEFORE               AFTER
 //      N                   X
@@ -260,7 +422,8 @@ void avltree::rotateright(node* &n)
    updateheight(n);       // X's height has probably changed
 }
 
-void avltree::checkrotation(node* &n)
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::checkrotation(node* &n)
 // determine if the subtree rooted at n has become unbalanced
 // (i.e. the height difference between the left and right 
 //   subtrees of n is more than 1)
@@ -274,42 +437,39 @@ void avltree::checkrotation(node* &n)
 
 
    // quit if n is balanced (i.e. if the left and right
-   //      subtree heights are exactly the same or there are no children
-   if (n->balance == 0)
+   //      subtree heights differ by at most one)
+   if ((n->balance >= -1) && (n->balance <= 1))
       return;
 
-   // if n and it's right subtree are both positively
-   //    balanced then do one left rotation on n
-   if ((n->balance > 0) && (n->right->balance > 0))
+   // if n is right heavy, rotate its right child up
+   //    (doing one right rotation on that child first if the child
+   //     is left heavy, i.e. a double rotation)
+   if (n->balance > 1) {
+      if (n->right->balance < 0) {
+         rotateright(n->right);
+         AVLSTAT(avlcounters::bump(counters.rotaterightleft);)
+      } else {
+         AVLSTAT(avlcounters::bump(counters.rotateleft);)
+      }
       rotateleft(n);
-
-   // if n and it's left subtree are both negatively
-   //    balanced then do one right rotation on n
-   else if ((n->balance < 0) && (n->left->balance < 0))
-      rotateright(n);
-
-   // if n is negatively balanced 
-   //    and it's left child is positively balanced
-   // then do two rotations:
-   //    do one left rotation on n's left child
-   //    then one right rotation on n
-   else if ((n->balance < 0) && (n->left->balance > 0)){
-      rotateleft(n->left);
-      rotateright(n);
    }
 
-   // if n is positively balanced
-   //    and it's right child is negatively balanced
-   // then do two rotations
-   //    do one right rotation on n's right child
-   //    then one left rotation on n
-   else if ((n->balance > 0) && (n->right->balance < 0)) {
-      rotateright(n->right);
-      rotateleft(n);
+   // if n is left heavy, rotate its left child up
+   //    (doing one left rotation on that child first if the child
+   //     is right heavy, i.e. a double rotation)
+   else {
+      if (n->left->balance > 0) {
+         rotateleft(n->left);
+         AVLSTAT(avlcounters::bump(counters.rotateleftright);)
+      } else {
+         AVLSTAT(avlcounters::bump(counters.rotateright);)
+      }
+      rotateright(n);
    }
 }
 
-bool avltree::checkvalid() 
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::checkvalid()
 //helper function which calls the treetest method if there is
 //at least one node in the tree.
 {
@@ -317,27 +477,29 @@ bool avltree::checkvalid()
       cout << "No nodes in tree...\n";
       return false;
    }
-   return treetest(root,"","");
+   return treetest(root,NULL,NULL);
 }
 
-bool avltree::treetest(node *n, string low, string high) 
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::treetest(
+   node *n, const Key *low, const Key *high)
 //Checks to see if the avltree is currently a valid binary search 
 //tree and no node has a subtree whose height differs by more than 1.
 //returns true if the structure of the tree is correct otherwise returns 
 //false.
 //NOTE: assumes there is at least one node in the tree
-//if there is no low or high value, the empty string is passed.
+//if there is no low or high value, null is passed.
 {
    //check that keys adhere to the bounds set by low and high
-   if ( (low != "") && (n->key < low) ) { 
+   if ( (low != NULL) && compare(n->key, *low) ) { 
       //if the current nodes key is too small
       cerr << "Error at node with key: " << n->key 
-           << ", key smaller than lowest allowable (" << low << ").\n";
+           << ", key smaller than lowest allowable (" << *low << ").\n";
       return false;
-   } else if ( (high != "") && (n->key > high) ) { 
+   } else if ( (high != NULL) && compare(*high, n->key) ) { 
       //if the currentnodes key is too big
       cerr << "Error at node with key: " << n->key 
-           << ", key bigger than biggest allowable (" << high << ").\n";
+           << ", key bigger than biggest allowable (" << *high << ").\n";
       return false;
    }//done checking key bounds
 
@@ -364,8 +526,8 @@ bool avltree::treetest(node *n, string low, string high)
          return false;
 
       } else //heights are ok, check both children
-         return ( treetest(n->left,low,n->key) && 
-                  treetest(n->right,n->key,high) );
+         return ( treetest(n->left,low,&n->key) && 
+                  treetest(n->right,&n->key,high) );
 
    } else if (n->left != NULL) {
       if (n->left->height  > 0) { //left subtree too big
@@ -375,7 +537,7 @@ bool avltree::treetest(node *n, string low, string high)
               << "'s height is >0 when there is no right subtree.\n";         
          return false;
       } else //heights are ok, check left child      
-         return treetest(n->left,low,n->key);
+         return treetest(n->left,low,&n->key);
    } else if (n->right != NULL) {
       if (n->right->height  > 0) { //left subtree too big
          cerr << "Error at node with key " << n->key 
@@ -384,86 +546,897 @@ bool avltree::treetest(node *n, string low, string high)
               << "'s height is >0 when there is no left subtree.\n";         
          return false;
       } else //heights are ok, check left child      
-          return treetest(n->right,n->key,high);
+          return treetest(n->right,&n->key,high);
    }
    //otherwise the node n does not have a subtree we need to check
    return true; 
 }
 
-bool avltree::insert(string k, string d)
-//Iteratively goes through the list to find the correct place to insert
-//a new node with the passed string k as its key and the passed string 
-//d as its data.  Once the correct place is found, it inserts the node
-//and traverses back up updating the height of any node affected and
-//checking if a rotation is needed on any of the affected nodes.
+template <class Key, class Value, class Compare, class Augment>
+template <class K, class... Args>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::insertunique(bool &inserted, K &&k,
+                                                    Args&&... args)
+//Iteratively goes down the tree to find the correct place to insert
+//a new node with the passed k as its key, keeping the path on a stack,
+//and constructs its data in place from args.  Once the node is placed,
+//it goes back up the path rebalancing only as long as subtree heights
+//keep growing: once a subtree's height is unchanged (or a rotation has
+//restored it) nothing above can need a rotation, and the remaining
+//ancestors only have their subtree sizes bumped.
+//If a node with key k already exists, nothing is constructed or changed,
+//and that node is returned with inserted set to false.
+//Returns null if the new node could not be allocated.
 {
-   
-   node *itrnode = root;
-   node *prevnode = NULL;
+   inserted = false;
+   node *path[maxdepth];
+   bool right[maxdepth];      //which way the path left path[i]
+   int depth = 0;
 
    //find the correct place to insert the new node
+   node *itrnode = root;
    while (itrnode != NULL){
-      //if the new key is smaller than itrnode's key go left
-      if (itrnode->key > k){ 
-         prevnode = itrnode;
-         itrnode = itrnode->left;
-         if (itrnode)
-            itrnode->lastvisit = prevnode; //update last visited node
-      } else { 
-         //go right
-         prevnode = itrnode;
-         itrnode = itrnode->right;
-         if (itrnode)
-            itrnode->lastvisit = prevnode; //update last visited node
-      }      
-   } //found the correct place to insert a new node
-   itrnode = prevnode;
-  
-   //create the new node
-   node *n = new node;
-   if (!n) return false;
-   n->data = d;
-   n->key = k;
-   n->left = NULL;
-   n->right = NULL;
-   n->height = 0;
-   n->balance = 0;
-   n->lastvisit = NULL;
+      if (compare(k, itrnode->key)) right[depth] = false;
+      else if (compare(itrnode->key, k)) right[depth] = true;
+      else {
+         //the key is already in the tree
+         AVLSTAT(avlcounters::path(counters.insertpaths, depth + 1);)
+         return itrnode;
+      }
+      path[depth++] = itrnode;
+      itrnode = right[depth - 1] ? itrnode->right : itrnode->left;
+   }
+   AVLSTAT(avlcounters::path(counters.insertpaths, depth);)
 
-   //place the new node in tree
-   if (root == NULL){
-      root = n;
+   //create the new node, after which k may have been moved from
+   node *n = newnode(std::forward<K>(k), std::forward<Args>(args)...);
+   if (!n) return NULL;
+   inserted = true;
+
+   //the link that points at path[i] (or, at i == depth, at the new node)
+   auto linkto = [&](int i) -> node*& {
+      if (i == 0) return root;
+      return right[i - 1] ? path[i - 1]->right : path[i - 1]->left;
+   };
+   linkto(depth) = n;
+
+   //climb while the subtree below keeps getting taller
+   int i = depth - 1;
+   for (; i >= 0; i--) {
+      node *&link = linkto(i);
+      int before = link->height;
+      checkrotation(link);
+      if (link->height == before) {
+         i--;
+         break;
+      }
+   }
+   //heights above here are unchanged, each subtree just gained a node
+   //(and needs its aggregate redone, if there is one)
+   for (; i >= 0; i--) {
+      path[i]->size++;
+      augment(path[i]);
+   }
+
+   return n;
+}
+
+
+template <class Key, class Value, class Compare, class Augment>
+template <class It>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::buildsorted(It &it, size_t count)
+// build a perfectly balanced subtree from the next count elements
+//    of the sorted sequence at it, advancing it past them
+// the middle element becomes the root, so the two halves differ by
+//    at most one node and no rotation is ever needed
+// returns null if memory runs out, having freed whatever it built
+{
+   if (count == 0) return NULL;
+
+   size_t leftcount = (count - 1) / 2;
+   node *left = buildsorted(it, leftcount);
+   if ((leftcount > 0) && !left) return NULL;
+
+   // (*it) rather than it->, so that move iterators really move
+   node *n = newnode((*it).first, (*it).second);
+   if (!n) {
+      freetree(left);
+      return NULL;
+   }
+   ++it;
+
+   size_t rightcount = count - 1 - leftcount;
+   node *right = buildsorted(it, rightcount);
+   if ((rightcount > 0) && !right) {
+      freetree(left);
+      freenode(n);
+      return NULL;
+   }
+
+   n->left = left;
+   n->right = right;
+   updateheight(n);
+   return n;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class It>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::buildparallel(
+   It first, void **slots, size_t count, unsigned threads)
+// build a perfectly balanced subtree from the count sorted elements
+//    at first, constructing element i in the preallocated slots[i]
+// the split is the same one buildsorted makes, and while more than
+//    one thread is available the two halves are built concurrently
+//    (since no pool calls are made here, the threads share nothing)
+{
+   if (count == 0) return NULL;
+
+   size_t leftcount = (count - 1) / 2;
+   size_t rightcount = count - 1 - leftcount;
+   node *n = new (slots[leftcount])
+      node((*(first + leftcount)).first, (*(first + leftcount)).second);
+
+   // below this size a thread costs more than it saves
+   const size_t serialcutoff = 1 << 14;
+   bool fork = (threads > 1) && (count > serialcutoff);
+   unsigned lthreads = threads / 2;
+   node *left, *right;
+   parallel_invoke(fork,
+      [&]() { left = buildparallel(first, slots, leftcount, lthreads); },
+      [&]() { right = buildparallel(first + (leftcount + 1),
+                                    slots + (leftcount + 1), rightcount,
+                                    threads - lthreads); });
+
+   n->left = left;
+   n->right = right;
+   updateheight(n);
+   return n;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class It>
+bool avltree<Key, Value, Compare, Augment>::buildrange(
+   It first, size_t count, unsigned threads, random_access_iterator_tag)
+//builds the tree from count sorted elements, in parallel if requested
+{
+   if (threads == 0) threads = defaultthreads();
+   if (threads == 1) return buildrange(first, count, 1, forward_iterator_tag());
+
+   //the pool isn't thread safe, so take all the storage up front
+   vector<void*> slots(count);
+   for (size_t i = 0; i < count; i++) {
+      slots[i] = pool->allocate();
+      if (!slots[i]) {
+         while (i > 0) pool->deallocate(slots[--i]);
+         return false;
+      }
+   }
+   root = buildparallel(first, slots.data(), count, threads);
+   AVLSTAT(avlcounters::bump(counters.allocations, count);)
+   return true;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class It>
+bool avltree<Key, Value, Compare, Augment>::buildrange(It first, size_t count,
+                                                       unsigned,
+                                                       forward_iterator_tag)
+//builds the tree from count sorted elements on the calling thread
+{
+   root = buildsorted(first, count);
+   return (count == 0) || (root != NULL);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class It>
+bool avltree<Key, Value, Compare, Augment>::build_from_sorted(It first, It last,
+                                                              unsigned threads)
+//checks that the range is strictly increasing, then replaces the tree
+//with a balanced tree built directly from it
+{
+   size_t count = 0;
+   for (It prev = first, cur = first; cur != last; prev = cur, ++cur) {
+      if ((count > 0) && !compare((*prev).first, (*cur).first))
+         return false; //out of order or duplicate key
+      count++;
+   }
+
+   //recycle the current nodes so the build can reuse them
+   freetree(root);
+   return buildrange(first, count, threads,
+                     typename iterator_traits<It>::iterator_category());
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class It>
+bool avltree<Key, Value, Compare, Augment>::build_from_unsorted(
+   It first, It last, unsigned threads)
+//sorts a copy of the range by key, drops repeated keys (keeping the
+//first occurrence of each), then builds the tree from the result
+{
+   typedef pair<Key, Value> entry;
+   vector<entry> sorted(first, last);
+   if (threads == 0) threads = defaultthreads();
+   parallel_stable_sort(sorted.begin(), sorted.end(),
+                        [this](const entry &a, const entry &b) {
+                           return compare(a.first, b.first);
+                        }, threads);
+   typename vector<entry>::iterator end =
+      unique(sorted.begin(), sorted.end(),
+             [this](const entry &a, const entry &b) {
+                return !compare(a.first, b.first);
+             });
+   return build_from_sorted(make_move_iterator(sorted.begin()),
+                            make_move_iterator(end), threads);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::join(node *l, node *k, node *r)
+// join the AVL trees l and r using the single node k, where every
+//    key in l is smaller than k's key and every key in r is larger
+// walk down the spine of the taller tree to a subtree of about the
+//    height of the other one, hang k there, and rebalance on the way
+//    back up: O(difference in heights) work
+// returns the root of the joined tree
+{
+   if (height(l) > height(r) + 1) {
+      l->right = join(l->right, k, r);
+      checkrotation(l);
+      return l;
+   }
+   if (height(r) > height(l) + 1) {
+      r->left = join(l, k, r->left);
+      checkrotation(r);
+      return r;
+   }
+   k->left = l;
+   k->right = r;
+   updateheight(k);
+   return k;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::splitlast(node *n, node* &rest)
+// detach the node with the largest key from the (non-empty) subtree
+//    rooted at n, setting rest to the balanced remainder
+// returns the detached node
+{
+   if (!n->right) {
+      rest = n->left;
+      n->left = NULL;
+      updateheight(n);
+      return n;
+   }
+   node *right;
+   node *last = splitlast(n->right, right);
+   rest = join(n->left, n, right);
+   return last;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::join2(node *l, node *r)
+// join l and r (every key in l smaller than every key in r)
+//    without a separating node, by borrowing l's largest node
+{
+   if (!l) return r;
+   node *rest;
+   node *k = splitlast(l, rest);
+   return join(rest, k, r);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class K>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::split(
+   node *n, const K &k, node* &l, node* &r)
+// split the subtree rooted at n into l, holding the keys less than k,
+//    and r, holding the keys greater than k
+// returns the detached node whose key matches k, or null if none does
+// the pieces are put back together with join on the way up,
+//    which makes the whole split O(log n)
+{
+   if (!n) {
+      l = r = NULL;
+      return NULL;
+   }
+   node *left = n->left, *right = n->right;
+   node *found;
+   if (compare(k, n->key)) {
+      node *rl;
+      found = split(left, k, l, rl);
+      r = join(rl, n, right);
+   } else if (compare(n->key, k)) {
+      node *lr;
+      found = split(right, k, lr, r);
+      l = join(left, n, lr);
+   } else {
+      l = left;
+      r = right;
+      n->left = n->right = NULL;
+      updateheight(n);
+      found = n;
+   }
+   return found;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::unite(
+   node *a, node *b, vector<node*> &garbage, unsigned threads)
+// union of the subtrees a and b, keeping a's node when a key is in both
+// b is split around a's root, the two halves are united recursively
+//    (concurrently while threads remain) and joined back with a's root
+// nodes that drop out are added to garbage rather than freed, since
+//    the pool must not be touched from several threads at once
+{
+   if (!a) return b;
+   if (!b) return a;
+
+   node *bl, *br;
+   node *dup = split(b, a->key, bl, br);
+   if (dup) garbage.push_back(dup);
+
+   node *al = a->left, *ar = a->right;
+   node *l, *r;
+   // only worth a thread above a few thousand nodes
+   bool fork = (threads > 1) && (height(a) > 12);
+   unsigned lthreads = threads / 2;
+   vector<node*> rgarbage;
+   parallel_invoke(fork,
+      [&]() { l = unite(al, bl, garbage, lthreads); },
+      [&]() { r = unite(ar, br, rgarbage, threads - lthreads); });
+   garbage.insert(garbage.end(), rgarbage.begin(), rgarbage.end());
+   return join(l, a, r);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::intersect(node *a, node *b,
+                                                 vector<node*> &garbage,
+                                                 unsigned threads)
+// intersection of the subtrees a and b, keeping a's nodes
+// works like unite, except a's root survives only if its key was
+//    found in b, and whole subtrees without a partner become garbage
+{
+   if (!a || !b) {
+      if (a) garbage.push_back(a);
+      if (b) garbage.push_back(b);
+      return NULL;
+   }
+
+   node *bl, *br;
+   node *dup = split(b, a->key, bl, br);
+
+   node *al = a->left, *ar = a->right;
+   a->left = a->right = NULL;
+   node *l, *r;
+   bool fork = (threads > 1) && (height(a) > 12);
+   unsigned lthreads = threads / 2;
+   vector<node*> rgarbage;
+   parallel_invoke(fork,
+      [&]() { l = intersect(al, bl, garbage, lthreads); },
+      [&]() { r = intersect(ar, br, rgarbage, threads - lthreads); });
+   garbage.insert(garbage.end(), rgarbage.begin(), rgarbage.end());
+
+   if (dup) {
+      garbage.push_back(dup);
+      return join(l, a, r);
+   }
+   garbage.push_back(a);
+   return join2(l, r);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::subtract(node *a, node *b,
+                                                vector<node*> &garbage,
+                                                unsigned threads)
+// the subtree a with every key of the subtree b removed
+// here a is split around b's root instead, and b's nodes all
+//    become garbage
+{
+   if (!a || !b) {
+      if (b) garbage.push_back(b);
+      return a;
+   }
+
+   node *al, *ar;
+   node *dup = split(a, b->key, al, ar);
+   if (dup) garbage.push_back(dup);
+
+   node *bl = b->left, *br = b->right;
+   b->left = b->right = NULL;
+   garbage.push_back(b);
+   node *l, *r;
+   bool fork = (threads > 1) && (height(b) > 12);
+   unsigned lthreads = threads / 2;
+   vector<node*> rgarbage;
+   parallel_invoke(fork,
+      [&]() { l = subtract(al, bl, garbage, lthreads); },
+      [&]() { r = subtract(ar, br, rgarbage, threads - lthreads); });
+   garbage.insert(garbage.end(), rgarbage.begin(), rgarbage.end());
+   return join2(l, r);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::buildchanges(const change **first,
+                                                    size_t count, void **&slots)
+// build a perfectly balanced subtree from the count upserts at first
+//    (sorted, with distinct keys), like buildsorted, constructing the
+//    nodes in the preallocated slots
+{
+   if (count == 0) return NULL;
+   size_t leftcount = (count - 1) / 2;
+   node *left = buildchanges(first, leftcount, slots);
+   const change *c = first[leftcount];
+   node *n = new (*slots++) node(c->key, c->data);
+   n->left = left;
+   n->right = buildchanges(first + leftcount + 1, count - 1 - leftcount,
+                           slots);
+   updateheight(n);
+   return n;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::applychanges(
+   node *n, const change **first, const change **last, void **&slots)
+// apply the sorted, distinct-keyed changes [first, last) to the
+//    subtree rooted at n and return its new root
+// the changes are divided around n's key and applied to each side,
+//    then the sides are joined back around n, or without it if n's
+//    key is removed; join is O(1) when the sides still have about
+//    the same height, so only paths the batch unbalanced cost more
+{
+   if (first == last) return n;
+   if (!n) {
+      // removes of absent keys have nothing to do
+      last = remove_if(first, last,
+                       [](const change *c) { return c->op == change::erase; });
+      return buildchanges(first, last - first, slots);
+   }
+
+   const change **mid = first, **after;
+   for (size_t count = last - first; count > 0; ) {
+      size_t half = count / 2;
+      if (compare(mid[half]->key, n->key)) {
+         mid += half + 1;
+         count -= half + 1;
+      } else {
+         count = half;
+      }
+   }
+   after = mid;
+   if ((mid != last) && !compare(n->key, (*mid)->key)) after++;
+
+   node *l = applychanges(n->left, first, mid, slots);
+   node *r = applychanges(n->right, after, last, slots);
+   if (after != mid) {
+      if ((*mid)->op == change::erase) {
+         freenode(n);
+         return join2(l, r);
+      }
+      n->data = (*mid)->data;
+   }
+   return join(l, n, r);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::apply_batch(
+   const vector<change> &ops)
+//orders the batch, reserves a node for every upsert, and merges the
+//batch into the tree; unused nodes go back to the pool
+{
+   vector<const change*> order(ops.size());
+   for (size_t i = 0; i < ops.size(); i++) order[i] = &ops[i];
+   stable_sort(order.begin(), order.end(),
+               [this](const change *a, const change *b) {
+                  return compare(a->key, b->key);
+               });
+
+   // keep only the last change to each key
+   size_t kept = 0, upserts = 0;
+   for (size_t i = 0; i < order.size(); i++) {
+      if ((i + 1 < order.size()) && !compare(order[i]->key, order[i + 1]->key))
+         continue;
+      order[kept++] = order[i];
+      if (order[i]->op == change::upsert) upserts++;
+   }
+   order.resize(kept);
+
+   vector<void*> slots(upserts);
+   for (size_t i = 0; i < upserts; i++) {
+      slots[i] = pool->allocate();
+      if (!slots[i]) {
+         while (i > 0) pool->deallocate(slots[--i]);
+         return false;
+      }
+   }
+
+   void **next = slots.data();
+   if (kept > 0) root = applychanges(root, &order[0], &order[0] + kept, next);
+   AVLSTAT(avlcounters::bump(counters.allocations, next - slots.data());)
+   for (void **s = next; s != slots.data() + upserts; s++)
+      pool->deallocate(*s);
+   return true;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::save(const string &path) const
+//writes the header, then the records and then the blobs, each in
+//preorder; the subtree sizes give every record's child indices up
+//front, so two passes over the tree are enough
+//records hold lengths and links in 32 bits, so a tree with an entry
+//whose key or value encodes to more than that, or with too many
+//entries to link, can't be saved
+{
+   static_assert(is_same<Compare, less<Key> >::value,
+                 "images are searched in less<Key> order");
+   if (size() >= 0xffffffffULL) return false;
+   string temp = path + ".tmp";
+   FILE *f = fopen(temp.c_str(), "wb");
+   if (!f) return false;
+
+   avlimageheader h;
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, avlimagemagic, sizeof(h.magic));
+   h.version = avlimageversion;
+   h.byteorder = avlimagebyteorder;
+   h.count = size();
+   h.recordsoffset = sizeof(h);
+   h.blobsoffset = h.recordsoffset + h.count * sizeof(avlimagerecord);
+   h.checksum = avlfnv(NULL, 0);
+
+   // the header is rewritten once the checksum is known
+   bool ok = (fwrite(&h, sizeof(h), 1, f) == 1);
+   string bytes;
+   vector<node*> stack;
+   for (int pass = 0; (pass < 2) && ok; pass++) {
+      uint64_t index = 0;
+      if (root) stack.push_back(root);
+      while (!stack.empty() && ok) {
+         node *n = stack.back();
+         stack.pop_back();
+         if (n->right) stack.push_back(n->right);
+         if (n->left) stack.push_back(n->left);
+
+         bytes.clear();
+         avlcodec<Key>::encode(n->key, bytes);
+         size_t keybytes = bytes.size();
+         avlcodec<Value>::encode(n->data, bytes);
+         if (pass == 1) {
+            h.checksum = avlfnv(bytes.data(), bytes.size(), h.checksum);
+            ok = (fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size());
+            continue;
+         }
+
+         if ((keybytes > 0xffffffffULL) ||
+             (bytes.size() - keybytes > 0xffffffffULL)) {
+            ok = false;
+            break;
+         }
+         avlimagerecord r;
+         r.blob = h.blobbytes;
+         r.keybytes = keybytes;
+         r.valuebytes = bytes.size() - keybytes;
+         r.left = n->left ? index + 2 : 0;
+         r.right = n->right ? index + 2 + subtreesize(n->left) : 0;
+         r.height = n->height;
+         r.balance = n->balance;
+         h.blobbytes += bytes.size();
+         h.checksum = avlfnv(&r, sizeof(r), h.checksum);
+         ok = (fwrite(&r, sizeof(r), 1, f) == 1);
+         index++;
+      }
+   }
+
+   ok = ok && (fseek(f, 0, SEEK_SET) == 0) &&
+        (fwrite(&h, sizeof(h), 1, f) == 1) && (fflush(f) == 0) &&
+        (fsync(fileno(f)) == 0);
+   ok = (fclose(f) == 0) && ok;
+   ok = ok && (rename(temp.c_str(), path.c_str()) == 0);
+   if (!ok) {
+      std::remove(temp.c_str());
+      return false;
+   }
+   // the rename itself is only durable once the directory is synced
+   return avlsyncdirectory(path);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::freegarbage(vector<node*> &garbage)
+// free every subtree listed in garbage
+{
+   for (size_t i = 0; i < garbage.size(); i++) freetree(garbage[i]);
+   garbage.clear();
+}
+
+template <class Key, class Value, class Compare, class Augment>
+typename avltree<Key, Value, Compare, Augment>::node *
+avltree<Key, Value, Compare, Augment>::takenodes(avltree &other, bool &ok)
+// detach all of other's nodes, making sure they belong to our pool:
+//    if the pools differ, other's slabs are taken over when nobody
+//    else uses other's pool and both draw from the same slab
+//    allocator, otherwise the nodes are copied into our pool
+// returns the root of the detached tree; on failure ok is false and
+//    other is left as it was
+{
+   ok = true;
+   node *n = other.root;
+   if (pool != other.pool) {
+      if ((other.pool.use_count() > 1) || !pool->merge(*other.pool)) {
+         n = copytree(other.root);
+         if (other.root && !n) {
+            ok = false;
+            return NULL;
+         }
+         other.freetree(other.root);
+      }
+   }
+   other.root = NULL;
+   return n;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+void avltree<Key, Value, Compare, Augment>::split(
+   const Key &k, avltree &greater)
+//splits off the entries above k into greater, which takes over
+//our pool so the nodes can move as they are
+{
+   if (&greater == this) return;
+   greater.clear();
+   greater.pool = pool;
+   node *l, *r;
+   node *mid = split(root, k, l, r);
+   if (mid) l = join(l, mid, NULL);
+   root = l;
+   greater.root = r;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::join(avltree &greater)
+//appends greater's entries, which must all be above ours
+{
+   if ((&greater == this) || !greater.root) return true;
+   if (root) {
+      node *last = root, *first = greater.root;
+      while (last->right) last = last->right;
+      while (first->left) first = first->left;
+      if (!compare(last->key, first->key)) return false;
+   }
+   bool ok;
+   node *r = takenodes(greater, ok);
+   if (!ok) return false;
+   root = join2(root, r);
+   return true;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::unite(
+   avltree &other, unsigned threads)
+//merges other into this tree
+{
+   if (&other == this) return true;
+   bool ok;
+   node *b = takenodes(other, ok);
+   if (!ok) return false;
+   if (threads == 0) threads = defaultthreads();
+   vector<node*> garbage;
+   root = unite(root, b, garbage, threads);
+   freegarbage(garbage);
+   return true;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::intersect(
+   avltree &other, unsigned threads)
+//keeps only the entries whose keys are also in other
+{
+   if (&other == this) return true;
+   bool ok;
+   node *b = takenodes(other, ok);
+   if (!ok) return false;
+   if (threads == 0) threads = defaultthreads();
+   vector<node*> garbage;
+   root = intersect(root, b, garbage, threads);
+   freegarbage(garbage);
+   return true;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::subtract(
+   avltree &other, unsigned threads)
+//removes the entries whose keys are in other
+{
+   if (&other == this) {
+      clear();
       return true;
    }
-   if (itrnode->key > k)
-      itrnode->left = n;
-   else
-      itrnode->right = n;
-
-   node *tmp = NULL;
-
-   //iterate back up through tree and check if rotations are needed   
-   while (itrnode->lastvisit != NULL){
-      tmp = itrnode->lastvisit; //store last visited node
-      itrnode->lastvisit = NULL; //scrub record if last visited node
-      itrnode = tmp; //iterate up to last visited node
-
-      //update height and check rotation for the node we came from
-      //note: updatehight and checkrotation take a pointer by reference so
-      //we need to use the previous node's children pointers when calling.
-      if (itrnode->key > k){ //we came from the left node
-         updateheight(itrnode->left);
-         checkrotation(itrnode->left);
-      } else { //we came from the right node
-         updateheight(itrnode->right);
-         checkrotation(itrnode->right); 
+   bool ok;
+   node *b = takenodes(other, ok);
+   if (!ok) return false;
+   if (threads == 0) threads = defaultthreads();
+   vector<node*> garbage;
+   root = subtract(root, b, garbage, threads);
+   freegarbage(garbage);
+   return true;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class K>
+size_t avltree<Key, Value, Compare, Augment>::countbelow(
+   const K &k, bool inclusive)
+   const
+// the number of keys less than k (or, if inclusive, not greater than
+//    k), found by adding up the left subtree sizes of every node we
+//    pass on the right during a single descent
+{
+   size_t below = 0;
+   node *n = root;
+   while (n) {
+      bool right = inclusive ? !compare(k, n->key) : compare(n->key, k);
+      if (right) {
+         below += subtreesize(n->left) + 1;
+         n = n->right;
+      } else {
+         n = n->left;
       }
    }
-   //now we take care of updating/checking the root
-   updateheight(root);
-   checkrotation(root);
+   return below;
+}
 
-   return true;   
+template <class Key, class Value, class Compare, class Augment>
+template <class K>
+int avltree<Key, Value, Compare, Augment>::seek(const K &k, bool strict,
+                                                node **path) const
+//descend toward k, recording the path, and return the depth of the
+//first entry with a key not less than k (or, if strict, greater than
+//k); that entry is path[depth - 1], and a depth of 0 means there is
+//none
+{
+   int depth = 0, found = 0;
+   node *n = root;
+   while (n) {
+      path[depth++] = n;
+      if (strict ? compare(k, n->key) : !compare(n->key, k)) {
+         found = depth;
+         if (!strict && !compare(k, n->key)) break;
+         n = n->left;
+      } else {
+         n = n->right;
+      }
+   }
+   return found;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::select(
+   size_t i, Key &k, Value &d) const
+//finds the entry with the given (zero based) position in key order,
+//steering by the left subtree sizes
+{
+   node *n = root;
+   while (n) {
+      size_t leftsize = subtreesize(n->left);
+      if (i < leftsize) {
+         n = n->left;
+      } else if (i == leftsize) {
+         k = n->key;
+         d = n->data;
+         return true;
+      } else {
+         i -= leftsize + 1;
+         n = n->right;
+      }
+   }
+   return false;
 }
 
+template <class Key, class Value, class Compare, class Augment>
+size_t avltree<Key, Value, Compare, Augment>::count_range(const Key &lo,
+                                                          const Key &hi) const
+//counts the keys in [lo, hi] with two descents
+{
+   if (compare(hi, lo)) return 0;
+   return countbelow(hi, true) - countbelow(lo, false);
+}
 
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::percentile(double p, Key &k,
+                                                       Value &d) const
+//nearest rank percentile: the smallest entry with at least p percent
+//of the entries at or below it
+{
+   size_t n = size();
+   if (n == 0) return false;
+   if (p < 0) p = 0;
+   if (p > 100) p = 100;
+   size_t rank = (size_t)ceil(p / 100 * n);
+   return select(rank > 0 ? rank - 1 : 0, k, d);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class K>
+void avltree<Key, Value, Compare, Augment>::reaugment(const K &k)
+// redo the aggregates on the path down to k, bottom up, after its
+//    value has been replaced
+{
+   if (!augmented) return;
+   node *path[maxdepth];
+   int depth = 0;
+   for (node *n = root; n; ) {
+      path[depth++] = n;
+      if (compare(k, n->key)) n = n->left;
+      else if (compare(n->key, k)) n = n->right;
+      else break;
+   }
+   while (depth > 0) augment(path[--depth]);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::aggregate(
+   node *n, const Key *lo, const Key *hi,
+   typename Augment::type &out) const
+// the aggregate of the keys in the subtree at n from *lo to *hi (a
+//    null bound meaning none on that side); returns false if there
+//    are no such keys
+// once n is inside the range each side has a single bound, and a side
+//    without one is a whole subtree, whose aggregate is stored; so
+//    only the two boundary paths are walked, O(log n)
+{
+   while (n) {
+      if (lo && compare(n->key, *lo)) n = n->right;
+      else if (hi && compare(*hi, n->key)) n = n->left;
+      else break;
+   }
+   if (!n) return false;
+   if (!lo && !hi) {
+      out = n->aggregate;
+      return true;
+   }
+   typename Augment::type side;
+   out = Augment::make(n->key, n->data);
+   if (aggregate(n->left, lo, NULL, side))
+      out = Augment::combine(side, out);
+   if (aggregate(n->right, NULL, hi, side))
+      out = Augment::combine(out, side);
+   return true;
+}
+
+template <class Key, class Value, class Compare, class Augment>
+bool avltree<Key, Value, Compare, Augment>::aggregate(
+   const Key &lo, const Key &hi, typename Augment::type &out) const
+{
+   if (compare(hi, lo)) return false;
+   return aggregate(root, &lo, &hi, out);
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class F>
+void avltree<Key, Value, Compare, Augment>::overlapping(
+   node *n, const Key &a, const Key &b, F &fn) const
+// in order, skipping every subtree whose largest end is below a, and
+//    everything right of a start above b
+{
+   while (n && !compare(n->aggregate, a)) {
+      overlapping(n->left, a, b, fn);
+      if (compare(b, n->key)) return;
+      if (!compare(Augment::make(n->key, n->data), a)) fn(n->key, n->data);
+      n = n->right;
+   }
+}
+
+template <class Key, class Value, class Compare, class Augment>
+template <class F>
+void avltree<Key, Value, Compare, Augment>::for_each_overlapping(
+   const Key &a, const Key &b, F fn) const
+{
+   if (compare(b, a)) return;
+   overlapping(root, a, b, fn);
+}
@@ -1,63 +1,637 @@
-/* 
-CSCI 260 Assignment 2 
+/*
+CSCI 260 Assignment 2
 Submitted by: Dylan Suveges
 S#: 546853797
 */
 
 #ifndef AVLTREE_H
-#define AVLTREE 1
+#define AVLTREE_H 1
 
 #include <string>
 #include <iostream>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <iterator>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <cstdio>
+#include "nodepool.h"
+#include "parallel.h"
+#include "avlimage.h"
+#include "frozenavltree.h"
+#include "avlstats.h"
+#include "avlaugment.h"
 using namespace std;
 
+// an AVL tree mapping keys of type Key to values of type Value,
+//    ordered by Compare (a strict weak ordering on Key)
+// if Compare declares is_transparent, lookups also accept any type
+//    the comparator can compare against a Key, e.g. a comparator for
+//    string keys with "typedef void is_transparent;" and operator()
+//    overloads for (string, const char*) and (const char*, string)
+//    can be searched with a literal without building a string (see
+//    arenakeyless in keyarena.h for one in use)
+// with an Augment (see avlaugment.h) every node also keeps an
+//    aggregate of its subtree, for aggregate and interval queries
+template <class Key, class Value, class Compare = less<Key>,
+          class Augment = noaugment>
 class avltree {
    private:
-      struct node {
+      struct node : avlaugmentslot<Augment> {
           node *right, *left;
-          node *lastvisit; //last visited node during iterative insert
-          string      key, data;
+          Key         key;
+          Value       data;
           int         height, balance;
+          size_t      size;      //number of nodes in this subtree
+
+          template <class K, class... Args>
+          node(K &&k, Args&&... args) :
+             key(std::forward<K>(k)), data(std::forward<Args>(args)...) { }
       };
       // we maintain a pointer to the root of the tree
       node *root;
 
+      // every node lives in (and is recycled through) the pool
+      // a tree split off from this one shares its pool, so the
+      //    nodes can move between them without being copied
+      shared_ptr< nodepool<node> > pool;
+
+      // the key ordering
+      Compare comp;
+#ifdef AVLTREE_STATS
+      mutable avlcounters counters;
+#endif
+
+      // every key comparison goes through here, so it can be counted
+      template <class A, class B>
+      bool compare(const A &a, const B &b) const {
+         AVLSTAT(avlcounters::bump(counters.comparisons);)
+         return comp(a, b);
+      }
+
       // private, recursive routines
       // (used by the public methods)
-      node *search(string k, node *n);
+      template <class K> node *search(const K &k, node *n) const;
       void deallocate(node* &n);
-      bool insert(string k, string d, node* &n);
-      bool remove(string k, node* &n);
-      void print(node *n);
-      void debugprint(node *n); 
+      void debugprint(node *n);
       void rotateleft(node* &n);
       void rotateright(node* &n);
       void checkrotation(node* &n);
-      node *findsmallest(node *n);
+      template <class K, class... Args>
+      node *newnode(K &&k, Args&&... args);
+      void freenode(node *n);
       void updateheight(node *n);
-      bool treetest(node *n, string low, string high);
 
+      // subtree aggregates, which updateheight keeps up to date; for
+      //    noaugment these compile away to nothing
+      static const bool augmented = !is_same<Augment, noaugment>::value;
+      static void augment(node *n) {
+         augment(n, integral_constant<bool, augmented>());
+      }
+      static void augment(node *, false_type) { }
+      static void augment(node *n, true_type) {
+         n->aggregate = Augment::make(n->key, n->data);
+         if (n->left)
+            n->aggregate = Augment::combine(n->left->aggregate, n->aggregate);
+         if (n->right)
+            n->aggregate = Augment::combine(n->aggregate, n->right->aggregate);
+      }
+      template <class K> void reaugment(const K &k);
+      bool aggregate(node *n, const Key *lo, const Key *hi,
+                     typename Augment::type &out) const;
+      template <class F>
+      void overlapping(node *n, const Key &a, const Key &b, F &fn) const;
+      bool treetest(node *n, const Key *low, const Key *high);
+
+      // iterative insert shared by all of the public insert flavours
+      template <class K, class... Args>
+      node *insertunique(bool &inserted, K &&k, Args&&... args);
+      // iterative remove behind both public flavours
+      template <class K> bool removekey(const K &k);
+
+      // batched lookup helpers
+      static void prefetch(const node *n) {
+#ifdef __GNUC__
+         __builtin_prefetch(n);
+#endif
+      }
+      size_t searchinterleaved(const Key *keys, size_t count,
+                               const Value **out) const;
+      size_t searchmerged(const Key *keys, size_t count,
+                          const Value **out) const;
+
+      // order statistics
+      template <class K> size_t countbelow(const K &k, bool inclusive) const;
+
+      // iterators keep the path from the root on a fixed stack, which
+      //    is deep enough for any tree that fits in memory
+      //    (an AVL tree of n nodes is less than 1.45 log2 n high)
+      static const int maxdepth = 96;
+      template <class K> int seek(const K &k, bool strict, node **path) const;
+
+      // bulk construction helpers
+      template <class It> node *buildsorted(It &it, size_t count);
+      template <class It>
+      node *buildparallel(It first, void **slots, size_t count,
+                          unsigned threads);
+      template <class It>
+      bool buildrange(It first, size_t count, unsigned threads,
+                      random_access_iterator_tag);
+      template <class It>
+      bool buildrange(It first, size_t count, unsigned threads,
+                      forward_iterator_tag);
+      void freetree(node* &n);
+      node *copytree(const node *n);
+
+      // join/split primitives and the set operations built on them
+      static int height(const node *n) { return n ? n->height : -1; }
+      static size_t subtreesize(const node *n) { return n ? n->size : 0; }
+      node *join(node *l, node *k, node *r);
+      node *join2(node *l, node *r);
+      node *splitlast(node *n, node* &rest);
+      template <class K>
+      node *split(node *n, const K &k, node* &l, node* &r);
+      node *unite(node *a, node *b, vector<node*> &garbage,
+                  unsigned threads);
+      node *intersect(node *a, node *b, vector<node*> &garbage,
+                      unsigned threads);
+      node *subtract(node *a, node *b, vector<node*> &garbage,
+                     unsigned threads);
+      node *takenodes(avltree &other, bool &ok);
+      void freegarbage(vector<node*> &garbage);
+
+   public:
+      // one entry of a batch for apply_batch: an insert that replaces
+      //    the value of an existing key (upsert), or a remove
+      struct change {
+         enum kind { upsert, erase };
+         kind   op;
+         Key    key;
+         Value  data;        // unused by erase
+      };
+
+   private:
+      // batched updates
+      node *applychanges(node *n, const change **first,
+                         const change **last, void **&slots);
+      node *buildchanges(const change **first, size_t count,
+                         void **&slots);
 
    public:
 
-      bool insert(string k, string d);
-      avltree() { root = NULL; }
-      ~avltree() { deallocate(root); }
-      void display() { print(root); }
+      // bidirectional iterators over the entries in key order
+      // each holds the path down to its entry, so stepping costs O(1)
+      //    amortized with no parent links and no recursion
+      // dereferencing gives a (key, value) pair of references;
+      //    key() and value() reach the two directly
+      // any change to the tree invalidates every iterator over it
+      template <bool isconst>
+      class basic_iterator {
+         private:
+            friend class avltree;
+            template <bool> friend class basic_iterator;
+            typedef typename conditional<isconst, const Value, Value>::type
+               mapped;
+
+            const avltree *tree;
+            node *path[maxdepth];  // root first, current entry on top
+            int depth;             // 0 at end()
+
+            basic_iterator(const avltree *t) : tree(t), depth(0) { }
+            void pushleftmost(node *n) {
+               for (; n; n = n->left) path[depth++] = n;
+            }
+            void pushrightmost(node *n) {
+               for (; n; n = n->right) path[depth++] = n;
+            }
+
+         public:
+            typedef bidirectional_iterator_tag iterator_category;
+            typedef pair<const Key, Value> value_type;
+            typedef ptrdiff_t difference_type;
+            typedef pair<const Key&, mapped&> reference;
+            struct pointer {
+               reference r;
+               reference *operator->() { return &r; }
+            };
+
+            basic_iterator() : tree(NULL), depth(0) { }
+            // an iterator converts to a const_iterator
+            template <bool other,
+                      class = typename enable_if<isconst && !other>::type>
+            basic_iterator(const basic_iterator<other> &it) :
+               tree(it.tree), depth(it.depth) {
+               copy(it.path, it.path + depth, path);
+            }
+
+            const Key &key() const { return path[depth - 1]->key; }
+            mapped &value() const { return path[depth - 1]->data; }
+            reference operator*() const { return reference(key(), value()); }
+            pointer operator->() const {
+               pointer p = { **this };
+               return p;
+            }
+
+            basic_iterator &operator++() {
+               // the leftmost entry right of here, or else the nearest
+               //    ancestor we are in the left subtree of
+               node *n = path[depth - 1];
+               if (n->right) {
+                  pushleftmost(n->right);
+                  return *this;
+               }
+               while (--depth > 0 && path[depth - 1]->right == n)
+                  n = path[depth - 1];
+               return *this;
+            }
+            basic_iterator &operator--() {
+               // as ++, mirrored; stepping back from end() gives the
+               //    largest entry
+               if (depth == 0) {
+                  pushrightmost(tree->root);
+                  return *this;
+               }
+               node *n = path[depth - 1];
+               if (n->left) {
+                  pushrightmost(n->left);
+                  return *this;
+               }
+               while (--depth > 0 && path[depth - 1]->left == n)
+                  n = path[depth - 1];
+               return *this;
+            }
+            basic_iterator operator++(int) {
+               basic_iterator old(*this);
+               ++*this;
+               return old;
+            }
+            basic_iterator operator--(int) {
+               basic_iterator old(*this);
+               --*this;
+               return old;
+            }
+
+            bool operator==(const basic_iterator &other) const {
+               node *a = depth ? path[depth - 1] : NULL;
+               node *b = other.depth ? other.path[other.depth - 1] : NULL;
+               return a == b;
+            }
+            bool operator!=(const basic_iterator &other) const {
+               return !(*this == other);
+            }
+      };
+      typedef basic_iterator<false> iterator;
+      typedef basic_iterator<true> const_iterator;
+
+      iterator begin() {
+         iterator it(this);
+         it.pushleftmost(root);
+         return it;
+      }
+      const_iterator begin() const {
+         const_iterator it(this);
+         it.pushleftmost(root);
+         return it;
+      }
+      iterator end() { return iterator(this); }
+      const_iterator end() const { return const_iterator(this); }
+
+      // the first entry with a key not less than k (lower_bound) or
+      //    greater than k (upper_bound), or end() if there is none
+      // each is a single O(log n) descent
+      iterator lower_bound(const Key &k) {
+         iterator it(this);
+         it.depth = seek(k, false, it.path);
+         return it;
+      }
+      const_iterator lower_bound(const Key &k) const {
+         const_iterator it(this);
+         it.depth = seek(k, false, it.path);
+         return it;
+      }
+      iterator upper_bound(const Key &k) {
+         iterator it(this);
+         it.depth = seek(k, true, it.path);
+         return it;
+      }
+      const_iterator upper_bound(const Key &k) const {
+         const_iterator it(this);
+         it.depth = seek(k, true, it.path);
+         return it;
+      }
+      pair<iterator, iterator> equal_range(const Key &k) {
+         return make_pair(lower_bound(k), upper_bound(k));
+      }
+      pair<const_iterator, const_iterator> equal_range(const Key &k) const {
+         return make_pair(lower_bound(k), upper_bound(k));
+      }
+      iterator find(const Key &k) {
+         iterator it = lower_bound(k);
+         return (it != end() && !compare(k, it.key())) ? it : end();
+      }
+      const_iterator find(const Key &k) const {
+         const_iterator it = lower_bound(k);
+         return (it != end() && !compare(k, it.key())) ? it : end();
+      }
+
+      // call fn(key, value) for every entry from lo to hi inclusive,
+      //    in key order, visiting O(log n + k) nodes for k entries
+      template <class F>
+      void for_each_in_range(const Key &lo, const Key &hi, F fn) {
+         for (iterator it = lower_bound(lo); it != end(); ++it) {
+            if (compare(hi, it.key())) break;
+            fn(it.key(), it.value());
+         }
+      }
+      template <class F>
+      void for_each_in_range(const Key &lo, const Key &hi, F fn) const {
+         for (const_iterator it = lower_bound(lo); it != end(); ++it) {
+            if (compare(hi, it.key())) break;
+            fn(it.key(), it.value());
+         }
+      }
+
+      // with an Augment: the aggregate of the values of the keys from
+      //    lo to hi inclusive (or of the whole tree), in O(log n)
+      // returns false if there are no such keys
+      // a value changed in place (through an iterator or for_each)
+      //    must not change its aggregate, as the nodes above it won't
+      //    know; replace it with insert_or_assign instead
+      bool aggregate(const Key &lo, const Key &hi,
+                     typename Augment::type &out) const;
+      bool aggregate(typename Augment::type &out) const {
+         return aggregate(root, NULL, NULL, out);
+      }
+      // for an interval tree, keyed by each interval's start, whose
+      //    Augment::make gives its end and whose combine keeps the
+      //    larger end (as maxaugment does, with the end as the value):
+      //    call fn(key, value) for every interval that overlaps [a, b],
+      //    in key order; subtrees holding no interval that ends at or
+      //    after a are skipped, so it visits at most O((k + 1) log n)
+      //    nodes for k intervals, rather than all of them
+      // intervals are closed, and Compare must order ends against keys
+      template <class F>
+      void for_each_overlapping(const Key &a, const Key &b, F fn) const;
+
+      // the insert/emplace family never replaces an existing entry:
+      //    each returns true if k was added, or false if k was
+      //    already present (or memory ran out)
+      // the key and the value are each copied or moved in, as passed
+      template <class V>
+      bool insert(const Key &k, V &&d) {
+         bool inserted;
+         insertunique(inserted, k, std::forward<V>(d));
+         return inserted;
+      }
+      template <class V>
+      bool insert(Key &&k, V &&d) {
+         bool inserted;
+         insertunique(inserted, std::move(k), std::forward<V>(d));
+         return inserted;
+      }
+      // construct the value for k in place from args,
+      //    leaving args untouched if k is already present
+      template <class... Args>
+      bool try_emplace(const Key &k, Args&&... args) {
+         bool inserted;
+         insertunique(inserted, k, std::forward<Args>(args)...);
+         return inserted;
+      }
+      template <class... Args>
+      bool try_emplace(Key &&k, Args&&... args) {
+         bool inserted;
+         insertunique(inserted, std::move(k), std::forward<Args>(args)...);
+         return inserted;
+      }
+      // emplace behaves exactly like try_emplace
+      template <class... Args>
+      bool emplace(const Key &k, Args&&... args) {
+         return try_emplace(k, std::forward<Args>(args)...);
+      }
+      template <class... Args>
+      bool emplace(Key &&k, Args&&... args) {
+         return try_emplace(std::move(k), std::forward<Args>(args)...);
+      }
+      // add k with value d, or replace the value of an existing k
+      // returns true if k was added, false if it was assigned
+      template <class V>
+      bool insert_or_assign(const Key &k, V &&d) {
+         bool inserted;
+         node *n = insertunique(inserted, k, std::forward<V>(d));
+         if (n && !inserted) {
+            n->data = std::forward<V>(d);
+            reaugment(n->key);
+         }
+         return inserted;
+      }
+      template <class V>
+      bool insert_or_assign(Key &&k, V &&d) {
+         bool inserted;
+         node *n = insertunique(inserted, std::move(k), std::forward<V>(d));
+         if (n && !inserted) {
+            n->data = std::forward<V>(d);
+            reaugment(n->key);
+         }
+         return inserted;
+      }
+      // nodes are carved out of slabs obtained from source,
+      //    or from operator new if no source is given
+      avltree(slaballocator *source = NULL) :
+         root(NULL), pool(make_shared< nodepool<node> >(source)) { }
+      avltree(const Compare &c, slaballocator *source = NULL) :
+         root(NULL), pool(make_shared< nodepool<node> >(source)), comp(c) { }
+      // a copy gets its own pool (from the same slab allocator)
+      //    and its own copy of every node
+      // throws bad_alloc if memory runs out
+      avltree(const avltree &other) :
+         root(NULL), pool(make_shared< nodepool<node> >(
+                             other.pool->allocator())),
+         comp(other.comp) {
+         root = copytree(other.root);
+         if (other.root && !root) throw bad_alloc();
+      }
+      avltree(avltree &&other) :
+         root(other.root), pool(other.pool), comp(other.comp) {
+         other.root = NULL;
+         other.pool = make_shared< nodepool<node> >(pool->allocator());
+      }
+      avltree &operator=(avltree other) {
+         swap(other);
+         return *this;
+      }
+      void swap(avltree &other) {
+         std::swap(root, other.root);
+         std::swap(pool, other.pool);
+         std::swap(comp, other.comp);
+      }
+      ~avltree() {
+         // if other trees still use the pool our nodes go back to it,
+         // otherwise the pool is about to release all of its slabs and
+         //    nodes with nothing to destroy are simply dropped
+         if (pool.use_count() > 1) freetree(root);
+         else if (!is_trivially_destructible<node>::value) deallocate(root);
+      }
+      // remove every entry, recycling the nodes through the pool
+      void clear() { freetree(root); }
+
+      // replace the contents of the tree with the (key, value) pairs
+      //    in [first, last), which must be strictly increasing by key
+      // the tree is built bottom-up in O(n), perfectly balanced and
+      //    without any rotations, reusing the pool's free nodes
+      // returns false (leaving the tree untouched) if the range is
+      //    not strictly increasing, or if memory runs out
+      //    (leaving the tree empty)
+      // with threads other than 1 (0 meaning one per core) and random
+      //    access iterators, subtrees are built concurrently; the
+      //    resulting tree has exactly the same shape either way
+      template <class It>
+      bool build_from_sorted(It first, It last, unsigned threads = 1);
+      // as build_from_sorted, for a range in any order
+      // if a key appears more than once its first value is kept,
+      //    just as repeated inserts would
+      // the threads setting also applies to sorting the range
+      template <class It>
+      bool build_from_unsorted(It first, It last, unsigned threads = 1);
+
+      // split/join move whole subtrees between trees in O(log n)
+      // split moves every entry with a key greater than k into greater
+      //    (discarding what greater held before); greater then shares
+      //    this tree's node pool, and trees that share a pool must not
+      //    be modified concurrently
+      void split(const Key &k, avltree &greater);
+      // append all of greater's entries to this tree, leaving greater
+      //    empty; every key in greater must be larger than every key
+      //    here, otherwise nothing is changed and false is returned
+      bool join(avltree &greater);
+
+      // set operations, each leaving its result in this tree and
+      //    consuming other (which is left empty)
+      // they cost O(m log(n/m + 1)) for trees of sizes m <= n, and with
+      //    threads other than 1 (0 meaning one per core) independent
+      //    halves of large trees are processed concurrently
+      // when a key is in both trees the value from this tree is kept
+      // other's nodes are adopted without copying when the two trees
+      //    get their slabs from the same slab allocator
+      // each returns false if memory ran out copying other's nodes,
+      //    leaving this tree unchanged
+      bool unite(avltree &other, unsigned threads = 1);
+      bool intersect(avltree &other, unsigned threads = 1);
+      bool subtract(avltree &other, unsigned threads = 1);
+
+      // apply a whole batch of changes in one pass over the tree
+      // the batch is sorted by key (when a key appears more than once
+      //    its last change wins), then merged into the tree top down:
+      //    subtrees no change reaches are left alone, runs of inserts
+      //    that land below a leaf are built into balanced subtrees, and
+      //    the pieces are joined back on the way up, so each touched
+      //    node has its height fixed and is rotated at most once
+      // all the nodes the batch could need are taken from the pool
+      //    first; returns false (changing nothing) if that fails
+      bool apply_batch(const vector<change> &ops);
+
+      // write a binary image of the tree to path: its structure,
+      //    balance data and every key and value (encoded through
+      //    avlcodec), versioned and checksummed, see avlimage.h
+      // the image is written beside path and renamed over it once
+      //    complete, so a crash never leaves a torn image behind;
+      //    it is on disk (directory entry included) when save returns
+      // returns false on any i/o error, or if a key or value encodes to
+      //    4 GB or more (records hold 32 bit lengths)
+      bool save(const string &path) const;
+      // map an image written by save for searching in place, without
+      //    loading it into a tree (see mappedavltree)
+      static bool open_mapped(const string &path,
+                              mappedavltree<Key, Value, Compare> &image,
+                              bool verify = true) {
+         return image.open(path, verify);
+      }
+
+      // an immutable copy of the tree in Eytzinger layout, for data
+      //    that is built once and then only read; see frozenavltree
+      // throws bad_alloc if memory runs out
+      frozenavltree<Key, Value, Compare> freeze() const {
+         frozenavltree<Key, Value, Compare> frozen(comp);
+         frozen.assign(begin(), end());
+         return frozen;
+      }
+
+      // order statistics, each O(log n) using the subtree sizes
+      //    kept in every node
+      size_t size() const { return subtreesize(root); }
+      // the number of keys less than k
+      size_t rank(const Key &k) const { return countbelow(k, false); }
+      // the entry with the given position in key order (0 = smallest);
+      //    returns false if i >= size()
+      bool select(size_t i, Key &k, Value &d) const;
+      // the number of keys from lo to hi inclusive
+      size_t count_range(const Key &lo, const Key &hi) const;
+      // the nearest rank p-th percentile entry (p from 0 to 100)
+      bool percentile(double p, Key &k, Value &d) const;
+
+      void display() const;
       void debug() { debugprint(root); }
 
-      bool remove(string k) {
-           if (remove(k, root)) checkrotation(root);
-           else return false;
-           return true;
+      // removing an entry never moves another entry's node, so
+      //    pointers to the other values (from search_batch, say) stay
+      //    valid
+      bool remove(const Key &k) { return removekey(k); }
+      // heterogeneous remove, only offered for transparent comparators
+      template <class K, class C = Compare, class = typename C::is_transparent>
+      bool remove(const K &k) { return removekey(k); }
+      bool search(const Key &k, Value &d) const {
+          node *n = search(k, root);
+          if (!n) return false;
+          d = n->data;
+          return true;
       }
-      bool search(string k, string &d) {
+      // heterogeneous lookup, only offered for transparent comparators
+      template <class K, class C = Compare, class = typename C::is_transparent>
+      bool search(const K &k, Value &d) const {
           node *n = search(k, root);
           if (!n) return false;
           d = n->data;
           return true;
-     }
-     bool checkvalid();
+      }
+      // look up count keys at once, setting out[i] to the value of
+      //    keys[i], or to NULL if it is absent; returns how many were
+      //    found
+      // rather than one descent after another, the descents are
+      //    interleaved and each prefetches its next node while the
+      //    others work, so their cache misses overlap; a batch in
+      //    ascending key order instead makes one merged descent that
+      //    visits the nodes the lookups share only once, a level at
+      //    a time
+      // inserts and removes never move a node, so each pointer stays
+      //    valid until its own entry is removed, or until clear,
+      //    assignment, build_from_sorted, split, join or a set
+      //    operation frees or moves the node
+      size_t search_batch(const Key *keys, size_t count,
+                          const Value **out) const;
+      size_t search_batch(const vector<Key> &keys,
+                          vector<const Value*> &out) const {
+         out.resize(keys.size());
+         return search_batch(keys.data(), keys.size(), out.data());
+      }
+      bool checkvalid();
+
+      // operation counts, see avlstats.h (all zero unless the tree
+      //    was compiled with AVLTREE_STATS)
+      avlstats stats() const {
+#ifdef AVLTREE_STATS
+         return counters.read();
+#else
+         avlstats s;
+         memset(&s, 0, sizeof(s));
+         return s;
+#endif
+      }
+      void resetstats() { AVLSTAT(counters.reset();) }
 };
 
+// template member definitions
+#include "avltree.cpp"
+
 #endif
@@ -0,0 +1,1187 @@
+/*
+avltree benchmarks
+usage: benchmark <scenario> [options]
+*/
+
+#include "avltree.h"
+#include "concurrentavltree.h"
+#include "compactavltree.h"
+#include "durableavltree.h"
+#include "shardedavltree.h"
+#include "bucketavltree.h"
+#include "keyarena.h"
+#include "avlcache.h"
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+
+typedef chrono::steady_clock benchclock;
+typedef avltree<uint64_t, uint64_t> numtree;
+
+double secondssince(benchclock::time_point start)
+//the wall clock time elapsed since start, in seconds
+{
+   return chrono::duration<double>(benchclock::now() - start).count();
+}
+
+void report(const char *label, size_t ops, double seconds)
+//print one result line: total time and throughput
+{
+   printf("%-34s %10.3f s %12.0f ops/s\n", label, seconds,
+          seconds > 0 ? ops / seconds : 0.0);
+}
+
+vector< pair<uint64_t, uint64_t> > randomitems(size_t n, uint64_t seed)
+//n (key, value) pairs with distinct keys in random order
+{
+   vector< pair<uint64_t, uint64_t> > items(n);
+   for (size_t i = 0; i < n; i++) items[i] = make_pair(i * 2 + 1, i);
+   shuffle(items.begin(), items.end(), mt19937_64(seed));
+   return items;
+}
+
+int benchbuild(int argc, char **argv)
+//compares loading a tree by repeated insert against the bulk builders,
+//sequential and parallel
+//options: [entries (default 1000000)] [threads (default: one per core)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   unsigned threads = (argc > 1) ? strtoul(argv[1], NULL, 10) : 0;
+   if (threads == 0) threads = defaultthreads();
+
+   vector< pair<uint64_t, uint64_t> > items = randomitems(n, 1);
+   vector< pair<uint64_t, uint64_t> > sorted = items;
+   sort(sorted.begin(), sorted.end());
+   printf("building trees of %zu entries, %u threads\n", n, threads);
+
+   {
+      numtree t;
+      benchclock::time_point start = benchclock::now();
+      for (size_t i = 0; i < n; i++) t.insert(items[i].first, items[i].second);
+      report("repeated insert (random order)", n, secondssince(start));
+   }
+   {
+      numtree t;
+      benchclock::time_point start = benchclock::now();
+      t.build_from_unsorted(items.begin(), items.end(), 1);
+      report("build_from_unsorted, 1 thread", n, secondssince(start));
+   }
+   {
+      numtree t;
+      benchclock::time_point start = benchclock::now();
+      t.build_from_unsorted(items.begin(), items.end(), threads);
+      report("build_from_unsorted, parallel", n, secondssince(start));
+   }
+   {
+      numtree t;
+      benchclock::time_point start = benchclock::now();
+      t.build_from_sorted(sorted.begin(), sorted.end(), 1);
+      report("build_from_sorted, 1 thread", n, secondssince(start));
+   }
+   {
+      numtree t;
+      benchclock::time_point start = benchclock::now();
+      t.build_from_sorted(sorted.begin(), sorted.end(), threads);
+      report("build_from_sorted, parallel", n, secondssince(start));
+      if (!t.checkvalid()) return 1;
+   }
+   return 0;
+}
+
+// the two ways of sharing a tree between threads that are compared:
+//    one avltree behind a mutex, and the lock-free-read tree
+struct lockedtree {
+   numtree t;
+   mutex m;
+   bool search(uint64_t k, uint64_t &d) {
+      lock_guard<mutex> g(m);
+      return t.search(k, d);
+   }
+   bool insert(uint64_t k, uint64_t d) {
+      lock_guard<mutex> g(m);
+      return t.insert(k, d);
+   }
+   bool remove(uint64_t k) {
+      lock_guard<mutex> g(m);
+      return t.remove(k);
+   }
+};
+typedef concurrentavltree<uint64_t, uint64_t> sharedtree;
+
+template <class Tree>
+void runmixed(Tree &t, const char *label, size_t n, unsigned readers,
+              unsigned writers, double seconds)
+//preload n keys, then let readers search and writers insert/remove
+//random keys for the given time, and report each side's throughput
+{
+   for (size_t i = 0; i < n; i++) t.insert(i * 2, i);
+
+   atomic<bool> stop(false);
+   atomic<uint64_t> reads(0), writes(0);
+   vector<thread> threads;
+   for (unsigned r = 0; r < readers; r++) {
+      threads.push_back(thread([&, r]() {
+         mt19937_64 rng(r + 1);
+         uint64_t done = 0, d;
+         while (!stop.load(memory_order_relaxed)) {
+            t.search(rng() % (2 * n), d);
+            done++;
+         }
+         reads += done;
+      }));
+   }
+   for (unsigned w = 0; w < writers; w++) {
+      threads.push_back(thread([&, w]() {
+         mt19937_64 rng(1000 + w);
+         uint64_t done = 0;
+         while (!stop.load(memory_order_relaxed)) {
+            uint64_t k = rng() % (2 * n);
+            if (rng() & 1) t.insert(k, k);
+            else t.remove(k);
+            done++;
+         }
+         writes += done;
+      }));
+   }
+   this_thread::sleep_for(chrono::duration<double>(seconds));
+   stop = true;
+   for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+
+   printf("%-22s %14.0f reads/s %12.0f writes/s\n", label,
+          reads / seconds, writes / seconds);
+}
+
+int benchconcurrent(int argc, char **argv)
+//read/write throughput with concurrent readers and writers, for an
+//avltree behind a mutex and for the concurrentavltree
+//options: [entries (default 1000000)] [readers (default: cores - 1)]
+//         [writers (default 1)] [seconds (default 2)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   unsigned readers = (argc > 1) ? strtoul(argv[1], NULL, 10)
+                                 : max(1u, defaultthreads() - 1);
+   unsigned writers = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+   double seconds = (argc > 3) ? strtod(argv[3], NULL) : 2;
+   printf("%zu entries, %u readers, %u writers, %.1f s\n", n, readers,
+          writers, seconds);
+
+   {
+      lockedtree t;
+      runmixed(t, "avltree + mutex", n, readers, writers, seconds);
+   }
+   {
+      sharedtree t;
+      runmixed(t, "concurrentavltree", n, readers, writers, seconds);
+   }
+   return 0;
+}
+
+// a slab source that keeps count of the bytes it has handed out, so
+//    the footprint of an avltree's nodes can be measured
+class countingallocator : public slaballocator {
+   public:
+      size_t bytes;
+      countingallocator() : bytes(0) { }
+      void *allocate(size_t n) {
+         void *p = ::operator new(n, nothrow);
+         if (p) bytes += n;
+         return p;
+      }
+      void deallocate(void *p, size_t n) {
+         bytes -= n;
+         ::operator delete(p);
+      }
+};
+
+template <class Tree, class Key>
+double timelookups(const Tree &t, const vector<Key> &probes)
+//the average time of one search over the probe keys, in nanoseconds
+{
+   uint64_t found = 0, d;
+   benchclock::time_point start = benchclock::now();
+   for (size_t i = 0; i < probes.size(); i++)
+      if (t.search(probes[i], d)) found += d;
+   double seconds = secondssince(start);
+   if (found == 1) printf(" ");   // keeps the loop from being optimized out
+   return seconds * 1e9 / probes.size();
+}
+
+int benchlayout(int argc, char **argv)
+//memory per entry and random lookup latency of the pointer based
+//avltree against the array based compactavltree
+//options: [entries (default 1000000)] [lookups (default 2000000)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   size_t lookups = (argc > 1) ? strtoul(argv[1], NULL, 10) : 2000000;
+
+   vector< pair<uint64_t, uint64_t> > items = randomitems(n, 1);
+   vector<uint64_t> probes(lookups);
+   mt19937_64 rng(2);
+   for (size_t i = 0; i < lookups; i++) probes[i] = items[rng() % n].first;
+   printf("%zu entries of 8 byte keys and values, %zu lookups\n", n,
+          lookups);
+
+   {
+      countingallocator slabs;
+      numtree t(&slabs);
+      for (size_t i = 0; i < n; i++) t.insert(items[i].first, items[i].second);
+      printf("%-22s %8.1f bytes/entry %10.1f ns/lookup\n", "avltree",
+             (double)slabs.bytes / n, timelookups(t, probes));
+   }
+   {
+      compactavltree<uint64_t, uint64_t> t;
+      for (size_t i = 0; i < n; i++) t.insert(items[i].first, items[i].second);
+      printf("%-22s %8.1f bytes/entry %10.1f ns/lookup\n", "compactavltree",
+             (double)t.bytes() / n, timelookups(t, probes));
+      if (!t.checkvalid()) return 1;
+   }
+   return 0;
+}
+
+int benchbatch(int argc, char **argv)
+//a loop of search against search_batch, for random and for sorted
+//batches of lookups
+//options: [entries (default 1000000)] [batch size (default 256)]
+//         [lookups (default 4000000)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   size_t batch = (argc > 1) ? strtoul(argv[1], NULL, 10) : 256;
+   size_t lookups = (argc > 2) ? strtoul(argv[2], NULL, 10) : 4000000;
+   if (batch == 0) batch = 1;
+   lookups = (lookups + batch - 1) / batch * batch;
+
+   vector< pair<uint64_t, uint64_t> > items = randomitems(n, 1);
+   numtree t;
+   t.build_from_unsorted(items.begin(), items.end());
+   // probe present and absent keys alike
+   vector<uint64_t> probes(lookups);
+   mt19937_64 rng(2);
+   for (size_t i = 0; i < lookups; i++) probes[i] = rng() % (2 * n);
+   vector<uint64_t> sorted = probes;
+   for (size_t i = 0; i < lookups; i += batch)
+      sort(sorted.begin() + i, sorted.begin() + i + batch);
+   printf("%zu entries, %zu lookups in batches of %zu\n", n, lookups, batch);
+
+   const char *labels[] = { "loop of search, random",
+                            "loop of search, sorted" };
+   const vector<uint64_t> *orders[] = { &probes, &sorted };
+   for (int o = 0; o < 2; o++) {
+      const vector<uint64_t> &keys = *orders[o];
+      uint64_t found = 0, d;
+      benchclock::time_point start = benchclock::now();
+      for (size_t i = 0; i < lookups; i++)
+         if (t.search(keys[i], d)) found++;
+      report(labels[o], lookups, secondssince(start));
+      if (found > lookups) return 1;   // keeps the loop from being dropped
+   }
+
+   const char *batchlabels[] = { "search_batch, random",
+                                 "search_batch, sorted" };
+   vector<const uint64_t*> out(batch);
+   for (int o = 0; o < 2; o++) {
+      const vector<uint64_t> &keys = *orders[o];
+      size_t found = 0;
+      benchclock::time_point start = benchclock::now();
+      for (size_t i = 0; i < lookups; i += batch)
+         found += t.search_batch(&keys[i], batch, &out[0]);
+      report(batchlabels[o], lookups, secondssince(start));
+      if (found > lookups) return 1;
+   }
+   return 0;
+}
+
+int benchimage(int argc, char **argv)
+//cold start: rebuilding a tree by repeated insert against saving an
+//image once and mapping it back
+//options: [entries (default 1000000)] [image path (default avltree.img)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   string path = (argc > 1) ? argv[1] : "avltree.img";
+
+   vector< pair<uint64_t, uint64_t> > items = randomitems(n, 1);
+   printf("%zu entries, image at %s\n", n, path.c_str());
+   numtree t;
+   benchclock::time_point start = benchclock::now();
+   for (size_t i = 0; i < n; i++) t.insert(items[i].first, items[i].second);
+   report("rebuild by insert", n, secondssince(start));
+
+   start = benchclock::now();
+   if (!t.save(path)) {
+      cerr << "could not write " << path << "\n";
+      return 1;
+   }
+   report("save", n, secondssince(start));
+
+   mappedavltree<uint64_t, uint64_t> image;
+   start = benchclock::now();
+   if (!numtree::open_mapped(path, image, false)) return 1;
+   report("open_mapped", n, secondssince(start));
+   start = benchclock::now();
+   if (!numtree::open_mapped(path, image, true)) return 1;
+   report("open_mapped, verified", n, secondssince(start));
+
+   uint64_t found = 0, d;
+   start = benchclock::now();
+   for (size_t i = 0; i < n; i++)
+      if (image.search(items[i].first, d)) found++;
+   report("search every key in the image", n, secondssince(start));
+   remove(path.c_str());
+   return (found == n) ? 0 : 1;
+}
+
+double percentile(vector<double> &samples, double p)
+//the p-th percentile (0 to 100) of samples, which get sorted
+{
+   if (samples.empty()) return 0;
+   sort(samples.begin(), samples.end());
+   size_t i = (size_t)(p / 100 * (samples.size() - 1) + 0.5);
+   return samples[i];
+}
+
+int benchdurable(int argc, char **argv)
+//sustained insert throughput and latency through the write-ahead log,
+//for each fsync policy
+//options: [inserts per policy (default 20000)] [threads (default 4)]
+//         [log directory (default .)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 20000;
+   unsigned threads = (argc > 1) ? strtoul(argv[1], NULL, 10) : 4;
+   string dir = (argc > 2) ? argv[2] : ".";
+   if (threads == 0) threads = 1;
+   printf("%zu inserts per policy from %u threads, logging in %s\n", n,
+          threads, dir.c_str());
+
+   const fsyncpolicy policies[] = { syncnever, syncinterval, synccommit };
+   const char *labels[] = { "syncnever", "syncinterval (10 ms)",
+                            "synccommit" };
+   for (int p = 0; p < 3; p++) {
+      string base = dir + "/benchmark-durable";
+      remove((base + ".wal").c_str());
+      remove((base + ".snapshot").c_str());
+      durableavltree<uint64_t, uint64_t> t;
+      if (!t.open(base, policies[p], 10)) {
+         cerr << "could not open a log in " << dir << "\n";
+         return 1;
+      }
+
+      vector< vector<double> > latencies(threads);
+      vector<thread> workers;
+      benchclock::time_point start = benchclock::now();
+      for (unsigned w = 0; w < threads; w++) {
+         workers.push_back(thread([&, w]() {
+            for (size_t i = w; i < n; i += threads) {
+               benchclock::time_point begin = benchclock::now();
+               t.insert(i, i);
+               latencies[w].push_back(secondssince(begin) * 1e6);
+            }
+         }));
+      }
+      for (unsigned w = 0; w < threads; w++) workers[w].join();
+      double seconds = secondssince(start);
+      t.close();
+
+      vector<double> all;
+      for (unsigned w = 0; w < threads; w++)
+         all.insert(all.end(), latencies[w].begin(), latencies[w].end());
+      printf("%-22s %12.0f inserts/s  p50 %9.1f us  p99 %9.1f us\n",
+             labels[p], n / seconds, percentile(all, 50),
+             percentile(all, 99));
+      remove((base + ".wal").c_str());
+      remove((base + ".snapshot").c_str());
+   }
+   return 0;
+}
+
+// the suite: every workload below, for each key/value size, reported as
+//    one row per workload so that runs can be diffed
+
+// keys and values for item id, of about the given size; string keys
+//    are zero padded so they sort in id order
+void makeitem(uint64_t id, size_t, uint64_t &out) { out = id; }
+void makeitem(uint64_t id, size_t size, string &out)
+{
+   char digits[24];
+   int len = snprintf(digits, sizeof(digits), "%llu", (unsigned long long)id);
+   out.assign(size > (size_t)len ? size - len : 0, '0');
+   out += digits;
+}
+
+// heap memory an item holds outside the node
+size_t heapbytes(uint64_t) { return 0; }
+size_t heapbytes(const string &s)
+{
+   // contents that fit the string object itself don't allocate
+   return (s.capacity() > string().capacity()) ? s.capacity() + 1 : 0;
+}
+
+// draws ids 0..n-1 with Zipfian popularity (exponent s), the most
+// popular ids scattered over the key space rather than bunched
+class zipfian {
+   private:
+      vector<double> cdf;
+      uniform_real_distribution<double> uniform;
+   public:
+      zipfian(size_t n, double s) : cdf(n) {
+         double sum = 0;
+         for (size_t i = 0; i < n; i++) cdf[i] = (sum += 1 / pow(i + 1.0, s));
+         for (size_t i = 0; i < n; i++) cdf[i] /= sum;
+      }
+      uint64_t operator()(mt19937_64 &rng) {
+         size_t rank = lower_bound(cdf.begin(), cdf.end(), uniform(rng)) -
+                       cdf.begin();
+         if (rank >= cdf.size()) rank = cdf.size() - 1;
+         return (rank * 0x9e3779b97f4a7c15ULL) % cdf.size();
+      }
+};
+
+// one line of suite output
+struct suiterow {
+   string workload, items;
+   size_t ops;
+   double seconds, p50, p99, p999;   // latencies in ns
+   double bytesperentry;              // 0 where it doesn't apply
+};
+
+template <class F>
+suiterow timeops(const string &workload, const string &items, size_t ops,
+                 F op)
+//run op(0) .. op(ops - 1), timing every call
+{
+   vector<double> latencies(ops);
+   benchclock::time_point start = benchclock::now();
+   for (size_t i = 0; i < ops; i++) {
+      benchclock::time_point begin = benchclock::now();
+      op(i);
+      latencies[i] = secondssince(begin) * 1e9;
+   }
+   suiterow row;
+   row.workload = workload;
+   row.items = items;
+   row.ops = ops;
+   row.seconds = secondssince(start);
+   row.p50 = percentile(latencies, 50);
+   row.p99 = percentile(latencies, 99);
+   row.p999 = percentile(latencies, 99.9);
+   row.bytesperentry = 0;
+   return row;
+}
+
+template <class Key, class Value>
+void runsuite(const string &items, size_t keysize, size_t valuesize,
+              size_t n, vector<suiterow> &rows)
+//every workload for one key/value type and size
+{
+   typedef avltree<Key, Value> tree;
+   vector<Key> keys(2 * n);
+   for (size_t i = 0; i < 2 * n; i++) makeitem(i, keysize, keys[i]);
+   Value value;
+   makeitem(42, valuesize, value);
+   mt19937_64 rng(7);
+
+   // load orders: ascending, random, and a zigzag from both ends
+   //    inwards, which keeps every insert at the edge of a subtree that
+   //    was just rebalanced: nearly every insert rotates, and most of
+   //    the rotations are double ones
+   vector<size_t> sequential(n), shuffled(n), zigzag(n);
+   for (size_t i = 0; i < n; i++) sequential[i] = 2 * i;
+   shuffled = sequential;
+   shuffle(shuffled.begin(), shuffled.end(), rng);
+   for (size_t i = 0, lo = 0, hi = n; i < n; i++)
+      zigzag[i] = 2 * ((i & 1) ? --hi : lo++);
+   const char *ordernames[] = { "load-sequential", "load-random",
+                                "load-zigzag" };
+   const vector<size_t> *orders[] = { &sequential, &shuffled, &zigzag };
+   for (int o = 0; o < 3; o++) {
+      countingallocator slabs;
+      tree t(&slabs);
+      const vector<size_t> &order = *orders[o];
+      suiterow row = timeops(ordernames[o], items, n, [&](size_t i) {
+         t.insert(keys[order[i]], value);
+      });
+      size_t heap = 0;
+      for (typename tree::const_iterator it = t.begin(); it != t.end(); ++it)
+         heap += heapbytes(it.key()) + heapbytes(it.value());
+      row.bytesperentry = (double)(slabs.bytes + heap) / n;
+      rows.push_back(row);
+   }
+
+   // the rest start from a tree of the even keys, so odd keys miss
+   tree t;
+   for (size_t i = 0; i < n; i++) t.insert(keys[shuffled[i]], value);
+   Value found;
+
+   vector<size_t> probes(n);
+   for (size_t i = 0; i < n; i++) probes[i] = rng() % (2 * n);
+   rows.push_back(timeops("read-uniform", items, n, [&](size_t i) {
+      t.search(keys[probes[i]], found);
+   }));
+   zipfian zipf(n, 0.99);
+   for (size_t i = 0; i < n; i++) probes[i] = 2 * zipf(rng);
+   rows.push_back(timeops("read-zipfian", items, n, [&](size_t i) {
+      t.search(keys[probes[i]], found);
+   }));
+
+   // mixes of reads and writes; writes are an even split of upserts and
+   //    removes over all the keys, so the size stays about the same
+   const int readpercents[] = { 95, 50, 5 };
+   for (int r = 0; r < 3; r++) {
+      vector<uint64_t> ops(n);
+      for (size_t i = 0; i < n; i++) ops[i] = rng();
+      char name[32];
+      snprintf(name, sizeof(name), "mixed-%dr%dw", readpercents[r],
+               100 - readpercents[r]);
+      rows.push_back(timeops(name, items, n, [&](size_t i) {
+         const Key &k = keys[(ops[i] >> 8) % (2 * n)];
+         int roll = ops[i] % 100;
+         if (roll < readpercents[r]) t.search(k, found);
+         else if (roll & 1) t.insert_or_assign(k, value);
+         else t.remove(k);
+      }));
+   }
+
+   // range scans of about 100 entries from a random start
+   size_t scans = max((size_t)1, n / 100);
+   size_t visited = 0;
+   for (size_t i = 0; i < scans; i++) probes[i] = rng() % (2 * n);
+   rows.push_back(timeops("scan-100", items, scans, [&](size_t i) {
+      size_t last = min(probes[i] + 200, 2 * n - 1);
+      t.for_each_in_range(keys[probes[i]], keys[last],
+                          [&](const Key &, const Value &) { visited++; });
+   }));
+
+   // tear the tree down in random order
+   size_t left = t.size();
+   vector<size_t> victims(2 * n);
+   for (size_t i = 0; i < 2 * n; i++) victims[i] = i;
+   shuffle(victims.begin(), victims.end(), rng);
+   rows.push_back(timeops("delete-all", items, 2 * n, [&](size_t i) {
+      if (t.remove(keys[victims[i]])) left--;
+   }));
+   if (left != 0 || visited == 0) cerr << "suite: inconsistent tree\n";
+}
+
+int benchsuite(int argc, char **argv)
+//the full workload suite: load orders, uniform and Zipfian reads, read
+//and write mixes, range scans and a delete phase, for several key and
+//value sizes
+//options: [entries (default 200000)] [format: text or csv (default text)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 200000;
+   bool csv = (argc > 1) && (strcmp(argv[1], "csv") == 0);
+   if (n == 0) n = 1;
+
+   vector<suiterow> rows;
+   runsuite<uint64_t, uint64_t>("u64/u64", 8, 8, n, rows);
+   runsuite<string, uint64_t>("str16/u64", 16, 8, n, rows);
+   runsuite<string, string>("str64/str256", 64, 256, n, rows);
+
+   if (csv) {
+      printf("workload,items,entries,ops,seconds,ops_per_s,p50_ns,p99_ns,"
+             "p999_ns,bytes_per_entry\n");
+   } else {
+      printf("%zu entries\n%-16s %-13s %12s %9s %9s %9s %9s\n", n,
+             "workload", "items", "ops/s", "p50 ns", "p99 ns", "p99.9 ns",
+             "B/entry");
+   }
+   for (size_t i = 0; i < rows.size(); i++) {
+      const suiterow &r = rows[i];
+      double rate = r.seconds > 0 ? r.ops / r.seconds : 0;
+      if (csv) {
+         printf("%s,%s,%zu,%zu,%.6f,%.0f,%.0f,%.0f,%.0f,%.1f\n",
+                r.workload.c_str(), r.items.c_str(), n, r.ops, r.seconds,
+                rate, r.p50, r.p99, r.p999, r.bytesperentry);
+      } else {
+         printf("%-16s %-13s %12.0f %9.0f %9.0f %9.0f ", r.workload.c_str(),
+                r.items.c_str(), rate, r.p50, r.p99, r.p999);
+         if (r.bytesperentry > 0) printf("%9.1f\n", r.bytesperentry);
+         else printf("%9s\n", "-");
+      }
+   }
+   return 0;
+}
+
+template <class Key, class Value>
+void rundelete(const char *items, size_t keysize, size_t valuesize,
+               size_t n)
+//the delete-heavy phases for one key/value type
+{
+   typedef avltree<Key, Value> tree;
+   vector<Key> keys(2 * n);
+   for (size_t i = 0; i < 2 * n; i++) makeitem(i, keysize, keys[i]);
+   Value value;
+   makeitem(42, valuesize, value);
+   mt19937_64 rng(11);
+   vector<size_t> order(n);
+   for (size_t i = 0; i < n; i++) order[i] = 2 * i;
+   shuffle(order.begin(), order.end(), rng);
+
+   char label[64];
+   {
+      tree t;
+      for (size_t i = 0; i < n; i++) t.insert(keys[order[i]], value);
+      benchclock::time_point start = benchclock::now();
+      for (size_t i = 0; i < n; i++) t.remove(keys[order[i]]);
+      snprintf(label, sizeof(label), "%s remove all, random", items);
+      report(label, n, secondssince(start));
+   }
+   {
+      tree t;
+      for (size_t i = 0; i < n; i++) t.insert(keys[order[i]], value);
+      benchclock::time_point start = benchclock::now();
+      for (size_t i = 0; i < n; i++) t.remove(keys[2 * i]);
+      snprintf(label, sizeof(label), "%s remove all, ascending", items);
+      report(label, n, secondssince(start));
+   }
+   {
+      // remove a present key, insert an absent one, at a steady size
+      tree t;
+      for (size_t i = 0; i < n; i++) t.insert(keys[order[i]], value);
+      vector<size_t> present(order), absent(n);
+      for (size_t i = 0; i < n; i++) absent[i] = 2 * i + 1;
+      shuffle(absent.begin(), absent.end(), rng);
+      benchclock::time_point start = benchclock::now();
+      for (size_t i = 0; i < n; i++) {
+         t.remove(keys[present[i]]);
+         t.insert(keys[absent[i]], value);
+      }
+      snprintf(label, sizeof(label), "%s churn", items);
+      report(label, 2 * n, secondssince(start));
+   }
+}
+
+int benchdelete(int argc, char **argv)
+//delete-heavy phases: emptying a tree in random and in ascending order,
+//and churning it with paired removes and inserts
+//options: [entries (default 1000000)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   printf("%zu entries\n", n);
+   rundelete<uint64_t, uint64_t>("u64/u64", 8, 8, n);
+   rundelete<string, string>("str64/str256", 64, 256, n);
+   return 0;
+}
+
+int benchinsert(int argc, char **argv)
+//insert throughput for ascending, random and zigzag orders; built with
+//AVLTREE_STATS it also reports the rebalancing work per insert: node
+//writes (height/balance/size recomputed), rotations and nodes visited,
+//the node writes being what decides how many cache lines get dirtied
+//options: [entries (default 1000000)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   vector<uint64_t> ascending(n), zigzag(n);
+   for (size_t i = 0; i < n; i++) ascending[i] = i;
+   vector<uint64_t> shuffled = ascending;
+   shuffle(shuffled.begin(), shuffled.end(), mt19937_64(3));
+   for (size_t i = 0, lo = 0, hi = n; i < n; i++)
+      zigzag[i] = (i & 1) ? --hi : lo++;
+   printf("%zu entries\n", n);
+
+   const char *labels[] = { "insert, ascending", "insert, random",
+                            "insert, zigzag" };
+   const vector<uint64_t> *orders[] = { &ascending, &shuffled, &zigzag };
+   for (int o = 0; o < 3; o++) {
+      numtree t;
+      const vector<uint64_t> &keys = *orders[o];
+      benchclock::time_point start = benchclock::now();
+      for (size_t i = 0; i < n; i++) t.insert(keys[i], i);
+      report(labels[o], n, secondssince(start));
+#ifdef AVLTREE_STATS
+      avlstats s = t.stats();
+      double visited = 0;
+      for (int d = 0; d < avlstats::maxpath; d++)
+         visited += (double)d * s.insertpaths[d];
+      printf("   %.2f node writes, %.3f rotations, %.1f nodes visited "
+             "per insert\n", (double)s.heightupdates / n,
+             (double)(s.rotateleft + s.rotateright + s.rotateleftright +
+                      s.rotaterightleft) / n, visited / n);
+#endif
+   }
+#ifndef AVLTREE_STATS
+   printf("(build with -DAVLTREE_STATS to count the work per insert)\n");
+#endif
+   return 0;
+}
+
+typedef shardedavltree<uint64_t, uint64_t> shardtree;
+
+int benchsharded(int argc, char **argv)
+//write throughput as writer threads are added, for an avltree behind
+//one mutex and for hash and range sharded trees; the range shards are
+//either fixed up front or grown by splitting from a single shard
+//options: [entries (default 1000000)] [shards (default: 4 x cores)]
+//         [seconds per run (default 1)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   size_t nshards = (argc > 1) ? strtoul(argv[1], NULL, 10)
+                               : 4 * defaultthreads();
+   double seconds = (argc > 2) ? strtod(argv[2], NULL) : 1;
+   if (nshards == 0) nshards = 1;
+   printf("%zu entries, %zu shards, %.1f s per run\n", n, nshards, seconds);
+
+   // runmixed draws keys from [0, 2n)
+   vector<uint64_t> boundaries;
+   for (size_t i = 1; i < nshards; i++)
+      boundaries.push_back(2 * n * i / nshards);
+   unsigned cores = defaultthreads();
+   for (unsigned writers = 1; ; writers *= 2) {
+      if (writers > cores) writers = cores;
+      char label[64];
+      {
+         lockedtree t;
+         snprintf(label, sizeof(label), "mutex, %u writers", writers);
+         runmixed(t, label, n, 0, writers, seconds);
+      }
+      {
+         shardtree t(nshards);
+         snprintf(label, sizeof(label), "hash, %u writers", writers);
+         runmixed(t, label, n, 0, writers, seconds);
+      }
+      {
+         shardtree t(boundaries);
+         snprintf(label, sizeof(label), "range, %u writers", writers);
+         runmixed(t, label, n, 0, writers, seconds);
+      }
+      {
+         shardtree t(vector<uint64_t>(), n / nshards + 1);
+         snprintf(label, sizeof(label), "range split, %u writers", writers);
+         runmixed(t, label, n, 0, writers, seconds);
+      }
+      if (writers == cores) break;
+   }
+   return 0;
+}
+
+template <class Tree, class Key>
+double timescans(const Tree &t, const vector<Key> &starts, size_t length)
+//the average time of one scan of length entries from each start key,
+//in nanoseconds
+{
+   uint64_t sum = 0;
+   benchclock::time_point start = benchclock::now();
+   for (size_t i = 0; i < starts.size(); i++) {
+      typename Tree::const_iterator it = t.lower_bound(starts[i]);
+      for (size_t j = 0; j < length && it != t.end(); j++, ++it)
+         sum += it.value();
+   }
+   double seconds = secondssince(start);
+   if (sum == 1) printf(" ");
+   return seconds * 1e9 / starts.size();
+}
+
+template <class Key>
+void runfrozen(const char *label, vector<Key> &keys, size_t lookups)
+//random lookups and short range scans on a tree of the given (distinct)
+//keys, before and after freezing it
+{
+   size_t n = keys.size();
+   vector<Key> probes(lookups);
+   mt19937_64 rng(2);
+   for (size_t i = 0; i < lookups; i++) probes[i] = keys[rng() % n];
+   vector<Key> starts(probes.begin(), probes.begin() + lookups / 10);
+
+   avltree<Key, uint64_t> t;
+   {
+      sort(keys.begin(), keys.end());
+      vector< pair<Key, uint64_t> > items(n);
+      for (size_t i = 0; i < n; i++) items[i] = make_pair(keys[i], i);
+      vector<Key>().swap(keys);
+      t.build_from_sorted(items.begin(), items.end(), 0);
+   }
+   printf("%s, %zu entries\n", label, n);
+   printf("   %-18s %8.1f ns/lookup %10.1f ns/scan of 100\n", "avltree",
+          timelookups(t, probes), timescans(t, starts, 100));
+   benchclock::time_point start = benchclock::now();
+   frozenavltree<Key, uint64_t> frozen = t.freeze();
+   double freezing = secondssince(start);
+   t.clear();
+   printf("   %-18s %8.1f ns/lookup %10.1f ns/scan of 100 "
+          "(%.2f s to freeze, %.1f bytes/entry)\n", "frozenavltree",
+          timelookups(frozen, probes), timescans(frozen, starts, 100),
+          freezing, (double)frozen.bytes() / n);
+}
+
+int benchfrozen(int argc, char **argv)
+//lookup and range scan latency of the pointer tree against its frozen
+//Eytzinger copy, for 8 byte integer keys and 16 character string keys
+//(whose prefixes rarely tie), at each size given
+//options: [entries ... (default 1000000 10000000 100000000)]
+{
+   vector<size_t> sizes;
+   for (int i = 0; i < argc; i++) sizes.push_back(strtoul(argv[i], NULL, 10));
+   if (sizes.empty()) {
+      sizes.push_back(1000000);
+      sizes.push_back(10000000);
+      sizes.push_back(100000000);
+   }
+   const size_t lookups = 2000000;
+   for (size_t s = 0; s < sizes.size(); s++) {
+      size_t n = sizes[s];
+      {
+         vector<uint64_t> keys(n);
+         for (size_t i = 0; i < n; i++) keys[i] = i * 2 + 1;
+         runfrozen("u64", keys, lookups);
+      }
+      {
+         vector<string> keys(n);
+         char text[24];
+         for (size_t i = 0; i < n; i++) {
+            // a bijection on 64 bits, so the keys stay distinct
+            snprintf(text, sizeof(text), "%016llx",
+                     (unsigned long long)(i * 0x9e3779b97f4a7c15ULL));
+            keys[i] = text;
+         }
+         runfrozen("str16", keys, lookups);
+      }
+   }
+   return 0;
+}
+
+template <class Tree>
+void runbuckets(const char *label,
+                const vector< pair<uint64_t, uint64_t> > &items,
+                const vector<uint64_t> &probes)
+//insert the items, then time random lookups and scans of 100 entries
+{
+   size_t n = items.size();
+   countingallocator slabs;
+   Tree t(less<uint64_t>(), &slabs);
+   benchclock::time_point start = benchclock::now();
+   for (size_t i = 0; i < n; i++) t.insert(items[i].first, items[i].second);
+   double inserting = secondssince(start);
+   double lookup = timelookups(t, probes);
+
+   // the keys are the odd numbers, so each scan covers 100 entries
+   uint64_t sum = 0;
+   size_t scans = probes.size() / 10;
+   start = benchclock::now();
+   for (size_t i = 0; i < scans; i++)
+      t.for_each_in_range(probes[i], probes[i] + 198,
+                          [&sum](const uint64_t &, uint64_t &v) {
+                             sum += v;
+                          });
+   double scan = secondssince(start) * 1e9 / scans;
+   if (sum == 1) printf(" ");
+   printf("%-22s %6.1f bytes/entry %7.1f ns/insert %7.1f ns/lookup "
+          "%8.1f ns/scan of 100\n", label, (double)slabs.bytes / n,
+          inserting * 1e9 / n, lookup, scan);
+}
+
+int benchbuckets(int argc, char **argv)
+//memory per entry, insert, lookup and scan cost of avltree against
+//bucketavltree at a few bucket sizes
+//options: [entries (default 1000000)] [lookups (default 2000000)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   size_t lookups = (argc > 1) ? strtoul(argv[1], NULL, 10) : 2000000;
+   vector< pair<uint64_t, uint64_t> > items = randomitems(n, 1);
+   vector<uint64_t> probes(lookups);
+   mt19937_64 rng(2);
+   for (size_t i = 0; i < lookups; i++) probes[i] = items[rng() % n].first;
+   printf("%zu entries of 8 byte keys and values, %zu lookups\n", n,
+          lookups);
+
+   runbuckets<numtree>("avltree", items, probes);
+   runbuckets< bucketavltree<uint64_t, uint64_t, less<uint64_t>, 16> >(
+      "bucketavltree, 16", items, probes);
+   runbuckets< bucketavltree<uint64_t, uint64_t, less<uint64_t>, 32> >(
+      "bucketavltree, 32", items, probes);
+   runbuckets< bucketavltree<uint64_t, uint64_t, less<uint64_t>, 64> >(
+      "bucketavltree, 64", items, probes);
+   return 0;
+}
+
+// comparisons per lookup (and how many of them read the arena) from
+//    the trees' counters, which only count with AVLTREE_STATS
+void printcomparisons(const avlstats &s, unsigned long long arena,
+                      size_t lookups)
+{
+#ifdef AVLTREE_STATS
+   printf("   %.1f comparisons/lookup, %.2f reading the arena\n",
+          (double)s.comparisons / lookups, (double)arena / lookups);
+#else
+   (void)s;
+   (void)arena;
+   (void)lookups;
+#endif
+}
+
+void runarena(const char *label, const vector<string> &keys,
+              const vector<string> &probes)
+//memory per key and lookup cost of string keys in their own strings,
+//in a key arena, and in a front compressed key arena
+{
+   size_t n = keys.size();
+   printf("%s, %zu keys of %.1f bytes on average\n", label, n,
+          [&keys]() {
+             double total = 0;
+             for (size_t i = 0; i < keys.size(); i++) total += keys[i].size();
+             return total / keys.size();
+          }());
+   {
+      countingallocator slabs;
+      avltree<string, uint64_t> t(&slabs);
+      size_t heap = 0;
+      for (size_t i = 0; i < n; i++) {
+         t.insert(keys[i], i);
+         heap += heapbytes(keys[i]);
+      }
+      t.resetstats();
+      double lookup = timelookups(t, probes);
+      printf("   %-24s %6.1f bytes/key %8.1f ns/lookup\n", "string keys",
+             (double)(slabs.bytes + heap) / n, lookup);
+      printcomparisons(t.stats(), 0, probes.size());
+   }
+   for (int compress = 0; compress < 2; compress++) {
+      countingallocator slabs;
+      arenaavltree<uint64_t> t(compress != 0, 16, &slabs);
+      for (size_t i = 0; i < n; i++) t.insert(keys[i], i);
+      // rewritten in key order, so neighbours share the most
+      t.compact();
+      t.resetstats();
+      double lookup = timelookups(t, probes);
+      printf("   %-24s %6.1f bytes/key %8.1f ns/lookup\n",
+             compress ? "arena, front compressed" : "arena",
+             (double)(slabs.bytes + t.arenabytes()) / n, lookup);
+      printcomparisons(t.stats(), t.arenacomparisons(), probes.size());
+   }
+}
+
+int bencharena(int argc, char **argv)
+//string keys in a key arena with inline prefixes, against plain string
+//keys, for keys that differ early (host names first) and URLs that all
+//share their first 8 bytes, where the prefixes can't help
+//options: [keys (default 1000000)] [lookups (default 1000000)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   size_t lookups = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+   const char *stems[] = { "shop", "news", "mail", "blog", "docs", "wiki",
+                           "maps", "play" };
+   const char *sections[] = { "catalog", "search", "account", "help" };
+   vector<string> hosts(n), urls(n);
+   mt19937_64 rng(1);
+   char text[128];
+   for (size_t i = 0; i < n; i++) {
+      unsigned long long item = i * 0x9e3779b97f4a7c15ULL;
+      const char *stem = stems[rng() % 8];
+      unsigned site = rng() % 1000;
+      const char *section = sections[rng() % 4];
+      snprintf(text, sizeof(text), "%s%u.example.com/%s/item/%016llx",
+               stem, site, section, item);
+      hosts[i] = text;
+      snprintf(text, sizeof(text),
+               "https://www.example.com/%s/%s%u/item/%016llx", section,
+               stem, site, item);
+      urls[i] = text;
+   }
+   vector<string> probes(lookups);
+   for (size_t i = 0; i < lookups; i++) probes[i] = hosts[rng() % n];
+   runarena("host first keys", hosts, probes);
+   for (size_t i = 0; i < lookups; i++) probes[i] = urls[rng() % n];
+   runarena("URL keys", urls, probes);
+#ifndef AVLTREE_STATS
+   printf("(build with -DAVLTREE_STATS to count the comparisons)\n");
+#endif
+   return 0;
+}
+
+int benchcache(int argc, char **argv)
+//a cache in front of a slow store (each load spins for the given
+//time), read with Zipfian popularity by several threads through
+//get_or_load, at budgets from 1% to 50% of the keys: hit rate,
+//throughput and how many loads the single flight saved
+//options: [keys (default 1000000)] [reads (default 2000000)]
+//         [threads (default: cores)] [load microseconds (default 20)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   size_t reads = (argc > 1) ? strtoul(argv[1], NULL, 10) : 2000000;
+   unsigned threads = (argc > 2) ? strtoul(argv[2], NULL, 10) : 0;
+   double loadus = (argc > 3) ? strtod(argv[3], NULL) : 20;
+   if (threads == 0) threads = defaultthreads();
+   printf("%zu keys, %zu reads, %u threads, %.0f us per load\n", n, reads,
+          threads, loadus);
+
+   zipfian popularity(n, 0.99);
+   vector<uint64_t> keys(reads);
+   mt19937_64 rng(1);
+   for (size_t i = 0; i < reads; i++) keys[i] = popularity(rng);
+   auto slowload = [loadus](const uint64_t &k, uint64_t &d) {
+      benchclock::time_point start = benchclock::now();
+      while (secondssince(start) * 1e6 < loadus) { }
+      d = k;
+      return true;
+   };
+
+   const double budgets[] = { 0.01, 0.05, 0.2, 0.5 };
+   for (int b = 0; b < 4; b++) {
+      size_t budget = (size_t)(n * budgets[b]);
+      avlcache<uint64_t, uint64_t> cache(budget ? budget : 1);
+      atomic<size_t> next(0);
+      benchclock::time_point start = benchclock::now();
+      vector<thread> workers;
+      for (unsigned t = 0; t < threads; t++) {
+         workers.push_back(thread([&]() {
+            uint64_t d;
+            for (size_t i = next++; i < reads; i = next++)
+               cache.get_or_load(keys[i], d, slowload);
+         }));
+      }
+      for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+      double seconds = secondssince(start);
+      avlcachestats s = cache.stats();
+      char label[64];
+      snprintf(label, sizeof(label), "budget %.0f%% of keys",
+               budgets[b] * 100);
+      printf("%-22s %6.1f%% hits %10.0f reads/s %9llu evictions "
+             "%7llu loads shared\n", label,
+             100.0 * s.hits / (s.hits + s.misses), reads / seconds,
+             s.evictions, s.coalesced);
+   }
+   return 0;
+}
+
+int benchaugment(int argc, char **argv)
+//range sums and interval overlap queries over random entries,
+//answered from the subtree aggregates an Augment keeps, against
+//walking the entries in range (for the sums) or every entry (for the
+//overlaps, which an ordinary tree keyed by start can't prune)
+//options: [entries (default 1000000)] [queries (default 10000)]
+{
+   size_t n = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+   size_t queries = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10000;
+   printf("%zu entries, %zu queries\n", n, queries);
+
+   mt19937_64 rng(1);
+   uint64_t space = 16 * (uint64_t)n;
+   vector< pair<uint64_t, uint64_t> > items(n);
+   for (size_t i = 0; i < n; i++) {
+      items[i].first = rng() % space;
+      items[i].second = rng() % 1000;
+   }
+   avltree<uint64_t, uint64_t> plain;
+   avltree<uint64_t, uint64_t, less<uint64_t>,
+           sumaugment<uint64_t, uint64_t> > sums;
+   for (size_t i = 0; i < n; i++) {
+      plain.insert(items[i].first, items[i].second);
+      sums.insert(items[i].first, items[i].second);
+   }
+
+   // sums over ranges a tenth of the key space wide
+   vector<uint64_t> starts(queries);
+   for (size_t i = 0; i < queries; i++) starts[i] = rng() % space;
+   uint64_t checksum = 0, check2 = 0;
+   benchclock::time_point start = benchclock::now();
+   for (size_t i = 0; i < queries; i++) {
+      uint64_t total = 0;
+      plain.for_each_in_range(starts[i], starts[i] + space / 10,
+         [&total](const uint64_t &, const uint64_t &d) { total += d; });
+      checksum += total;
+   }
+   double walk = secondssince(start);
+   start = benchclock::now();
+   for (size_t i = 0; i < queries; i++) {
+      uint64_t total = 0;
+      sums.aggregate(starts[i], starts[i] + space / 10, total);
+      check2 += total;
+   }
+   double aggregated = secondssince(start);
+   printf("%-22s %12.0f queries/s\n", "range sum, walk",
+          queries / walk);
+   printf("%-22s %12.0f queries/s  %s\n", "range sum, aggregate",
+          queries / aggregated, checksum == check2 ? "" : "MISMATCH");
+
+   // intervals of up to 64 keys' width, keyed by start
+   avltree<uint64_t, uint64_t, less<uint64_t>,
+           maxaugment<uint64_t, uint64_t> > intervals;
+   for (size_t i = 0; i < n; i++)
+      intervals.insert(items[i].first, items[i].first + rng() % 64);
+   size_t found = 0, found2 = 0;
+   size_t scans = queries / 100 ? queries / 100 : 1;
+   start = benchclock::now();
+   for (size_t i = 0; i < scans; i++) {
+      uint64_t a = starts[i], b = a + 16;
+      typedef avltree<uint64_t, uint64_t, less<uint64_t>,
+                      maxaugment<uint64_t, uint64_t> >::iterator iterator;
+      for (iterator it = intervals.begin(); it != intervals.end(); ++it)
+         if (it.key() <= b && it.value() >= a) found++;
+   }
+   double scanned = secondssince(start);
+   start = benchclock::now();
+   for (size_t i = 0; i < scans; i++) {
+      intervals.for_each_overlapping(starts[i], starts[i] + 16,
+         [&found2](const uint64_t &, const uint64_t &) { found2++; });
+   }
+   double pruned = secondssince(start);
+   printf("%-22s %12.0f queries/s\n", "overlaps, scan",
+          scans / scanned);
+   printf("%-22s %12.0f queries/s  %s\n", "overlaps, pruned",
+          scans / pruned, found == found2 ? "" : "MISMATCH");
+   return 0;
+}
+
+struct scenario {
+   const char *name;
+   int (*run)(int argc, char **argv);
+   const char *help;
+};
+
+const scenario scenarios[] = {
+   { "build", benchbuild,
+     "[entries] [threads]  repeated insert vs bulk build" },
+   { "concurrent", benchconcurrent,
+     "[entries] [readers] [writers] [seconds]  concurrent read/write "
+     "throughput" },
+   { "layout", benchlayout,
+     "[entries] [lookups]  memory and lookup latency, avltree vs "
+     "compactavltree" },
+   { "batch", benchbatch,
+     "[entries] [batch size] [lookups]  search loop vs search_batch" },
+   { "image", benchimage,
+     "[entries] [path]  rebuild by insert vs save and open_mapped" },
+   { "durable", benchdurable,
+     "[inserts] [threads] [directory]  write-ahead log throughput and "
+     "latency per fsync policy" },
+   { "suite", benchsuite,
+     "[entries] [text|csv]  the full workload suite, csv for diffing" },
+   { "delete", benchdelete,
+     "[entries]  delete-heavy phases" },
+   { "insert", benchinsert,
+     "[entries]  insert throughput (and, with AVLTREE_STATS, work per "
+     "insert)" },
+   { "sharded", benchsharded,
+     "[entries] [shards] [seconds]  write scaling, one mutex vs sharded "
+     "trees" },
+   { "frozen", benchfrozen,
+     "[entries ...]  lookups and scans, avltree vs its frozen copy" },
+   { "buckets", benchbuckets,
+     "[entries] [lookups]  avltree vs bucketavltree" },
+   { "arena", bencharena,
+     "[keys] [lookups]  string keys vs a key arena with inline "
+     "prefixes" },
+   { "cache", benchcache,
+     "[keys] [reads] [threads] [load us]  avlcache hit rate and "
+     "throughput by budget" },
+   { "augment", benchaugment,
+     "[entries] [queries]  range sums and interval overlaps from "
+     "subtree aggregates" },
+};
+const size_t nscenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+
+int main(int argc, char **argv)
+{
+   if (argc >= 2) {
+      for (size_t i = 0; i < nscenarios; i++)
+         if (strcmp(argv[1], scenarios[i].name) == 0)
+            return scenarios[i].run(argc - 2, argv + 2);
+   }
+   cerr << "usage: " << argv[0] << " <scenario> [options]\n";
+   for (size_t i = 0; i < nscenarios; i++)
+      cerr << "   " << scenarios[i].name << " " << scenarios[i].help << "\n";
+   return 2;
+}
@@ -0,0 +1,293 @@
+/*
+AVL tree map whose nodes hold sorted buckets of entries
+*/
+
+#ifndef BUCKETAVLTREE_H
+#define BUCKETAVLTREE_H 1
+
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include "avltree.h"
+using namespace std;
+
+// a map that keeps its entries in small sorted arrays (buckets) of up
+//    to Capacity entries, with an avltree indexing the buckets: a
+//    search descends a tree Capacity / 2 or more times smaller, and
+//    finishes with a scan through one contiguous bucket
+// the index is an ordinary avltree keyed by a separator per bucket,
+//    so its insert, remove and rotations balance the buckets exactly
+//    as they would single entries
+// a bucket holds the keys from its separator up to the next bucket's;
+//    removing a bucket's smallest key leaves its separator standing,
+//    which is harmless, except for the first bucket, which is re-keyed
+//    when a key below its separator arrives
+// a full bucket splits in two; a bucket that falls to a quarter full
+//    merges with a neighbour if the two fit in one
+// Key and Value must be default constructible
+template <class Key, class Value, class Compare = less<Key>,
+          unsigned Capacity = 32>
+class bucketavltree {
+   static_assert(Capacity >= 4, "buckets must hold at least 4 entries");
+   private:
+      struct bucket {
+         unsigned count;
+         Key keys[Capacity];
+         Value values[Capacity];
+         bucket() : count(0) { }
+
+         // the position of the first key not less than k
+         // arithmetic keys under less<Key> are counted rather than
+         //    searched for: the loop has no branches and no early exit,
+         //    so the compiler can vectorize it
+         unsigned rank(const Key &k, const Compare &comp) const {
+            unsigned i = 0;
+            if (is_arithmetic<Key>::value &&
+                is_same<Compare, less<Key> >::value) {
+               for (unsigned j = 0; j < count; j++) i += comp(keys[j], k);
+               return i;
+            }
+            while (i < count && comp(keys[i], k)) i++;
+            return i;
+         }
+         void insertat(unsigned pos, const Key &k, const Value &d) {
+            for (unsigned j = count; j > pos; j--) {
+               keys[j] = std::move(keys[j - 1]);
+               values[j] = std::move(values[j - 1]);
+            }
+            keys[pos] = k;
+            values[pos] = d;
+            count++;
+         }
+         void eraseat(unsigned pos) {
+            for (unsigned j = pos + 1; j < count; j++) {
+               keys[j - 1] = std::move(keys[j]);
+               values[j - 1] = std::move(values[j]);
+            }
+            count--;
+         }
+         // move the entries from position from on to the end of to
+         void moveto(bucket &to, unsigned from) {
+            for (unsigned j = from; j < count; j++) {
+               to.keys[to.count] = std::move(keys[j]);
+               to.values[to.count] = std::move(values[j]);
+               to.count++;
+            }
+            count = from;
+         }
+      };
+
+      typedef avltree<Key, bucket, Compare> index;
+      typedef typename index::iterator bucketiterator;
+      typedef typename index::const_iterator constbucketiterator;
+
+      index buckets;
+      size_t entries;
+      Compare comp;
+
+      // the bucket k belongs in (the first one if k is below every
+      //    separator), or end() if there are no buckets
+      bucketiterator locate(const Key &k) {
+         bucketiterator it = buckets.upper_bound(k);
+         if (it != buckets.begin()) --it;
+         return it;
+      }
+      constbucketiterator locate(const Key &k) const {
+         constbucketiterator it = buckets.upper_bound(k);
+         if (it != buckets.begin()) --it;
+         return it;
+      }
+      template <class V> bool put(const Key &k, V &&d, bool assign);
+      bool rekeyfirst(const Key &k);
+
+   public:
+      // the index's nodes (and so the buckets) are carved out of slabs
+      //    obtained from source, or from operator new if none is given
+      bucketavltree(const Compare &c = Compare(),
+                    slaballocator *source = NULL) :
+         buckets(c, source), entries(0), comp(c) { }
+
+      // as the avltree methods of the same names; an insert returns
+      //    false if memory runs out
+      bool insert(const Key &k, const Value &d) { return put(k, d, false); }
+      bool insert_or_assign(const Key &k, const Value &d) {
+         return put(k, d, true);
+      }
+      bool remove(const Key &k);
+      bool search(const Key &k, Value &d) const;
+      size_t size() const { return entries; }
+      size_t bucketcount() const { return buckets.size(); }
+      void clear() {
+         buckets.clear();
+         entries = 0;
+      }
+
+      // call fn(key, value) for every entry (from lo to hi inclusive),
+      //    in key order
+      template <class F> void for_each(F fn);
+      template <class F> void for_each_in_range(const Key &lo, const Key &hi,
+                                                F fn);
+
+      // check the index, that every bucket is sorted and lies between
+      //    its own and the next separator, and the entry count
+      bool checkvalid();
+};
+
+template <class Key, class Value, class Compare, unsigned Capacity>
+bool bucketavltree<Key, Value, Compare, Capacity>::search(const Key &k,
+                                                          Value &d) const
+{
+   constbucketiterator it = locate(k);
+   if (it == buckets.end()) return false;
+   const bucket &b = it.value();
+   unsigned pos = b.rank(k, comp);
+   if (pos == b.count || comp(k, b.keys[pos])) return false;
+   d = b.values[pos];
+   return true;
+}
+
+template <class Key, class Value, class Compare, unsigned Capacity>
+bool bucketavltree<Key, Value, Compare, Capacity>::rekeyfirst(const Key &k)
+// move the first bucket under the separator k, below its old one
+// the bucket is inserted anew before the old entry goes, so running
+//    out of memory changes nothing
+{
+   bucketiterator first = buckets.begin();
+   Key old = first.key();
+   if (!buckets.try_emplace(k, std::move(first.value()))) return false;
+   buckets.remove(old);
+   return true;
+}
+
+template <class Key, class Value, class Compare, unsigned Capacity>
+template <class V>
+bool bucketavltree<Key, Value, Compare, Capacity>::put(const Key &k, V &&d,
+                                                       bool assign)
+// insert k into its bucket, splitting the bucket first if it is full
+// buckets are reached through references to the index's values, which
+//    stay put while the index changes around them
+{
+   bucketiterator it = locate(k);
+   if (it == buckets.end()) {
+      if (!buckets.try_emplace(k)) return false;
+      buckets.begin().value().insertat(0, k, d);
+      entries++;
+      return true;
+   }
+   bucket *b = &it.value();
+   unsigned pos = b->rank(k, comp);
+   if (pos < b->count && !comp(k, b->keys[pos])) {
+      if (assign) b->values[pos] = std::forward<V>(d);
+      return false;
+   }
+   if (comp(k, it.key())) {
+      // a new smallest key
+      if (!rekeyfirst(k)) return false;
+      b = &buckets.begin().value();
+   }
+   if (b->count == Capacity) {
+      // the upper half goes to a new bucket after this one
+      unsigned half = Capacity / 2;
+      Key separator = b->keys[half];
+      if (!buckets.try_emplace(separator)) return false;
+      bucket &upper = buckets.find(separator).value();
+      b->moveto(upper, half);
+      if (pos > half) {
+         b = &upper;
+         pos -= half;
+      }
+   }
+   b->insertat(pos, k, d);
+   entries++;
+   return true;
+}
+
+template <class Key, class Value, class Compare, unsigned Capacity>
+bool bucketavltree<Key, Value, Compare, Capacity>::remove(const Key &k)
+// a bucket that empties is dropped; one that falls to a quarter full
+//    takes in the next bucket, or else moves into the previous one,
+//    if the two fit in one bucket
+{
+   bucketiterator it = locate(k);
+   if (it == buckets.end()) return false;
+   bucket &b = it.value();
+   unsigned pos = b.rank(k, comp);
+   if (pos == b.count || comp(k, b.keys[pos])) return false;
+   b.eraseat(pos);
+   entries--;
+
+   if (b.count == 0) {
+      Key separator = it.key();
+      buckets.remove(separator);
+      return true;
+   }
+   if (b.count > Capacity / 4) return true;
+   bucketiterator next = it;
+   ++next;
+   if (next != buckets.end() && b.count + next.value().count <= Capacity) {
+      next.value().moveto(b, 0);
+      Key separator = next.key();
+      buckets.remove(separator);
+   } else if (it != buckets.begin()) {
+      bucketiterator previous = it;
+      --previous;
+      if (previous.value().count + b.count <= Capacity) {
+         b.moveto(previous.value(), 0);
+         Key separator = it.key();
+         buckets.remove(separator);
+      }
+   }
+   return true;
+}
+
+template <class Key, class Value, class Compare, unsigned Capacity>
+template <class F>
+void bucketavltree<Key, Value, Compare, Capacity>::for_each(F fn)
+{
+   for (bucketiterator it = buckets.begin(); it != buckets.end(); ++it) {
+      bucket &b = it.value();
+      for (unsigned i = 0; i < b.count; i++) fn(b.keys[i], b.values[i]);
+   }
+}
+
+template <class Key, class Value, class Compare, unsigned Capacity>
+template <class F>
+void bucketavltree<Key, Value, Compare, Capacity>::for_each_in_range(
+   const Key &lo, const Key &hi, F fn)
+// start part way into lo's bucket, then run through whole buckets
+{
+   bucketiterator it = locate(lo);
+   if (it == buckets.end()) return;
+   unsigned i = it.value().rank(lo, comp);
+   for (; it != buckets.end(); ++it, i = 0) {
+      bucket &b = it.value();
+      for (; i < b.count; i++) {
+         if (comp(hi, b.keys[i])) return;
+         fn(b.keys[i], b.values[i]);
+      }
+   }
+}
+
+template <class Key, class Value, class Compare, unsigned Capacity>
+bool bucketavltree<Key, Value, Compare, Capacity>::checkvalid()
+{
+   if (entries == 0) return buckets.size() == 0;
+   if (!buckets.checkvalid()) return false;
+   size_t total = 0;
+   const Key *last = NULL;
+   for (bucketiterator it = buckets.begin(); it != buckets.end(); ++it) {
+      const bucket &b = it.value();
+      if (b.count == 0 || b.count > Capacity) return false;
+      // the bucket's keys are not below its separator, and above the
+      //    previous bucket's keys
+      if (comp(b.keys[0], it.key())) return false;
+      if (last && !comp(*last, it.key())) return false;
+      for (unsigned i = 1; i < b.count; i++)
+         if (!comp(b.keys[i - 1], b.keys[i])) return false;
+      last = &b.keys[b.count - 1];
+      total += b.count;
+   }
+   return total == entries;
+}
+
+#endif
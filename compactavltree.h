@@ -0,0 +1,381 @@
+/*
+AVL tree with a compact, array based node layout
+*/
+
+#ifndef COMPACTAVLTREE_H
+#define COMPACTAVLTREE_H 1
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+using namespace std;
+
+// an AVL tree map laid out for cache density rather than flexibility
+//
+// nodes live in one contiguous array and refer to their children by
+//    32 bit index instead of by pointer; index 0 is the null child
+// instead of a height and a balance, each node keeps only its balance
+//    factor (-1, 0 or +1), packed into the top two bits of its left
+//    child index, which limits the tree to 2^30 - 1 entries
+// keys and values are stored inline in the node
+// there are no parent or lastvisit links: insert and remove record
+//    the path they took on a small stack and rebalance from that,
+//    stopping as soon as a subtree's height is unchanged
+// removed slots are kept on a free list and reused; the array itself
+//    only shrinks on clear()
+// Key and Value must be default constructible
+template <class Key, class Value, class Compare = less<Key> >
+class compactavltree {
+   private:
+      typedef uint32_t index;
+
+      struct node {
+          index  link[2];        // left (with the balance bits), right
+          Key    key;
+          Value  data;
+      };
+
+      static const index linkmask = 0x3fffffff;
+      static const int balanceshift = 30;
+      // deep enough for 2^30 entries (AVL height < 1.45 log2 n)
+      static const int maxdepth = 48;
+
+      vector<node> nodes;        // nodes[0] is unused
+      index root;
+      index freelist;            // chained through link[1]
+      size_t count;
+      Compare comp;
+
+      index child(index n, int dir) const {
+         return nodes[n].link[dir] & linkmask;
+      }
+      void setchild(index n, int dir, index c) {
+         nodes[n].link[dir] = (nodes[n].link[dir] & ~linkmask) | c;
+      }
+      int balance(index n) const {
+         return (int)(nodes[n].link[0] >> balanceshift) - 1;
+      }
+      void setbalance(index n, int b) {
+         nodes[n].link[0] = (nodes[n].link[0] & linkmask) |
+                            ((index)(b + 1) << balanceshift);
+      }
+      // -1 for the left side, +1 for the right
+      static int sign(int dir) { return dir ? 1 : -1; }
+
+      index newnode(const Key &k, const Value &d);
+      void freenode(index n);
+      index rotate(index n, int dir);
+      index doublerotate(index n, int heavy);
+      void relink(const index *path, const int *dirs, int depth, index n);
+      int checkheight(index n, const Key *low, const Key *high,
+                      bool &ok) const;
+
+   public:
+      compactavltree(const Compare &c = Compare()) :
+         nodes(1), root(0), freelist(0), count(0), comp(c) { }
+
+      bool search(const Key &k, Value &d) const;
+      // returns false if k is already present (or the tree is full)
+      bool insert(const Key &k, const Value &d);
+      // returns true if k was added, false if its value was replaced
+      bool insert_or_assign(const Key &k, const Value &d);
+      bool remove(const Key &k);
+
+      size_t size() const { return count; }
+      void reserve(size_t n) { nodes.reserve(n + 1); }
+      void clear() {
+         vector<node>(1).swap(nodes);
+         root = freelist = 0;
+         count = 0;
+      }
+      // bytes of node storage held (not counting anything the keys or
+      //    values allocate themselves)
+      size_t bytes() const { return nodes.capacity() * sizeof(node); }
+      bool checkvalid() const;
+
+   private:
+      bool insert(const Key &k, const Value &d, bool assign);
+};
+
+template <class Key, class Value, class Compare>
+typename compactavltree<Key, Value, Compare>::index
+compactavltree<Key, Value, Compare>::newnode(const Key &k, const Value &d)
+// a balanced leaf holding k and d, from the free list if possible
+// returns 0 if the tree can't hold any more nodes
+{
+   index n;
+   if (freelist) {
+      n = freelist;
+      freelist = nodes[n].link[1];
+   } else {
+      if (nodes.size() > linkmask) return 0;
+      n = (index)nodes.size();
+      nodes.push_back(node());
+   }
+   nodes[n].link[0] = nodes[n].link[1] = 0;
+   setbalance(n, 0);
+   nodes[n].key = k;
+   nodes[n].data = d;
+   return n;
+}
+
+template <class Key, class Value, class Compare>
+void compactavltree<Key, Value, Compare>::freenode(index n)
+// put slot n on the free list, dropping whatever its key and value
+//    held on to
+{
+   nodes[n].key = Key();
+   nodes[n].data = Value();
+   nodes[n].link[0] = 0;
+   nodes[n].link[1] = freelist;
+   freelist = n;
+}
+
+template <class Key, class Value, class Compare>
+typename compactavltree<Key, Value, Compare>::index
+compactavltree<Key, Value, Compare>::rotate(index n, int dir)
+// rotate n down in direction dir (0 = left, 1 = right), bringing its
+//    child on the other side up; returns that child
+// balance factors are the caller's business
+{
+   index c = child(n, !dir);
+   setchild(n, !dir, child(c, dir));
+   setchild(c, dir, n);
+   return c;
+}
+
+template <class Key, class Value, class Compare>
+typename compactavltree<Key, Value, Compare>::index
+compactavltree<Key, Value, Compare>::doublerotate(index n, int heavy)
+// n is too tall on side heavy, and its child c there leans the other
+//    way: rotate c's inner child g up twice, so it ends up on top,
+//    and fix the three balance factors from g's old balance
+// returns g
+{
+   index c = child(n, heavy);
+   index g = child(c, !heavy);
+   int gb = balance(g);
+   setchild(n, heavy, rotate(c, heavy));
+   rotate(n, !heavy);
+   setbalance(n, (gb == sign(heavy)) ? -gb : 0);
+   setbalance(c, (gb == -sign(heavy)) ? -gb : 0);
+   setbalance(g, 0);
+   return g;
+}
+
+template <class Key, class Value, class Compare>
+void compactavltree<Key, Value, Compare>::relink(const index *path,
+                                                 const int *dirs,
+                                                 int depth, index n)
+// hang n where the path went from step depth - 1 to step depth
+//    (or make it the root, at depth 0)
+{
+   if (depth == 0) root = n;
+   else setchild(path[depth - 1], dirs[depth - 1], n);
+}
+
+template <class Key, class Value, class Compare>
+bool compactavltree<Key, Value, Compare>::search(const Key &k,
+                                                 Value &d) const
+// an ordinary descent, but every step stays inside one array
+{
+   index n = root;
+   while (n) {
+      const node &x = nodes[n];
+      if (comp(k, x.key)) n = x.link[0] & linkmask;
+      else if (comp(x.key, k)) n = x.link[1];
+      else {
+         d = x.data;
+         return true;
+      }
+   }
+   return false;
+}
+
+template <class Key, class Value, class Compare>
+bool compactavltree<Key, Value, Compare>::insert(const Key &k, const Value &d,
+                                                 bool assign)
+// descend recording the path, hang a new leaf, then walk back up
+//    adjusting balance factors until one subtree's height stops
+//    changing, rotating at most once
+{
+   index path[maxdepth];
+   int dirs[maxdepth];
+   int depth = 0;
+
+   index n = root;
+   while (n) {
+      int dir;
+      if (comp(k, nodes[n].key)) dir = 0;
+      else if (comp(nodes[n].key, k)) dir = 1;
+      else {
+         if (!assign) return false;
+         nodes[n].data = d;
+         return false;
+      }
+      path[depth] = n;
+      dirs[depth++] = dir;
+      n = child(n, dir);
+   }
+
+   index leaf = newnode(k, d);
+   if (!leaf) return false;
+   count++;
+   relink(path, dirs, depth, leaf);
+
+   // the subtree below path[i] in direction dirs[i] just got taller
+   for (int i = depth - 1; i >= 0; i--) {
+      index p = path[i];
+      int dir = dirs[i];
+      int b = balance(p);
+      if (b == 0) {
+         setbalance(p, sign(dir));   // p got taller too, keep going
+         continue;
+      }
+      if (b == -sign(dir)) {
+         setbalance(p, 0);           // p's height is unchanged
+         break;
+      }
+
+      // p is now two taller on side dir: one rotation restores the
+      //    height p had before the insert, so we can stop after it
+      index c = child(p, dir);
+      index top;
+      if (balance(c) == sign(dir)) {
+         top = rotate(p, !dir);
+         setbalance(p, 0);
+         setbalance(c, 0);
+      } else {
+         top = doublerotate(p, dir);
+      }
+      relink(path, dirs, i, top);
+      break;
+   }
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+bool compactavltree<Key, Value, Compare>::insert(const Key &k, const Value &d)
+{
+   return insert(k, d, false);
+}
+
+template <class Key, class Value, class Compare>
+bool compactavltree<Key, Value, Compare>::insert_or_assign(const Key &k,
+                                                           const Value &d)
+{
+   return insert(k, d, true);
+}
+
+template <class Key, class Value, class Compare>
+bool compactavltree<Key, Value, Compare>::remove(const Key &k)
+// descend recording the path; a node with two children first swaps
+//    its payload with its successor, which is then the node removed;
+//    then walk back up until a subtree's height stops changing
+{
+   index path[maxdepth];
+   int dirs[maxdepth];
+   int depth = 0;
+
+   index n = root;
+   while (n) {
+      int dir;
+      if (comp(k, nodes[n].key)) dir = 0;
+      else if (comp(nodes[n].key, k)) dir = 1;
+      else break;
+      path[depth] = n;
+      dirs[depth++] = dir;
+      n = child(n, dir);
+   }
+   if (!n) return false;
+
+   if (child(n, 0) && child(n, 1)) {
+      // move the successor's payload into n and remove the successor
+      index target = n;
+      path[depth] = n;
+      dirs[depth++] = 1;
+      n = child(n, 1);
+      while (child(n, 0)) {
+         path[depth] = n;
+         dirs[depth++] = 0;
+         n = child(n, 0);
+      }
+      swap(nodes[target].key, nodes[n].key);
+      swap(nodes[target].data, nodes[n].data);
+   }
+
+   // n has at most one child, which takes its place
+   index replacement = child(n, 0) ? child(n, 0) : child(n, 1);
+   relink(path, dirs, depth, replacement);
+   freenode(n);
+   count--;
+
+   // the subtree below path[i] in direction dirs[i] just got shorter
+   for (int i = depth - 1; i >= 0; i--) {
+      index p = path[i];
+      int dir = dirs[i];
+      int b = balance(p);
+      if (b == sign(dir)) {
+         setbalance(p, 0);           // p got shorter too, keep going
+         continue;
+      }
+      if (b == 0) {
+         setbalance(p, -sign(dir));  // p's height is unchanged
+         break;
+      }
+
+      // p is now two taller on the other side
+      int heavy = !dir;
+      index s = child(p, heavy);
+      int sb = balance(s);
+      index top;
+      if (sb == -sign(heavy)) {
+         top = doublerotate(p, heavy);
+      } else {
+         top = rotate(p, dir);
+         if (sb == 0) {
+            setbalance(p, sign(heavy));
+            setbalance(s, -sign(heavy));
+         } else {
+            setbalance(p, 0);
+            setbalance(s, 0);
+         }
+      }
+      relink(path, dirs, i, top);
+      if (sb == 0) break;            // the height came out unchanged
+   }
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+int compactavltree<Key, Value, Compare>::checkheight(index n,
+                                                     const Key *low,
+                                                     const Key *high,
+                                                     bool &ok) const
+// the height of the subtree at n, clearing ok if any stored balance
+//    factor is wrong or any key is out of order
+// every key must lie strictly between low and high (null for no
+//    bound), the nearest ancestors it is to the right and left of
+{
+   if (!n) return -1;
+   const Key &k = nodes[n].key;
+   if (low && !comp(*low, k)) ok = false;
+   if (high && !comp(k, *high)) ok = false;
+   int lh = checkheight(child(n, 0), low, &k, ok);
+   int rh = checkheight(child(n, 1), &k, high, ok);
+   if ((rh - lh) != balance(n)) ok = false;
+   return (lh > rh ? lh : rh) + 1;
+}
+
+template <class Key, class Value, class Compare>
+bool compactavltree<Key, Value, Compare>::checkvalid() const
+// check every balance factor against the real subtree heights,
+//    along with the ordering of every key against its ancestors
+{
+   bool ok = true;
+   checkheight(root, NULL, NULL, ok);
+   return ok;
+}
+
+#endif
@@ -0,0 +1,477 @@
+/*
+AVL tree for concurrent use: searches take no lock
+*/
+
+#ifndef CONCURRENTAVLTREE_H
+#define CONCURRENTAVLTREE_H 1
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "nodepool.h"
+using namespace std;
+
+// a concurrent AVL tree map
+//
+// writers (insert/remove) are serialized by a mutex, and never modify
+//    a node a reader might be looking at: they copy the path from the
+//    root down to the change (plus any nodes a rotation touches), and
+//    then publish the new root with a single atomic store
+// readers (search) take no lock at all: they announce themselves in
+//    one of a set of striped counters, load the root, and walk a tree
+//    that nobody will change underneath them
+// nodes replaced by a writer are retired, and only freed once every
+//    reader that might still see them has finished (an RCU style
+//    grace period, tracked by which of two epochs each reader is in)
+template <class Key, class Value, class Compare = less<Key> >
+class concurrentavltree {
+   private:
+      struct node {
+          node          *left, *right;
+          Key           key;
+          Value         data;
+          int           height;
+          unsigned long gen;      // the write that created this node
+
+          node(const Key &k, const Value &d) : key(k), data(d) { }
+      };
+
+      // readers are counted per slot and per epoch parity;
+      //    each slot has its own cache line so readers on different
+      //    cores don't fight over one counter
+      struct alignas(64) readerslot {
+         atomic<long> active[2];
+      };
+      static const unsigned nslots = 64;
+
+      atomic<node*> root;
+      mutable readerslot slots[nslots];
+      atomic<unsigned long> epoch;
+
+      // everything below is only touched while holding writelock
+      mutex writelock;
+      nodepool<node> pool;
+      Compare comp;
+      size_t count;
+      unsigned long gen;          // the current write
+      vector<node*> retired;      // replaced, waiting for a grace period
+      size_t retirelimit;
+      vector<void*> spare;        // storage reserved for the next write
+
+      static unsigned myslot();
+      unsigned long enter() const;
+      void leave(unsigned long e) const;
+      void synchronize();
+      void reclaim();
+
+      static int height(const node *n) { return n ? n->height : -1; }
+      bool reserve();
+      node *newnode(const Key &k, const Value &d);
+      node *own(node *n);
+      void retire(node *n) { retired.push_back(n); }
+      void updateheight(node *n);
+      node *rotateleft(node *n);
+      node *rotateright(node *n);
+      node *rebalance(node *n);
+      node *insert(node *n, const Key &k, const Value &d, bool assign,
+                   bool &changed, bool &inserted);
+      node *remove(node *n, const Key &k, bool &removed);
+      node *removesmallest(node *n, node* &smallest);
+      void deallocate(node *n);
+
+      // the tree owns its nodes, so it can't be copied
+      concurrentavltree(const concurrentavltree &);
+      concurrentavltree &operator=(const concurrentavltree &);
+
+   public:
+      // replaced nodes are freed in batches of retirebatch, so a
+      //    writer waits for readers at most once per batch
+      concurrentavltree(size_t retirebatch = 1024,
+                        slaballocator *source = NULL);
+      ~concurrentavltree();
+
+      // lock free, and safe to call from any number of threads
+      //    alongside the writers below
+      bool search(const Key &k, Value &d) const;
+
+      // writers, serialized against each other
+      bool insert(const Key &k, const Value &d);
+      bool insert_or_assign(const Key &k, const Value &d);
+      bool remove(const Key &k);
+      size_t size();
+};
+
+template <class Key, class Value, class Compare>
+concurrentavltree<Key, Value, Compare>::concurrentavltree(
+   size_t retirebatch, slaballocator *source) :
+   root(NULL), epoch(0), pool(source), count(0), gen(0),
+   retirelimit(retirebatch ? retirebatch : 1)
+{
+   for (unsigned i = 0; i < nslots; i++) {
+      slots[i].active[0] = 0;
+      slots[i].active[1] = 0;
+   }
+}
+
+template <class Key, class Value, class Compare>
+concurrentavltree<Key, Value, Compare>::~concurrentavltree()
+// no reader may still be running, so everything can go at once
+{
+   for (size_t i = 0; i < retired.size(); i++) {
+      retired[i]->~node();
+      pool.deallocate(retired[i]);
+   }
+   for (size_t i = 0; i < spare.size(); i++) pool.deallocate(spare[i]);
+   deallocate(root.load());
+}
+
+template <class Key, class Value, class Compare>
+void concurrentavltree<Key, Value, Compare>::deallocate(node *n)
+// destroy every node in the subtree rooted at n
+{
+   if (!n) return;
+   deallocate(n->left);
+   deallocate(n->right);
+   n->~node();
+   pool.deallocate(n);
+}
+
+template <class Key, class Value, class Compare>
+unsigned concurrentavltree<Key, Value, Compare>::myslot()
+// each thread is given a reader slot the first time it reads,
+//    round robin, so that up to nslots readers never share one
+{
+   static atomic<unsigned> next(0);
+   static thread_local unsigned slot = next++ % nslots;
+   return slot;
+}
+
+template <class Key, class Value, class Compare>
+unsigned long concurrentavltree<Key, Value, Compare>::enter() const
+// register the calling thread as a reader in the current epoch
+// if the epoch moves on while we register, back out and try again,
+//    so a writer waiting on the old epoch can never miss us
+// returns the epoch to pass to leave
+{
+   atomic<long> *active = slots[myslot()].active;
+   for (;;) {
+      unsigned long e = epoch.load();
+      active[e & 1].fetch_add(1);
+      if (epoch.load() == e) return e;
+      active[e & 1].fetch_sub(1);
+   }
+}
+
+template <class Key, class Value, class Compare>
+void concurrentavltree<Key, Value, Compare>::leave(unsigned long e) const
+// the reader registered in epoch e is done
+{
+   slots[myslot()].active[e & 1].fetch_sub(1);
+}
+
+template <class Key, class Value, class Compare>
+void concurrentavltree<Key, Value, Compare>::synchronize()
+// wait for a grace period: move to the next epoch, then wait until
+//    every reader that registered in the old one has left
+// readers registering from now on will load a root published before
+//    this call, so they can't see anything retired before it
+{
+   unsigned long e = epoch.load();
+   epoch.store(e + 1);
+   for (unsigned i = 0; i < nslots; i++) {
+      while (slots[i].active[e & 1].load() != 0)
+         this_thread::yield();
+   }
+}
+
+template <class Key, class Value, class Compare>
+void concurrentavltree<Key, Value, Compare>::reclaim()
+// free everything retired so far, once no reader can still see it
+// must be called after the root that drops those nodes is published
+{
+   if (retired.empty()) return;
+   synchronize();
+   for (size_t i = 0; i < retired.size(); i++) {
+      retired[i]->~node();
+      pool.deallocate(retired[i]);
+   }
+   retired.clear();
+}
+
+template <class Key, class Value, class Compare>
+bool concurrentavltree<Key, Value, Compare>::search(const Key &k,
+                                                    Value &d) const
+// look for k without taking any lock, copying its value into d
+{
+   unsigned long e = enter();
+   node *n = root.load();
+   while (n) {
+      if (comp(k, n->key)) n = n->left;
+      else if (comp(n->key, k)) n = n->right;
+      else break;
+   }
+   if (n) d = n->data;
+   leave(e);
+   return n != NULL;
+}
+
+template <class Key, class Value, class Compare>
+bool concurrentavltree<Key, Value, Compare>::reserve()
+// make sure the next write can't run out of memory half way through
+//    building its copy of the path: a write copies at most the path
+//    plus two nodes per level for rotations
+// returns false if that much storage can't be had
+{
+   size_t needed = 3 * (height(root.load()) + 2) + 1;
+   while (spare.size() < needed) {
+      void *mem = pool.allocate();
+      if (!mem) return false;
+      spare.push_back(mem);
+   }
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+typename concurrentavltree<Key, Value, Compare>::node *
+concurrentavltree<Key, Value, Compare>::newnode(const Key &k, const Value &d)
+// a new leaf belonging to the current write, in reserved storage
+{
+   void *mem = spare.back();
+   spare.pop_back();
+   node *n = new (mem) node(k, d);
+   n->left = n->right = NULL;
+   n->height = 0;
+   n->gen = gen;
+   return n;
+}
+
+template <class Key, class Value, class Compare>
+typename concurrentavltree<Key, Value, Compare>::node *
+concurrentavltree<Key, Value, Compare>::own(node *n)
+// return a version of n that the current write may modify:
+//    n itself if this write created it, otherwise a private copy
+//    (retiring n, which the new version of the tree won't use)
+{
+   if (n->gen == gen) return n;
+   node *c = newnode(n->key, n->data);
+   c->left = n->left;
+   c->right = n->right;
+   c->height = n->height;
+   retire(n);
+   return c;
+}
+
+template <class Key, class Value, class Compare>
+void concurrentavltree<Key, Value, Compare>::updateheight(node *n)
+// n's height is one greater than the height of its taller child
+{
+   int l = height(n->left), r = height(n->right);
+   n->height = (l > r ? l : r) + 1;
+}
+
+template <class Key, class Value, class Compare>
+typename concurrentavltree<Key, Value, Compare>::node *
+concurrentavltree<Key, Value, Compare>::rotateleft(node *n)
+// rotate n's right child up, n being owned by the current write
+//    (the child is copied first unless it is too)
+// returns the new subtree root
+{
+   node *y = own(n->right);
+   n->right = y->left;
+   y->left = n;
+   updateheight(n);
+   updateheight(y);
+   return y;
+}
+
+template <class Key, class Value, class Compare>
+typename concurrentavltree<Key, Value, Compare>::node *
+concurrentavltree<Key, Value, Compare>::rotateright(node *n)
+// rotate n's left child up, n being owned by the current write
+// returns the new subtree root
+{
+   node *x = own(n->left);
+   n->left = x->right;
+   x->right = n;
+   updateheight(n);
+   updateheight(x);
+   return x;
+}
+
+template <class Key, class Value, class Compare>
+typename concurrentavltree<Key, Value, Compare>::node *
+concurrentavltree<Key, Value, Compare>::rebalance(node *n)
+// update the height of the owned node n, and do a single or double
+//    rotation if its subtrees' heights now differ by more than one
+// returns the new subtree root
+{
+   updateheight(n);
+   int balance = height(n->right) - height(n->left);
+   if (balance > 1) {
+      if (height(n->right->right) < height(n->right->left))
+         n->right = rotateright(own(n->right));
+      return rotateleft(n);
+   }
+   if (balance < -1) {
+      if (height(n->left->left) < height(n->left->right))
+         n->left = rotateleft(own(n->left));
+      return rotateright(n);
+   }
+   return n;
+}
+
+template <class Key, class Value, class Compare>
+typename concurrentavltree<Key, Value, Compare>::node *
+concurrentavltree<Key, Value, Compare>::insert(node *n, const Key &k,
+                                               const Value &d, bool assign,
+                                               bool &changed, bool &inserted)
+// return a new version of the subtree rooted at n with k added
+//    (or its value replaced, if assign is set), copying only the path
+// changed is false if nothing needed to change, in which case n
+//    itself is returned
+{
+   if (!n) {
+      changed = inserted = true;
+      return newnode(k, d);
+   }
+   if (comp(k, n->key)) {
+      node *l = insert(n->left, k, d, assign, changed, inserted);
+      if (!changed) return n;
+      n = own(n);
+      n->left = l;
+      return rebalance(n);
+   }
+   if (comp(n->key, k)) {
+      node *r = insert(n->right, k, d, assign, changed, inserted);
+      if (!changed) return n;
+      n = own(n);
+      n->right = r;
+      return rebalance(n);
+   }
+   changed = inserted = false;
+   if (!assign) return n;
+   changed = true;
+   n = own(n);
+   n->data = d;
+   return n;
+}
+
+template <class Key, class Value, class Compare>
+typename concurrentavltree<Key, Value, Compare>::node *
+concurrentavltree<Key, Value, Compare>::removesmallest(node *n,
+                                                       node* &smallest)
+// return a new version of the (non-empty) subtree rooted at n without
+//    its smallest node, which is left in smallest (still unmodified)
+{
+   if (!n->left) {
+      smallest = n;
+      return n->right;
+   }
+   node *l = removesmallest(n->left, smallest);
+   n = own(n);
+   n->left = l;
+   return rebalance(n);
+}
+
+template <class Key, class Value, class Compare>
+typename concurrentavltree<Key, Value, Compare>::node *
+concurrentavltree<Key, Value, Compare>::remove(node *n, const Key &k,
+                                               bool &removed)
+// return a new version of the subtree rooted at n without k
+{
+   if (!n) {
+      removed = false;
+      return NULL;
+   }
+   if (comp(k, n->key)) {
+      node *l = remove(n->left, k, removed);
+      if (!removed) return n;
+      n = own(n);
+      n->left = l;
+      return rebalance(n);
+   }
+   if (comp(n->key, k)) {
+      node *r = remove(n->right, k, removed);
+      if (!removed) return n;
+      n = own(n);
+      n->right = r;
+      return rebalance(n);
+   }
+
+   removed = true;
+   retire(n);
+   if (!n->left) return n->right;
+   if (!n->right) return n->left;
+
+   // two children: the smallest node on the right takes n's place
+   node *smallest;
+   node *r = removesmallest(n->right, smallest);
+   smallest = own(smallest);
+   smallest->left = n->left;
+   smallest->right = r;
+   return rebalance(smallest);
+}
+
+template <class Key, class Value, class Compare>
+bool concurrentavltree<Key, Value, Compare>::insert(const Key &k,
+                                                    const Value &d)
+// add k unless it is already present, returning true if it was added
+//    (or false if it was present, or memory ran out)
+{
+   lock_guard<mutex> g(writelock);
+   if (!reserve()) return false;
+   gen++;
+   bool changed, inserted;
+   node *r = insert(root.load(), k, d, false, changed, inserted);
+   if (changed) {
+      root.store(r);
+      count++;
+   }
+   if (retired.size() >= retirelimit) reclaim();
+   return inserted;
+}
+
+template <class Key, class Value, class Compare>
+bool concurrentavltree<Key, Value, Compare>::insert_or_assign(const Key &k,
+                                                              const Value &d)
+// add k, or replace its value; returns true if k was added
+{
+   lock_guard<mutex> g(writelock);
+   if (!reserve()) return false;
+   gen++;
+   bool changed, inserted;
+   node *r = insert(root.load(), k, d, true, changed, inserted);
+   if (changed) root.store(r);
+   if (inserted) count++;
+   if (retired.size() >= retirelimit) reclaim();
+   return inserted;
+}
+
+template <class Key, class Value, class Compare>
+bool concurrentavltree<Key, Value, Compare>::remove(const Key &k)
+// remove k, returning false if it wasn't there
+{
+   lock_guard<mutex> g(writelock);
+   if (!reserve()) return false;
+   gen++;
+   bool removed;
+   node *r = remove(root.load(), k, removed);
+   if (removed) {
+      root.store(r);
+      count--;
+   }
+   if (retired.size() >= retirelimit) reclaim();
+   return removed;
+}
+
+template <class Key, class Value, class Compare>
+size_t concurrentavltree<Key, Value, Compare>::size()
+// the number of entries
+{
+   lock_guard<mutex> g(writelock);
+   return count;
+}
+
+#endif
@@ -0,0 +1,1207 @@
+/*
+differential tests: random operations applied to one of the trees here
+and to a std::map side by side, comparing the two as they go
+usage: difftest [test] [rounds] [seed]
+runs the avltree test if none is named; exits with status 1 at the
+first disagreement
+*/
+
+#include "avltree.h"
+#include "concurrentavltree.h"
+#include "persistentavltree.h"
+#include "compactavltree.h"
+#include "durableavltree.h"
+#include "shardedavltree.h"
+#include "bucketavltree.h"
+#include "keyarena.h"
+#include "avlcache.h"
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+
+typedef avltree<uint64_t, uint64_t, less<uint64_t>,
+                sumaugment<uint64_t, uint64_t> > sumtree;
+typedef map<uint64_t, uint64_t> model;
+
+// keys are drawn from a small space so that operations collide
+const uint64_t keyspace = 2048;
+
+bool fail(const char *step, const char *what)
+//report a disagreement
+{
+   printf("after %s: %s\n", step, what);
+   return false;
+}
+
+bool agree(sumtree &t, const model &m, mt19937_64 &rng, const char *step)
+//the tree's structure, contents, order statistics and aggregates
+//against the model
+{
+   if (t.size() != m.size()) return fail(step, "size");
+   if (m.empty()) return (t.begin() == t.end()) || fail(step, "not empty");
+   if (!t.checkvalid()) return fail(step, "checkvalid");
+
+   vector< pair<uint64_t, uint64_t> > entries(m.begin(), m.end());
+   size_t i = 0;
+   for (sumtree::iterator it = t.begin(); it != t.end(); ++it, i++) {
+      if ((i == entries.size()) || (it.key() != entries[i].first) ||
+          (it.value() != entries[i].second))
+         return fail(step, "in order walk");
+   }
+   if (i != entries.size()) return fail(step, "in order walk length");
+
+   for (int probe = 0; probe < 16; probe++) {
+      size_t pos = rng() % entries.size();
+      uint64_t k, d;
+      if (!t.select(pos, k, d) || (k != entries[pos].first) ||
+          (d != entries[pos].second))
+         return fail(step, "select");
+
+      uint64_t lo = rng() % keyspace, hi = rng() % keyspace;
+      if (hi < lo) swap(lo, hi);
+      size_t below = distance(m.begin(), m.lower_bound(lo));
+      if (t.rank(lo) != below) return fail(step, "rank");
+      model::const_iterator first = m.lower_bound(lo),
+                            last = m.upper_bound(hi);
+      size_t count = distance(first, last);
+      if (t.count_range(lo, hi) != count) return fail(step, "count_range");
+
+      uint64_t sum = 0, got = 0;
+      for (model::const_iterator it = first; it != last; ++it)
+         sum += it->second;
+      bool found = t.aggregate(lo, hi, got);
+      if ((found != (count > 0)) || (found && (got != sum)))
+         return fail(step, "aggregate over a range");
+
+      sumtree::iterator lb = t.lower_bound(lo);
+      if ((lb == t.end()) != (first == m.end()) ||
+          ((lb != t.end()) && (lb.key() != first->first)))
+         return fail(step, "lower_bound");
+   }
+
+   uint64_t total = 0, got = 0;
+   for (size_t j = 0; j < entries.size(); j++) total += entries[j].second;
+   if (!t.aggregate(got) || (got != total))
+      return fail(step, "aggregate of the whole tree");
+   return true;
+}
+
+void randomtree(size_t n, mt19937_64 &rng, sumtree &t, model &m)
+//another tree (and its model) of about n random entries
+{
+   for (size_t i = 0; i < n; i++) {
+      uint64_t k = rng() % keyspace, d = rng() % 1000;
+      if (t.insert(k, d)) m[k] = d;
+   }
+}
+
+bool step(sumtree &t, model &m, mt19937_64 &rng, const char* &name)
+//apply one random operation to both; false if they disagree on its
+//result
+{
+   uint64_t k = rng() % keyspace, d = rng() % 1000;
+   switch (rng() % 12) {
+      case 0: case 1: case 2: {
+         name = "insert";
+         bool added = m.insert(make_pair(k, d)).second;
+         return t.insert(k, d) == added;
+      }
+      case 3: {
+         name = "try_emplace";
+         bool added = m.insert(make_pair(k, d)).second;
+         return t.try_emplace(k, d) == added;
+      }
+      case 4: case 5: {
+         name = "insert_or_assign";
+         bool added = (m.count(k) == 0);
+         m[k] = d;
+         return t.insert_or_assign(k, d) == added;
+      }
+      case 6: case 7: case 8: {
+         name = "remove";
+         bool present = (m.erase(k) == 1);
+         return t.remove(k) == present;
+      }
+      case 9: {
+         name = "apply_batch";
+         vector<sumtree::change> ops(rng() % 64);
+         for (size_t i = 0; i < ops.size(); i++) {
+            ops[i].key = rng() % keyspace;
+            ops[i].data = rng() % 1000;
+            ops[i].op = (rng() % 3) ? sumtree::change::upsert
+                                    : sumtree::change::erase;
+            if (ops[i].op == sumtree::change::upsert)
+               m[ops[i].key] = ops[i].data;
+            else
+               m.erase(ops[i].key);
+         }
+         return t.apply_batch(ops);
+      }
+      case 10: {
+         name = "split and join";
+         sumtree greater;
+         t.split(k, greater);
+         model high(m.upper_bound(k), m.end());
+         model low(m.begin(), m.upper_bound(k));
+         if (!agree(t, low, rng, "split (lower part)") ||
+             !agree(greater, high, rng, "split (upper part)"))
+            return false;
+         return t.join(greater);
+      }
+      default: {
+         name = "a set operation";
+         sumtree other;
+         model theirs;
+         randomtree(rng() % 256, rng, other, theirs);
+         unsigned threads = 1 + rng() % 2;
+         switch (rng() % 3) {
+            case 0:
+               for (model::iterator it = theirs.begin(); it != theirs.end();
+                    ++it)
+                  m.insert(*it);
+               return t.unite(other, threads);
+            case 1:
+               for (model::iterator it = m.begin(); it != m.end(); ) {
+                  if (theirs.count(it->first)) ++it;
+                  else m.erase(it++);
+               }
+               return t.intersect(other, threads);
+            default:
+               for (model::iterator it = theirs.begin(); it != theirs.end();
+                    ++it)
+                  m.erase(it->first);
+               return t.subtract(other, threads);
+         }
+      }
+   }
+}
+
+bool intervals(size_t rounds, mt19937_64 &rng)
+//an interval tree under random inserts, reassignments and removes,
+//with every overlap query checked against a scan of the model
+{
+   avltree<uint64_t, uint64_t, less<uint64_t>,
+           maxaugment<uint64_t, uint64_t> > t;
+   model m;
+   for (size_t r = 0; r < rounds; r++) {
+      uint64_t start = rng() % (16 * keyspace);
+      if (rng() % 4 == 0) {
+         t.remove(start);
+         m.erase(start);
+      } else {
+         uint64_t end = start + rng() % ((rng() % 8) ? 32 : 1024);
+         t.insert_or_assign(start, end);
+         m[start] = end;
+      }
+      uint64_t a = rng() % (16 * keyspace), b = a + rng() % 64;
+      vector<uint64_t> want, got;
+      for (model::iterator it = m.begin(); it != m.end(); ++it)
+         if ((it->first <= b) && (it->second >= a)) want.push_back(it->first);
+      t.for_each_overlapping(a, b, [&got](const uint64_t &k,
+                                          const uint64_t &) {
+         got.push_back(k);
+      });
+      if (want != got) return fail("interval updates", "overlaps");
+   }
+   return true;
+}
+
+bool testavltree(size_t rounds, mt19937_64 &rng)
+//every avltree operation, checked after each step, then an interval
+//tree
+{
+   sumtree t;
+   model m;
+   for (size_t r = 0; r < rounds; r++) {
+      const char *name = "";
+      if (!step(t, m, rng, name)) return fail(name, "result");
+      if (!agree(t, m, rng, name)) return false;
+
+      // now and then, check a copy and a bulk rebuild as well
+      if (r % 997 == 0) {
+         sumtree copy(t);
+         if (!agree(copy, m, rng, "copy")) return false;
+         vector< pair<uint64_t, uint64_t> > items(m.begin(), m.end());
+         sumtree rebuilt;
+         if (!rebuilt.build_from_sorted(items.begin(), items.end(), 2) ||
+             !agree(rebuilt, m, rng, "build_from_sorted"))
+            return false;
+      }
+   }
+   return intervals(rounds, rng);
+}
+
+template <class T>
+bool finds(T &t, const model &m, uint64_t k)
+//t's search for k agrees with m
+{
+   uint64_t got;
+   model::const_iterator it = m.find(k);
+   bool found = t.search(k, got);
+   return (found == (it != m.end())) && (!found || (got == it->second));
+}
+
+bool testconcurrent(size_t rounds, mt19937_64 &rng)
+//one writer, followed by the model, with readers searching alongside
+//it; every value written is its key plus a multiple of keyspace, so a
+//reader can tell a value read from the wrong (or a freed) node
+{
+   concurrentavltree<uint64_t, uint64_t> t(8);
+   model m;
+   atomic<bool> done(false), wrong(false);
+   vector<thread> readers;
+   for (unsigned i = 0; i < 2; i++) {
+      readers.push_back(thread([&t, &done, &wrong, i]() {
+         mt19937_64 own(i);
+         while (!done) {
+            uint64_t k = own() % keyspace, d;
+            if (t.search(k, d) && (d % keyspace != k)) wrong = true;
+         }
+      }));
+   }
+
+   const char *name = "";
+   bool ok = true;
+   for (size_t r = 0; ok && (r < rounds); r++) {
+      uint64_t k = rng() % keyspace, d = k + keyspace * (rng() % 1000);
+      switch (rng() % 3) {
+         case 0:
+            name = "insert";
+            ok = (t.insert(k, d) == m.insert(make_pair(k, d)).second);
+            break;
+         case 1:
+            name = "insert_or_assign";
+            ok = (t.insert_or_assign(k, d) == (m.count(k) == 0));
+            m[k] = d;
+            break;
+         default:
+            name = "remove";
+            ok = (t.remove(k) == (m.erase(k) == 1));
+      }
+      if (!ok) fail(name, "result");
+      else if (t.size() != m.size()) ok = fail(name, "size");
+
+      // every key now and then, a few after each step
+      size_t probes = (r % 997 == 0) ? keyspace : 16;
+      for (size_t i = 0; ok && (i < probes); i++) {
+         uint64_t p = (probes == keyspace) ? i : rng() % keyspace;
+         if (!finds(t, m, p)) ok = fail(name, "search");
+      }
+   }
+   done = true;
+   for (size_t i = 0; i < readers.size(); i++) readers[i].join();
+   if (wrong) return fail("concurrent searches", "a value of another key");
+   return ok;
+}
+
+template <class T>
+bool matches(T &t, const model &m)
+//t holds exactly the entries of m (t being anything with size and an
+//in order for_each)
+{
+   if (t.size() != m.size()) return false;
+   model::const_iterator it = m.begin();
+   bool same = true;
+   t.for_each([&it, &m, &same](const uint64_t &k, const uint64_t &d) {
+      if ((it == m.end()) || (it->first != k) || (it->second != d))
+         same = false;
+      else
+         ++it;
+   });
+   return same && (it == m.end());
+}
+
+bool testpersistent(size_t rounds, mt19937_64 &rng)
+//a persistent tree and an O(1) copy of it written independently, with
+//snapshots of both taken along the way; every snapshot must keep the
+//contents it was taken with, whatever is written afterwards, and one
+//now and then is checked and dropped on another thread
+{
+   typedef persistentavltree<uint64_t, uint64_t> ptree;
+   vector<ptree> trees(1);
+   vector<model> models(1);
+   vector<ptree::version> snaps;
+   vector<model> snapmodels;
+   thread checker;
+   atomic<bool> stale(false);
+
+   for (size_t r = 0; r < rounds; r++) {
+      size_t w = rng() % trees.size();
+      ptree &t = trees[w];
+      model &m = models[w];
+      uint64_t k = rng() % keyspace, d = rng() % 1000;
+      const char *name;
+      bool ok;
+      switch (rng() % 4) {
+         case 0:
+            name = "insert";
+            ok = (t.insert(k, d) == m.insert(make_pair(k, d)).second);
+            break;
+         case 1:
+            name = "insert_or_assign";
+            ok = (t.insert_or_assign(k, d) == (m.count(k) == 0));
+            m[k] = d;
+            break;
+         default:
+            name = "remove";
+            ok = (t.remove(k) == (m.erase(k) == 1));
+      }
+      if (!ok) return fail(name, "result");
+      if (!matches(t, m)) return fail(name, "contents");
+
+      if (r == rounds / 4) {
+         // from here on a copy sharing every node is written as well
+         trees.push_back(trees[0]);
+         models.push_back(models[0]);
+      }
+      if (rng() % 16 == 0) {
+         snaps.push_back(t.snapshot());
+         snapmodels.push_back(m);
+      }
+      if (!snaps.empty()) {
+         size_t i = rng() % snaps.size();
+         if (!finds(snaps[i], snapmodels[i], k) ||
+             ((rng() % 64 == 0) && !matches(snaps[i], snapmodels[i])))
+            return fail(name, "an older snapshot");
+         if ((snaps.size() > 8) || (rng() % 32 == 0)) {
+            snaps.erase(snaps.begin() + i);
+            snapmodels.erase(snapmodels.begin() + i);
+         }
+      }
+      if ((r % 499 == 0) && !snaps.empty()) {
+         if (checker.joinable()) checker.join();
+         ptree::version v = snaps.back();
+         model vm = snapmodels.back();
+         snaps.pop_back();
+         snapmodels.pop_back();
+         checker = thread([v, vm, &stale]() {
+            if (!matches(v, vm)) stale = true;
+         });
+      }
+   }
+   if (checker.joinable()) checker.join();
+   if (stale) return fail("snapshots", "a snapshot read on another thread");
+   for (size_t i = 0; i < snaps.size(); i++)
+      if (!matches(snaps[i], snapmodels[i]))
+         return fail("all rounds", "a surviving snapshot");
+   return true;
+}
+
+bool testcompact(size_t rounds, mt19937_64 &rng)
+//a compactavltree checked with its own checkvalid after every step;
+//keys come now and then in ascending or descending runs, which make
+//for long chains of rotations, and removed slots are reused from the
+//free list
+{
+   compactavltree<uint64_t, uint64_t> t;
+   model m;
+   uint64_t run = 0;
+   int direction = 0;
+   for (size_t r = 0; r < rounds; r++) {
+      if (rng() % 256 == 0) direction = (int)(rng() % 3) - 1;
+      uint64_t k = direction ? (run += direction) % keyspace
+                             : rng() % keyspace;
+      uint64_t d = rng() % 1000;
+      const char *name;
+      bool ok;
+      switch (rng() % 5) {
+         case 0: case 1:
+            name = "insert";
+            ok = (t.insert(k, d) == m.insert(make_pair(k, d)).second);
+            break;
+         case 2:
+            name = "insert_or_assign";
+            ok = (t.insert_or_assign(k, d) == (m.count(k) == 0));
+            m[k] = d;
+            break;
+         default:
+            name = "remove";
+            ok = (t.remove(k) == (m.erase(k) == 1));
+      }
+      if (!ok) return fail(name, "result");
+      if (rng() % 4096 == 0) {
+         name = "clear";
+         t.clear();
+         m.clear();
+      }
+      if (t.size() != m.size()) return fail(name, "size");
+      if (!t.checkvalid()) return fail(name, "checkvalid");
+      size_t probes = (r % 997 == 0) ? keyspace : 16;
+      for (size_t i = 0; i < probes; i++)
+         if (!finds(t, m, (probes == keyspace) ? i : rng() % keyspace))
+            return fail(name, "search");
+   }
+   return true;
+}
+
+bool testmapped(size_t rounds, mt19937_64 &rng)
+//an avltree with string keys and values, saved now and then and mapped
+//back; the image must hold exactly the tree's entries, in the same
+//(byte string) order, for searches, walks and range walks alike, and
+//a byte flipped in it must fail verification
+{
+   typedef map<string, string> smodel;
+   const char *path = "difftest-mapped.image";
+   avltree<string, string> t;
+   smodel m;
+   for (size_t r = 0; r < rounds; r++) {
+      // decimal keys, so byte order and numeric order differ
+      string k = to_string(rng() % keyspace);
+      if (rng() % 2) t.remove(k), m.erase(k);
+      else {
+         string d(rng() % 40, (char)('a' + rng() % 26));
+         t.insert_or_assign(k, d);
+         m[k] = d;
+      }
+      if ((r % 199 != 0) && (r + 1 != rounds)) continue;
+
+      mappedavltree<string, string> image;
+      if (!t.save(path) || !avltree<string, string>::open_mapped(path, image))
+         return fail("save", "the image doesn't open");
+      if (image.size() != m.size()) return fail("open_mapped", "size");
+      smodel::iterator it = m.begin();
+      bool same = true;
+      bool whole = image.for_each([&](const string &k, const string &d) {
+         if ((it == m.end()) || (it->first != k) || (it->second != d))
+            same = false;
+         else
+            ++it;
+      });
+      if (!whole || !same || (it != m.end()))
+         return fail("open_mapped", "for_each");
+      for (int probe = 0; probe < 16; probe++) {
+         string lo = to_string(rng() % keyspace),
+                hi = to_string(rng() % keyspace);
+         if (hi < lo) swap(lo, hi);
+         vector<string> want, got;
+         for (smodel::iterator i = m.lower_bound(lo);
+              (i != m.end()) && (i->first <= hi); ++i)
+            want.push_back(i->first);
+         if (!image.for_each_in_range(lo, hi,
+                                      [&got](const string &k, const string &) {
+                                         got.push_back(k);
+                                      }) || (want != got))
+            return fail("open_mapped", "for_each_in_range");
+         string d;
+         smodel::iterator i = m.find(lo);
+         bool found = image.search(lo, d);
+         if ((found != (i != m.end())) || (found && (d != i->second)))
+            return fail("open_mapped", "search");
+      }
+      image.close();
+
+      // damage a byte past the header: verification must catch it
+      if ((r % 995 == 0) && !m.empty()) {
+         FILE *f = fopen(path, "r+b");
+         if (!f || (fseek(f, 0, SEEK_END) != 0)) return fail("save", "reopen");
+         long length = ftell(f);
+         long at = sizeof(avlimageheader) +
+                   rng() % (length - sizeof(avlimageheader));
+         int c;
+         bool flipped = (fseek(f, at, SEEK_SET) == 0) &&
+                        ((c = fgetc(f)) != EOF) &&
+                        (fseek(f, at, SEEK_SET) == 0) &&
+                        (fputc(c ^ 0x20, f) != EOF);
+         if ((fclose(f) != 0) || !flipped) return fail("save", "damage");
+         if (avltree<string, string>::open_mapped(path, image))
+            return fail("a damaged image", "opened");
+      }
+   }
+   std::remove(path);
+   return true;
+}
+
+bool readfile(const string &path, string &bytes)
+{
+   FILE *f = fopen(path.c_str(), "rb");
+   if (!f) return false;
+   char buffer[65536];
+   size_t got;
+   bytes.clear();
+   while ((got = fread(buffer, 1, sizeof(buffer), f)) > 0)
+      bytes.append(buffer, got);
+   bool ok = !ferror(f);
+   return (fclose(f) == 0) && ok;
+}
+
+bool writefile(const string &path, const string &bytes, const char *mode)
+{
+   FILE *f = fopen(path.c_str(), mode);
+   if (!f) return false;
+   bool ok = (fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size());
+   return (fclose(f) == 0) && ok;
+}
+
+bool testdurable(size_t rounds, mt19937_64 &rng)
+//a durableavltree, closed and reopened now and then, must come back
+//holding what the model does: after a checkpoint, after a torn record
+//at the end of its log (which loses just that update), after junk
+//appended to the log, and after replaying a log over an image that
+//already holds it (a crash between saving the image and emptying the
+//log)
+{
+   typedef durableavltree<uint64_t, uint64_t> dtree;
+   const string base = "difftest-durable", logpath = base + ".wal";
+   const string files[] = { base + ".snapshot", logpath, logpath + ".cut" };
+   for (size_t i = 0; i < 3; i++) std::remove(files[i].c_str());
+
+   unique_ptr<dtree> t(new dtree);
+   auto reopen = [&t, &base]() {
+      t.reset(new dtree);
+      return t->open(base, syncnever);
+   };
+   auto holds = [&t](const model &m) {
+      if (t->size() != m.size()) return false;
+      for (uint64_t k = 0; k < keyspace; k++)
+         if (!finds(*t, m, k)) return false;
+      return true;
+   };
+   if (!reopen()) return fail("open", "a new tree");
+
+   model m;
+   // the update behind the last record in the log, while it is known,
+   //    so that tearing the record can be followed in the model
+   bool known = false, hadold = false;
+   uint64_t lastkey = 0, oldvalue = 0;
+   for (size_t r = 0; r < rounds; r++) {
+      uint64_t k = rng() % keyspace, d = rng() % 1000;
+      model::iterator it = m.find(k);
+      bool present = (it != m.end());
+      uint64_t old = present ? it->second : 0;
+      const char *name;
+      bool ok, logged;
+      switch (rng() % 3) {
+         case 0:
+            name = "insert";
+            logged = !present;
+            ok = (t->insert(k, d) == logged);
+            if (logged) m[k] = d;
+            break;
+         case 1:
+            name = "insert_or_assign";
+            logged = true;
+            ok = (t->insert_or_assign(k, d) == !present);
+            m[k] = d;
+            break;
+         default:
+            name = "remove";
+            logged = present;
+            ok = (t->remove(k) == logged);
+            m.erase(k);
+      }
+      if (!ok) return fail(name, "result");
+      if (logged) {
+         known = true;
+         lastkey = k;
+         hadold = present;
+         oldvalue = old;
+      }
+      if ((t->size() != m.size()) || !finds(*t, m, rng() % keyspace))
+         return fail(name, "contents");
+
+      string log;
+      switch (rng() % 512) {
+         case 0:
+            name = "checkpoint and reopen";
+            if (!t->checkpoint()) return fail(name, "checkpoint");
+            known = false;
+            ok = reopen();
+            break;
+         case 1:
+            name = "reopen";
+            ok = reopen();
+            break;
+         case 2:
+            // a record is at least 21 bytes, so this tears the last one
+            if (!known) continue;
+            name = "a torn record";
+            t.reset();
+            ok = readfile(logpath, log) && (log.size() >= 21);
+            log.resize(log.size() - 1 - rng() % 20);
+            ok = ok && writefile(logpath, log, "wb") && reopen();
+            if (hadold) m[lastkey] = oldvalue;
+            else m.erase(lastkey);
+            known = false;
+            break;
+         case 3:
+            name = "junk after the log";
+            t.reset();
+            for (size_t i = rng() % 24; i > 0; i--) log += (char)rng();
+            ok = writefile(logpath, log, "ab") && reopen();
+            break;
+         case 4:
+            name = "a log replayed over a newer image";
+            t.reset();
+            ok = readfile(logpath, log) && reopen() && t->checkpoint();
+            t.reset();
+            ok = ok && writefile(logpath, log, "wb") && reopen();
+            // the image holds the last update too, now
+            known = false;
+            break;
+         default:
+            continue;
+      }
+      if (!ok) return fail(name, "reopening");
+      if (!holds(m)) return fail(name, "contents");
+   }
+   bool ok = reopen() && holds(m);
+   t.reset();
+   for (size_t i = 0; i < 3; i++) std::remove(files[i].c_str());
+   return ok || fail("all rounds", "contents after a final reopen");
+}
+
+bool testsharded(size_t rounds, mt19937_64 &rng)
+//range shards (splitting at 64 entries, and merging back) and hash
+//shards under the same random updates, with a key window that drifts
+//upwards so that shards empty out behind it; visits must come out in
+//key order, and after a rebalance no two neighbouring range shards
+//may be small enough to merge; then threads write disjoint keys, each
+//followed by a model of its own
+{
+   typedef shardedavltree<uint64_t, uint64_t> stree;
+   const size_t maxshard = 64;
+   vector<uint64_t> bounds;
+   bounds.push_back(keyspace / 4);
+   bounds.push_back(keyspace / 2);
+   stree ranged(bounds, maxshard), hashed(8);
+   stree *trees[] = { &ranged, &hashed };
+   model m;
+   uint64_t window = 0;
+   for (size_t r = 0; r < rounds; r++) {
+      if (r % 4 == 0) window++;
+      uint64_t k = window + rng() % keyspace, d = rng() % 1000;
+      const char *name;
+      unsigned op = rng() % 3;
+      bool want;
+      if (op == 0) {
+         name = "insert";
+         want = m.insert(make_pair(k, d)).second;
+      } else if (op == 1) {
+         name = "insert_or_assign";
+         want = (m.count(k) == 0);
+         m[k] = d;
+      } else {
+         // half the removes take the smallest key, so the shards the
+         //    window leaves behind empty out
+         name = "remove";
+         if ((rng() % 2) && !m.empty()) k = m.begin()->first;
+         want = (m.erase(k) == 1);
+      }
+      for (size_t i = 0; i < 2; i++) {
+         stree &t = *trees[i];
+         bool got = (op == 0) ? t.insert(k, d) :
+                    (op == 1) ? t.insert_or_assign(k, d) : t.remove(k);
+         if (got != want) return fail(name, "result");
+         if ((t.size() != m.size()) || !finds(t, m, k))
+            return fail(name, "contents");
+      }
+
+      if (r % 97 != 0) continue;
+      for (size_t i = 0; i < 2; i++) {
+         stree &t = *trees[i];
+         if (!matches(t, m)) return fail(name, "for_each");
+         uint64_t lo = window + rng() % keyspace, hi = lo + rng() % 256;
+         vector<uint64_t> want, got;
+         for (model::iterator it = m.lower_bound(lo);
+              (it != m.end()) && (it->first <= hi); ++it)
+            want.push_back(it->first);
+         t.for_each_in_range(lo, hi, [&got](const uint64_t &k,
+                                            const uint64_t &) {
+            got.push_back(k);
+         });
+         if (want != got) return fail(name, "for_each_in_range");
+      }
+      ranged.rebalance();
+      if (ranged.shardcount() > 4 * m.size() / maxshard + 1)
+         return fail("rebalance", "too many shards");
+   }
+
+   // threads on disjoint keys: thread i only touches keys i mod 4
+   const unsigned nthreads = 4;
+   stree shared(vector<uint64_t>(), maxshard);
+   vector<model> models(nthreads);
+   vector<thread> threads;
+   atomic<bool> wrong(false);
+   for (unsigned i = 0; i < nthreads; i++) {
+      uint64_t seed = rng();
+      threads.push_back(thread([&shared, &models, &wrong, i, seed,
+                                rounds]() {
+         mt19937_64 own(seed);
+         model &mine = models[i];
+         for (size_t r = 0; r < rounds / nthreads; r++) {
+            uint64_t k = (own() % keyspace) * nthreads + i, d = own() % 1000;
+            bool ok;
+            if (own() % 2) ok = (shared.insert_or_assign(k, d) ==
+                                 (mine.count(k) == 0)), mine[k] = d;
+            else ok = (shared.remove(k) == (mine.erase(k) == 1));
+            if (!ok || !finds(shared, mine, k)) wrong = true;
+            if (r % 1024 == 0) shared.rebalance();
+         }
+      }));
+   }
+   for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+   if (wrong) return fail("threaded updates", "a result or search");
+   model all;
+   for (size_t i = 0; i < nthreads; i++)
+      all.insert(models[i].begin(), models[i].end());
+   return matches(shared, all) || fail("threaded updates", "for_each");
+}
+
+template <class Key, class Compare, class Gen>
+bool checkfrozen(size_t rounds, mt19937_64 &rng, Gen gen)
+//frozen trees of every size up to a few hundred entries (so every
+//shape of the last level), frozen from an avltree or assigned from a
+//sorted range, against a map with the same comparator: walks both
+//ways, bounds, lookups and range visits, and an unsorted range, which
+//assign must refuse
+{
+   typedef map<Key, uint64_t, Compare> kmodel;
+   typedef frozenavltree<Key, uint64_t, Compare> ftree;
+   Compare comp;
+   for (size_t r = 0; r < rounds; r++) {
+      kmodel m;
+      for (size_t n = rng() % ((r % 64 == 0) ? 700 : 70); n > 0; n--)
+         m[gen(rng)] = rng() % 1000;
+      ftree f;
+      if (rng() % 2) {
+         avltree<Key, uint64_t, Compare> t;
+         for (typename kmodel::iterator it = m.begin(); it != m.end(); ++it)
+            t.insert(it->first, it->second);
+         f = t.freeze();
+      } else if (!f.assign(m.begin(), m.end())) {
+         return fail("assign", "a sorted range refused");
+      }
+
+      if (f.size() != m.size()) return fail("freeze", "size");
+      typename ftree::const_iterator it = f.begin();
+      for (typename kmodel::iterator i = m.begin(); i != m.end(); ++i, ++it)
+         if ((it == f.end()) || (it.key() != i->first) ||
+             (it.value() != i->second))
+            return fail("freeze", "forward walk");
+      if (it != f.end()) return fail("freeze", "forward walk length");
+      for (typename kmodel::reverse_iterator i = m.rbegin(); i != m.rend();
+           ++i)
+         if ((--it).key() != i->first) return fail("freeze", "backward walk");
+
+      for (int probe = 0; probe < 8; probe++) {
+         Key k = gen(rng), hi = gen(rng);
+         typename kmodel::iterator lb = m.lower_bound(k),
+                                   ub = m.upper_bound(k);
+         typename ftree::const_iterator flb = f.lower_bound(k),
+                                        fub = f.upper_bound(k);
+         if (((flb == f.end()) != (lb == m.end())) ||
+             ((lb != m.end()) && (flb.key() != lb->first)) ||
+             ((fub == f.end()) != (ub == m.end())) ||
+             ((ub != m.end()) && (fub.key() != ub->first)))
+            return fail("freeze", "lower_bound or upper_bound");
+         uint64_t d;
+         bool found = f.search(k, d);
+         if ((found != (m.count(k) == 1)) || (found && (d != m[k])) ||
+             ((f.find(k) != f.end()) != found))
+            return fail("freeze", "search or find");
+
+         if (comp(hi, k)) swap(k, hi);
+         vector<Key> want, got;
+         for (typename kmodel::iterator i = m.lower_bound(k);
+              (i != m.end()) && !comp(hi, i->first); ++i)
+            want.push_back(i->first);
+         f.for_each_in_range(k, hi, [&got](const Key &key, const uint64_t &) {
+            got.push_back(key);
+         });
+         if (want != got) return fail("freeze", "for_each_in_range");
+      }
+
+      if ((r % 16 == 0) && (m.size() >= 2)) {
+         vector< pair<Key, uint64_t> > items(m.begin(), m.end());
+         size_t i = rng() % (items.size() - 1);
+         swap(items[i], items[i + 1]);
+         if (f.assign(items.begin(), items.end()) || (f.size() != 0) ||
+             (f.begin() != f.end()))
+            return fail("assign", "an unsorted range taken");
+      }
+   }
+   return true;
+}
+
+bool testfrozen(size_t rounds, mt19937_64 &rng)
+//signed keys (whose prefixes flip the sign bit), strings that often
+//tie on their first 8 bytes, or differ only in a trailing zero byte
+//(which the zero padded prefix can't see), and a comparator the
+//prefixes can't be used with
+{
+   static const string stems[] = { "", "ab", "abcdefg", "abcdefgh" };
+   static const char tails[] = { '\0', 'a', 'z', '\xff' };
+   return checkfrozen<int64_t, less<int64_t> >(rounds / 3, rng,
+             [](mt19937_64 &g) { return (int64_t)(g() % 4001) - 2000; }) &&
+          checkfrozen<string, less<string> >(rounds / 3, rng,
+             [](mt19937_64 &g) {
+                string k = stems[g() % 4];
+                for (size_t n = g() % 4; n > 0; n--) k += tails[g() % 4];
+                return k;
+             }) &&
+          checkfrozen<uint64_t, greater<uint64_t> >(rounds / 3, rng,
+             [](mt19937_64 &g) { return g() % keyspace; });
+}
+
+template <class Compare, unsigned Capacity>
+bool checkbuckets(size_t rounds, mt19937_64 &rng)
+//a bucketavltree with small buckets, so that they split and merge all
+//the time, checked with its own checkvalid after every step; for a
+//stretch now and then keys come just below the smallest, and so below
+//the first bucket's separator, which has to be re-keyed for them
+{
+   typedef map<uint64_t, uint64_t, Compare> kmodel;
+   bucketavltree<uint64_t, uint64_t, Compare, Capacity> t;
+   kmodel m;
+   Compare comp;
+   for (size_t r = 0; r < rounds; r++) {
+      uint64_t k = rng() % keyspace, d = rng() % 1000;
+      if (((r / 512) % 4 == 1) && !m.empty()) {
+         uint64_t first = m.begin()->first;
+         k = comp(first + 1, first) ? first + 1 : first - 1;
+      }
+      const char *name;
+      bool ok;
+      switch (rng() % 5) {
+         case 0: case 1:
+            name = "insert";
+            ok = (t.insert(k, d) == m.insert(make_pair(k, d)).second);
+            break;
+         case 2:
+            name = "insert_or_assign";
+            ok = (t.insert_or_assign(k, d) == (m.count(k) == 0));
+            m[k] = d;
+            break;
+         default:
+            name = "remove";
+            ok = (t.remove(k) == (m.erase(k) == 1));
+      }
+      if (!ok) return fail(name, "result");
+      if (rng() % 8192 == 0) {
+         name = "clear";
+         t.clear();
+         m.clear();
+      }
+      if ((t.size() != m.size()) || !t.checkvalid())
+         return fail(name, "checkvalid");
+      uint64_t p = rng() % keyspace, got;
+      typename kmodel::iterator it = m.find(p);
+      bool found = t.search(p, got);
+      if ((found != (it != m.end())) || (found && (got != it->second)))
+         return fail(name, "search");
+
+      if (r % 97 != 0) continue;
+      vector< pair<uint64_t, uint64_t> > want(m.begin(), m.end()), all;
+      t.for_each([&all](const uint64_t &k, const uint64_t &d) {
+         all.push_back(make_pair(k, d));
+      });
+      if (all != want) return fail(name, "for_each");
+      uint64_t lo = rng() % keyspace, hi = rng() % keyspace;
+      if (comp(hi, lo)) swap(lo, hi);
+      vector<uint64_t> inrange, visited;
+      for (it = m.lower_bound(lo); (it != m.end()) && !comp(hi, it->first);
+           ++it)
+         inrange.push_back(it->first);
+      t.for_each_in_range(lo, hi, [&visited](const uint64_t &k,
+                                             const uint64_t &) {
+         visited.push_back(k);
+      });
+      if (inrange != visited) return fail(name, "for_each_in_range");
+   }
+   return true;
+}
+
+bool testbuckets(size_t rounds, mt19937_64 &rng)
+//the counting rank that less<> over integers gets, and the plain scan
+//every other comparator gets
+{
+   return checkbuckets<less<uint64_t>, 4>(rounds / 2, rng) &&
+          checkbuckets<greater<uint64_t>, 8>(rounds / 2, rng);
+}
+
+bool checkarena(size_t rounds, mt19937_64 &rng, bool compress,
+                unsigned interval)
+//an arenaavltree against a map of strings; keys share long leading
+//runs (so prefixes tie and front coding has something to share) and
+//are often inserted again, which appends them and takes them back;
+//every so often the arena is compacted, and must still hold every key
+{
+   typedef map<string, uint64_t> smodel;
+   static const string stems[] = { "", "k", "user:", "user:0000",
+                                   "user:00000000/" };
+   arenaavltree<uint64_t> t(compress, interval);
+   smodel m;
+   for (size_t r = 0; r < rounds; r++) {
+      string k = stems[rng() % 5] + to_string(rng() % (keyspace / 4));
+      uint64_t d = rng() % 1000;
+      const char *name;
+      bool ok;
+      switch (rng() % 5) {
+         case 0: case 1:
+            name = "insert";
+            ok = (t.insert(k, d) == m.insert(make_pair(k, d)).second);
+            break;
+         case 2:
+            name = "insert_or_assign";
+            ok = (t.insert_or_assign(k, d) == (m.count(k) == 0));
+            m[k] = d;
+            break;
+         default:
+            name = "remove";
+            ok = (t.remove(k) == (m.erase(k) == 1));
+      }
+      if (!ok) return fail(name, "result");
+      bool rebuilt = (rng() % 1024 == 0);
+      if (rebuilt) {
+         name = "compact";
+         if (!t.compact()) return fail(name, "out of memory");
+      }
+      if (rng() % 8192 == 0) {
+         name = "clear";
+         t.clear();
+         m.clear();
+      }
+      if (t.size() != m.size()) return fail(name, "size");
+      string p = stems[rng() % 5] + to_string(rng() % (keyspace / 4));
+      smodel::iterator it = m.find(p);
+      uint64_t got;
+      bool found = t.search(p, got);
+      if ((found != (it != m.end())) || (found && (got != it->second)))
+         return fail(name, "search");
+
+      if ((r % 97 != 0) && !rebuilt) continue;
+      vector< pair<string, uint64_t> > want(m.begin(), m.end()), all;
+      t.for_each([&all](const string &k, const uint64_t &d) {
+         all.push_back(make_pair(k, d));
+      });
+      if (all != want) return fail(name, "for_each");
+   }
+   return true;
+}
+
+bool testarena(size_t rounds, mt19937_64 &rng)
+//plain keys, then front coded keys with a whole key every 16, and
+//with one every 3 (so most reads cross a restart)
+{
+   return checkarena(rounds / 3, rng, false, 16) &&
+          checkarena(rounds / 3, rng, true, 16) &&
+          checkarena(rounds / 3, rng, true, 3);
+}
+
+// what an avlcache should hold: its entries, the order they were last
+//    used in (oldest first) and its counters; a short lived entry has
+//    expired by the time the next operation starts (see testcache), so
+//    an entry is either short lived and due, or never due in the test
+struct cachemodel {
+   struct item {
+      uint64_t value;
+      size_t bytes;
+      bool shortlived;
+   };
+   map<uint64_t, item> items;
+   deque<uint64_t> order;
+   size_t maxentries, maxbytes, bytes;
+   avlcachestats counts;
+
+   cachemodel(size_t entrylimit, size_t bytelimit) :
+      maxentries(entrylimit), maxbytes(bytelimit), bytes(0) {
+      memset(&counts, 0, sizeof(counts));
+   }
+   void drop(uint64_t k) {
+      bytes -= items[k].bytes;
+      items.erase(k);
+      order.erase(find(order.begin(), order.end(), k));
+   }
+   void touch(uint64_t k) {
+      order.erase(find(order.begin(), order.end(), k));
+      order.push_back(k);
+   }
+   // drop every short lived entry (but keep, if keeping), as expired
+   size_t expire(uint64_t keep, bool keeping) {
+      size_t n = 0;
+      for (map<uint64_t, item>::iterator it = items.begin();
+           it != items.end(); ) {
+         uint64_t k = (it++)->first;
+         if (items[k].shortlived && !(keeping && (k == keep))) {
+            drop(k);
+            n++;
+         }
+      }
+      counts.expirations += n;
+      return n;
+   }
+   bool get(uint64_t k, uint64_t &d) {
+      map<uint64_t, item>::iterator it = items.find(k);
+      if ((it == items.end()) || it->second.shortlived) {
+         if (it != items.end()) {
+            drop(k);
+            counts.expirations++;
+         }
+         counts.misses++;
+         return false;
+      }
+      touch(k);
+      d = it->second.value;
+      counts.hits++;
+      return true;
+   }
+   bool put(uint64_t k, uint64_t d, size_t size, bool shortlived) {
+      bool added = (items.count(k) == 0);
+      if (added) order.push_back(k);
+      else {
+         bytes -= items[k].bytes;
+         touch(k);
+      }
+      item i = { d, size, shortlived };
+      items[k] = i;
+      bytes += size;
+      expire(k, true);
+      while (!order.empty() &&
+             ((maxentries && (items.size() > maxentries)) ||
+              (maxbytes && (bytes > maxbytes)))) {
+         drop(order.front());
+         counts.evictions++;
+      }
+      return added;
+   }
+};
+
+bool testcache(size_t rounds, mt19937_64 &rng)
+//an avlcache under both an entry and a byte budget against a model of
+//its LRU and TTL rules, comparing every result, its size, its bytes
+//and its counters after each step; entries are put to live forever,
+//for an hour, or for a microsecond, and after a short lived put the
+//test waits out the microsecond, so whether such an entry is still
+//there never depends on timing
+{
+   typedef avlcache<uint64_t, uint64_t> cache;
+   typedef cache::clock clock;
+   const uint64_t keys = keyspace / 16;
+   cache c(48, 120, cache::duration::zero(),
+           [](const uint64_t &, const uint64_t &d) {
+              return (size_t)(1 + d % 5);
+           });
+   cachemodel m(48, 120);
+   for (size_t r = 0; r < rounds; r++) {
+      uint64_t k = rng() % keys, d = rng() % 1000, got = 0, want = 0;
+      const char *name;
+      bool ok;
+      switch (rng() % 8) {
+         case 0: case 1: case 2: {
+            name = "get";
+            bool found = c.get(k, got);
+            ok = (found == m.get(k, want)) && (got == want);
+            break;
+         }
+         case 3: {
+            name = "get_or_load";
+            // the loader finds two keys in three
+            auto load = [](const uint64_t &key, uint64_t &value) {
+               value = key * 7;
+               return (key % 3) != 0;
+            };
+            bool found = c.get_or_load(k, got, load);
+            bool hit = m.get(k, want);
+            if (!hit) {
+               m.counts.loads++;
+               if (load(k, want)) m.put(k, want, 1 + want % 5, false);
+            }
+            ok = (found == (hit || (k % 3 != 0))) && (!found || got == want);
+            break;
+         }
+         case 4: case 5: {
+            name = "put";
+            unsigned life = rng() % 3;
+            bool added = (life == 0) ? c.put(k, d) :
+                         c.put(k, d, (life == 1) ?
+                                     cache::duration(chrono::hours(1)) :
+                                     cache::duration(chrono::microseconds(1)));
+            ok = (added == m.put(k, d, 1 + d % 5, life == 2));
+            if (life == 2) {
+               clock::time_point due = clock::now() + chrono::microseconds(1);
+               while (clock::now() < due) { }
+            }
+            break;
+         }
+         case 6:
+            name = "remove";
+            ok = (c.remove(k) == (m.items.count(k) == 1));
+            if (m.items.count(k)) m.drop(k);
+            break;
+         default:
+            name = "expire";
+            ok = (c.expire() == m.expire(0, false));
+      }
+      if (!ok) return fail(name, "result");
+      if (rng() % 4096 == 0) {
+         name = "clear";
+         c.clear();
+         m.items.clear();
+         m.order.clear();
+         m.bytes = 0;
+      }
+      if ((c.size() != m.items.size()) || (c.bytes() != m.bytes))
+         return fail(name, "size or bytes");
+      avlcachestats s = c.stats();
+      if ((s.hits != m.counts.hits) || (s.misses != m.counts.misses) ||
+          (s.loads != m.counts.loads) || (s.coalesced != 0) ||
+          (s.evictions != m.counts.evictions) ||
+          (s.expirations != m.counts.expirations))
+         return fail(name, "stats");
+   }
+   return true;
+}
+
+struct difftest {
+   const char *name;
+   bool (*run)(size_t rounds, mt19937_64 &rng);
+};
+
+const difftest tests[] = {
+   { "avltree", testavltree },
+   { "concurrent", testconcurrent },
+   { "persistent", testpersistent },
+   { "compact", testcompact },
+   { "mapped", testmapped },
+   { "durable", testdurable },
+   { "sharded", testsharded },
+   { "frozen", testfrozen },
+   { "buckets", testbuckets },
+   { "arena", testarena },
+   { "cache", testcache },
+};
+const size_t ntests = sizeof(tests) / sizeof(tests[0]);
+
+int main(int argc, char **argv)
+{
+   const difftest *test = &tests[0];
+   int arg = 1;
+   if ((argc > 1) && !isdigit((unsigned char)argv[1][0])) {
+      for (test = tests; test < tests + ntests; test++)
+         if (strcmp(argv[1], test->name) == 0) break;
+      if (test == tests + ntests) {
+         fprintf(stderr, "usage: %s [test] [rounds] [seed]\ntests:", argv[0]);
+         for (size_t i = 0; i < ntests; i++)
+            fprintf(stderr, " %s", tests[i].name);
+         fprintf(stderr, "\n");
+         return 2;
+      }
+      arg++;
+   }
+   size_t rounds = (argc > arg) ? strtoul(argv[arg], NULL, 10) : 20000;
+   uint64_t seed = (argc > arg + 1) ? strtoull(argv[arg + 1], NULL, 10) : 1;
+   mt19937_64 rng(seed);
+
+   if (!test->run(rounds, rng)) return 1;
+   printf("%s: %zu rounds (seed %llu) agree\n", test->name, rounds,
+          (unsigned long long)seed);
+   return 0;
+}
@@ -0,0 +1,524 @@
+/*
+AVL tree made durable by a write-ahead log
+*/
+
+#ifndef DURABLEAVLTREE_H
+#define DURABLEAVLTREE_H 1
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <cerrno>
+#include "avltree.h"
+using namespace std;
+
+// when the log is forced to disk with fdatasync
+//    syncnever:    never; the log is written out but the OS decides
+//                  when it reaches the disk, so a machine crash can
+//                  lose recent updates
+//    syncinterval: at most every interval ms; a crash loses at most
+//                  about one interval of updates
+//    synccommit:   before any update returns; nothing acknowledged is
+//                  ever lost, and concurrent updates share each sync
+// under syncnever and syncinterval an update returns as soon as its
+//    record is queued, before the flusher has written it, so even a
+//    process crash loses the group still being queued or written
+enum fsyncpolicy { syncnever, syncinterval, synccommit };
+
+// an avltree whose updates survive a crash
+//
+// every update is applied to the tree in memory and appended to a
+//    write-ahead log; a background thread writes the log out in
+//    groups, so one write (and one sync) covers every update that
+//    arrived while the previous group was being written
+// each update not yet written keeps what it replaced, so that if a
+//    log write (or its sync) fails, the log is cut back to the end of
+//    the last group written whole and every update after that is
+//    undone, newest first, leaving the tree holding what the log does
+// if the log can't be cut back, the length it should have is left in
+//    base.wal.cut, and opening cuts it there before replaying (or
+//    fails, if it can't), so the records that were undone are never
+//    replayed
+// checkpoint() saves the whole tree as an image (see avltree::save)
+//    and empties the log; opening replays the log over the latest
+//    image, and a torn record at the end of the log (a crash mid
+//    write) is discarded
+// given a base path, the image is base.snapshot and the log base.wal
+// Key and Value must have an avlcodec; all public methods are safe to
+//    call from several threads
+template <class Key, class Value, class Compare = less<Key> >
+class durableavltree {
+   private:
+      // log records: a header, then the op, the key size, the key
+      //    bytes and (for upserts) the value bytes
+      struct recordheader {
+         uint32_t bytes;        // of everything after the header
+         uint32_t checksum;     // low half of its FNV-1a
+      };
+      enum { logupsert = 1, logerase = 2 };
+
+      // what an update replaced: k's old value, or null if k was absent
+      struct undorecord {
+         Key key;
+         unique_ptr<Value> old;
+         undorecord(const Key &k, const Value *d) :
+            key(k), old(d ? new Value(*d) : NULL) { }
+      };
+
+      avltree<Key, Value, Compare> tree;
+      string imagepath, logpath;
+      int logfd;
+      fsyncpolicy policy;
+      unsigned intervalms;
+
+      // everything below is guarded by m
+      mutex m;
+      condition_variable wakeflusher, flushed;
+      string pending;           // records not yet handed to the log
+      deque<undorecord> undos;  // one per record not yet durable,
+                                //    oldest first
+      size_t lastrecord;        // where the last record in pending
+                                //    starts
+      uint64_t appended;        // records appended so far
+      uint64_t durable;         // records written (and synced, if the
+                                //    policy asks for it)
+      bool flushing;            // the flusher is writing a group
+      bool stopping;
+      bool broken;              // a log write failed
+      thread flusher;
+      uint64_t logbytes;        // the log's length after the last group
+                                //    written whole (flusher only)
+
+      void flushloop();
+      bool writeall(const char *p, size_t bytes);
+      bool stage(int op, const Key &k, const Value *d, const Value *old);
+      void unstage();
+      void rollback();
+      bool commit(unique_lock<mutex> &lock);
+      bool replay();
+      bool loadimage();
+      void cutlog(uint64_t length);
+      bool applycut();
+
+      // the log and its thread are owned, so these can't be copied
+      durableavltree(const durableavltree &);
+      durableavltree &operator=(const durableavltree &);
+
+   public:
+      durableavltree() :
+         logfd(-1), policy(synccommit), intervalms(0), lastrecord(0),
+         appended(0),
+         durable(0), flushing(false), stopping(false), broken(false),
+         logbytes(0) { }
+      ~durableavltree() { close(); }
+
+      // recover the tree stored at base (or start an empty one) and
+      //    start logging; returns false if the image or log can't be
+      //    read, or the log can't be opened for writing
+      bool open(const string &base, fsyncpolicy p = synccommit,
+                unsigned interval = 100);
+      // write out and sync whatever is left in the log, and stop
+      void close();
+
+      // as the avltree methods of the same names; an update is in the
+      //    log (and, under synccommit, on disk) by the time it returns
+      // once a log write has failed every update returns false, and
+      //    the updates the log never took are undone in the tree (see
+      //    above); an update that runs out of memory returns false
+      //    having changed nothing
+      bool insert(const Key &k, const Value &d);
+      bool insert_or_assign(const Key &k, const Value &d);
+      bool remove(const Key &k);
+      bool search(const Key &k, Value &d);
+      size_t size();
+
+      // save the tree as the new image and empty the log
+      // updates wait while the image is written
+      bool checkpoint();
+      bool failed();
+};
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::loadimage()
+// fill the tree from the image, if there is one; the image is mapped
+//    and streamed into a bottom-up build, already in key order
+{
+   if (access(imagepath.c_str(), F_OK) != 0) return true;
+   mappedavltree<Key, Value, Compare> image;
+   if (!image.open(imagepath)) return false;
+   vector< pair<Key, Value> > items;
+   items.reserve(image.size());
+   bool whole = image.for_each([&items](const Key &k, const Value &d) {
+      items.push_back(make_pair(k, d));
+   });
+   return whole && tree.build_from_sorted(make_move_iterator(items.begin()),
+                                 make_move_iterator(items.end()));
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::replay()
+// apply every intact record in the log to the tree, then cut the log
+//    off after the last of them
+{
+   string log;
+   char buffer[65536];
+   ssize_t got;
+   while ((got = read(logfd, buffer, sizeof(buffer))) != 0) {
+      if (got < 0) {
+         if (errno == EINTR) continue;
+         return false;
+      }
+      log.append(buffer, got);
+   }
+
+   size_t at = 0;
+   while (log.size() - at >= sizeof(recordheader)) {
+      recordheader h;
+      memcpy(&h, log.data() + at, sizeof(h));
+      const char *p = log.data() + at + sizeof(h);
+      if (h.bytes > log.size() - at - sizeof(h)) break;
+      if ((uint32_t)avlfnv(p, h.bytes) != h.checksum) break;
+      uint32_t keybytes;
+      if (h.bytes < 1 + sizeof(keybytes)) break;
+      memcpy(&keybytes, p + 1, sizeof(keybytes));
+      if (keybytes > h.bytes - 1 - sizeof(keybytes)) break;
+
+      const char *key = p + 1 + sizeof(keybytes);
+      Key k = avlcodec<Key>::decode(key, keybytes);
+      if (p[0] == logupsert) {
+         const char *value = key + keybytes;
+         size_t valuebytes = h.bytes - 1 - sizeof(keybytes) - keybytes;
+         tree.insert_or_assign(k, avlcodec<Value>::decode(value, valuebytes));
+      } else {
+         tree.remove(k);
+      }
+      at += sizeof(h) + h.bytes;
+   }
+
+   // drop a torn tail so new records follow the last good one
+   logbytes = at;
+   return (at == log.size()) ||
+          ((ftruncate(logfd, at) == 0) && (fdatasync(logfd) == 0));
+}
+
+template <class Key, class Value, class Compare>
+void durableavltree<Key, Value, Compare>::cutlog(uint64_t length)
+// take back a group that failed to be written (or synced) whole, by
+//    cutting the log to the given length; failing that, leave the
+//    length in the cut file for open to apply
+{
+   if ((ftruncate(logfd, length) == 0) && (fdatasync(logfd) == 0)) return;
+   string cutpath = logpath + ".cut";
+   FILE *f = fopen(cutpath.c_str(), "w");
+   if (!f) return;
+   bool ok = (fprintf(f, "%llu\n", (unsigned long long)length) > 0) &&
+             (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+   ok = (fclose(f) == 0) && ok;
+   if (ok) avlsyncdirectory(cutpath);
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::applycut()
+// cut the log to the length a failed flush left in the cut file, if
+//    there is one, then remove the file
+{
+   string cutpath = logpath + ".cut";
+   if (access(cutpath.c_str(), F_OK) != 0) return true;
+   FILE *f = fopen(cutpath.c_str(), "r");
+   if (!f) return false;
+   unsigned long long length;
+   bool ok = (fscanf(f, "%llu", &length) == 1);
+   fclose(f);
+   ok = ok && (ftruncate(logfd, length) == 0) && (fdatasync(logfd) == 0);
+   return ok && (std::remove(cutpath.c_str()) == 0) &&
+          avlsyncdirectory(cutpath);
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::open(const string &base,
+                                               fsyncpolicy p,
+                                               unsigned interval)
+{
+   close();
+   imagepath = base + ".snapshot";
+   logpath = base + ".wal";
+   policy = p;
+   intervalms = interval ? interval : 1;
+   tree.clear();
+
+   logfd = ::open(logpath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+   if (logfd < 0) return false;
+   if (!applycut() || !loadimage() || !replay()) {
+      ::close(logfd);
+      logfd = -1;
+      tree.clear();
+      return false;
+   }
+
+   appended = durable = 0;
+   undos.clear();
+   flushing = stopping = broken = false;
+   flusher = thread(&durableavltree::flushloop, this);
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+void durableavltree<Key, Value, Compare>::close()
+{
+   if (logfd < 0) return;
+   {
+      lock_guard<mutex> lock(m);
+      stopping = true;
+   }
+   wakeflusher.notify_one();
+   flusher.join();
+   ::close(logfd);
+   logfd = -1;
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::writeall(const char *p,
+                                                   size_t bytes)
+// write(2) until everything is out, retrying short writes
+{
+   while (bytes > 0) {
+      ssize_t done = write(logfd, p, bytes);
+      if (done < 0) {
+         if (errno == EINTR) continue;
+         return false;
+      }
+      p += done;
+      bytes -= done;
+   }
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+void durableavltree<Key, Value, Compare>::flushloop()
+// the group commit loop: take every record appended so far, write
+//    them with one call (and sync, as the policy says) outside the
+//    lock, then let the updates waiting on them go
+{
+   unique_lock<mutex> lock(m);
+   chrono::steady_clock::time_point lastsync = chrono::steady_clock::now();
+   bool unsynced = false;
+   string group;
+   for (;;) {
+      if (pending.empty() && !stopping) {
+         if ((policy == syncinterval) && unsynced)
+            wakeflusher.wait_for(lock, chrono::milliseconds(intervalms));
+         else
+            wakeflusher.wait(lock);
+      }
+
+      group.clear();
+      group.swap(pending);
+      uint64_t upto = appended;
+      bool last = stopping;
+      flushing = true;
+      lock.unlock();
+
+      uint64_t start = logbytes;
+      bool ok = group.empty() || writeall(group.data(), group.size());
+      unsynced = unsynced || !group.empty();
+      chrono::steady_clock::time_point now = chrono::steady_clock::now();
+      bool sync = unsynced &&
+                  ((policy == synccommit) || last ||
+                   ((policy == syncinterval) &&
+                    (now - lastsync >= chrono::milliseconds(intervalms))));
+      if (ok && sync) {
+         ok = (fdatasync(logfd) == 0);
+         lastsync = now;
+         unsynced = false;
+      }
+      if (ok) logbytes += group.size();
+      else cutlog(start);
+
+      lock.lock();
+      flushing = false;
+      if (!ok) {
+         // the records queued meanwhile are undone too
+         broken = true;
+         rollback();
+         upto = appended;
+      } else {
+         undos.erase(undos.begin(), undos.begin() + (upto - durable));
+      }
+      durable = upto;
+      flushed.notify_all();
+      if (last) return;
+   }
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::stage(int op, const Key &k,
+                                                const Value *d,
+                                                const Value *old)
+// append a record for a change to the pending group, and its undo
+//    record (under m), before the tree is touched
+// returns false, leaving both as they were, if memory runs out
+{
+   size_t start = pending.size();
+   try {
+      recordheader h = { 0, 0 };
+      pending.append(reinterpret_cast<const char*>(&h), sizeof(h));
+      pending += (char)op;
+      uint32_t keybytes = 0;
+      size_t keyat = pending.size();
+      pending.append(reinterpret_cast<const char*>(&keybytes),
+                     sizeof(keybytes));
+      avlcodec<Key>::encode(k, pending);
+      keybytes = pending.size() - keyat - sizeof(keybytes);
+      memcpy(&pending[keyat], &keybytes, sizeof(keybytes));
+      if (d) avlcodec<Value>::encode(*d, pending);
+
+      const char *payload = pending.data() + start + sizeof(h);
+      h.bytes = pending.size() - start - sizeof(h);
+      h.checksum = (uint32_t)avlfnv(payload, h.bytes);
+      memcpy(&pending[start], &h, sizeof(h));
+      undos.emplace_back(k, old);
+   } catch (bad_alloc &) {
+      pending.resize(start);
+      return false;
+   }
+   lastrecord = start;
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+void durableavltree<Key, Value, Compare>::unstage()
+// take back the record just staged, whose change the tree refused
+{
+   pending.resize(lastrecord);
+   undos.pop_back();
+}
+
+template <class Key, class Value, class Compare>
+void durableavltree<Key, Value, Compare>::rollback()
+// the log has failed: undo every change it didn't take, newest first
+//    (under m)
+// putting back a removed entry reuses the node the remove returned to
+//    the tree's pool, so it doesn't need fresh memory
+{
+   while (!undos.empty()) {
+      undorecord &u = undos.back();
+      if (u.old) tree.insert_or_assign(u.key, *u.old);
+      else tree.remove(u.key);
+      undos.pop_back();
+   }
+   pending.clear();
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::commit(unique_lock<mutex> &lock)
+// hand the record just appended to the flusher; under synccommit, wait
+//    until it is on disk (other updates carry on meanwhile)
+{
+   uint64_t mine = appended;
+   wakeflusher.notify_one();
+   if (policy == synccommit) {
+      while ((durable < mine) && !broken) flushed.wait(lock);
+   }
+   return !broken;
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::insert(const Key &k, const Value &d)
+{
+   unique_lock<mutex> lock(m);
+   if (broken || (logfd < 0)) return false;
+   if (tree.find(k) != tree.end()) return false;
+   if (!stage(logupsert, k, &d, NULL)) return false;
+   if (!tree.insert(k, d)) {
+      unstage();
+      return false;
+   }
+   appended++;
+   return commit(lock);
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::insert_or_assign(const Key &k,
+                                                           const Value &d)
+{
+   unique_lock<mutex> lock(m);
+   if (broken || (logfd < 0)) return false;
+   typename avltree<Key, Value, Compare>::iterator it = tree.find(k);
+   bool existed = (it != tree.end());
+   if (!stage(logupsert, k, &d, existed ? &it.value() : NULL)) return false;
+   bool inserted = tree.insert_or_assign(k, d);
+   if (!existed && !inserted) {
+      // out of memory
+      unstage();
+      return false;
+   }
+   appended++;
+   return commit(lock) && inserted;
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::remove(const Key &k)
+{
+   unique_lock<mutex> lock(m);
+   if (broken || (logfd < 0)) return false;
+   typename avltree<Key, Value, Compare>::iterator it = tree.find(k);
+   if (it == tree.end()) return false;
+   if (!stage(logerase, k, NULL, &it.value())) return false;
+   tree.remove(k);
+   appended++;
+   return commit(lock);
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::search(const Key &k, Value &d)
+{
+   lock_guard<mutex> lock(m);
+   return tree.search(k, d);
+}
+
+template <class Key, class Value, class Compare>
+size_t durableavltree<Key, Value, Compare>::size()
+{
+   lock_guard<mutex> lock(m);
+   return tree.size();
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::failed()
+{
+   lock_guard<mutex> lock(m);
+   return broken;
+}
+
+template <class Key, class Value, class Compare>
+bool durableavltree<Key, Value, Compare>::checkpoint()
+// once the flusher is idle, everything it was handed is in the log;
+//    the image then covers the pending group too, so that is dropped
+//    along with the log itself
+// save syncs the image's directory, so the log is only emptied once
+//    the new image is sure to be found in place of the old one
+// a crash after the image is renamed into place but before the log is
+//    emptied is harmless: replaying updates that the image already
+//    holds, in order, ends in the same state
+{
+   unique_lock<mutex> lock(m);
+   if (broken || (logfd < 0)) return false;
+   while (flushing) flushed.wait(lock);
+   if (!tree.save(imagepath)) return false;
+   pending.clear();
+   undos.clear();
+   durable = appended;
+   logbytes = 0;
+   if ((ftruncate(logfd, 0) != 0) || (fdatasync(logfd) != 0)) {
+      broken = true;
+      return false;
+   }
+   flushed.notify_all();
+   return true;
+}
+
+#endif
@@ -0,0 +1,286 @@
+/*
+Read-only, pointer free AVL tree map in Eytzinger layout
+*/
+
+#ifndef FROZENAVLTREE_H
+#define FROZENAVLTREE_H 1
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include "keyprefix.h"
+using namespace std;
+
+// an immutable map laid out as an implicit binary search tree in
+//    Eytzinger (breadth first) order: the root is entry 1 and the
+//    children of entry i are entries 2i and 2i + 1, so there are no
+//    pointers to chase, and the entries a descent reaches in the next
+//    few levels sit together in memory, where they can be prefetched
+//    long before they are needed
+// each step of a descent is a comparison and a shift, without
+//    branches; for less<Key> over a key type with a keyprefix (see
+//    keyprefix.h) the descent compares 64 bit prefixes from a dense
+//    array of their own, touching the keys themselves only on ties
+// made by avltree::freeze, or from any sorted range with assign
+template <class Key, class Value, class Compare = less<Key> >
+class frozenavltree {
+   private:
+      // entry 0 is unused, so that entry i's children are 2i, 2i + 1
+      vector<Key> keys;
+      vector<Value> values;
+      vector<uint64_t> prefixes;      // empty unless useprefix
+      size_t count;
+      Compare comp;
+
+      static const bool useprefix = is_same<Compare, less<Key> >::value &&
+                                    keyprefix<Key>::available;
+      static const bool exactprefix = useprefix && keyprefix<Key>::exact;
+
+      template <class It> bool fill(It &it, size_t i, const Key* &last);
+      template <bool strict> size_t descend(const Key &k) const;
+      static size_t successor(size_t i, size_t n);
+      static size_t predecessor(size_t i, size_t n);
+
+      static void prefetch(const void *p) {
+#ifdef __GNUC__
+         __builtin_prefetch(p);
+#endif
+      }
+
+   public:
+      frozenavltree(const Compare &c = Compare()) : count(0), comp(c) { }
+
+      // replace the contents with the (key, value) pairs in
+      //    [first, last), which must be strictly increasing by key
+      // returns false (leaving the tree empty) if they are not
+      template <class It> bool assign(It first, It last);
+
+      size_t size() const { return count; }
+      // the memory the entries occupy
+      size_t bytes() const {
+         return keys.capacity() * sizeof(Key) +
+                values.capacity() * sizeof(Value) +
+                prefixes.capacity() * sizeof(uint64_t);
+      }
+
+      // bidirectional iterators over the entries in key order; an
+      //    iterator is just an entry number, so stepping walks the
+      //    implicit tree (O(1) amortized)
+      class const_iterator {
+         private:
+            friend class frozenavltree;
+            const frozenavltree *tree;
+            size_t i;                 // 0 at end()
+            const_iterator(const frozenavltree *t, size_t at) :
+               tree(t), i(at) { }
+
+         public:
+            typedef bidirectional_iterator_tag iterator_category;
+            typedef pair<const Key, Value> value_type;
+            typedef ptrdiff_t difference_type;
+            typedef pair<const Key&, const Value&> reference;
+            struct pointer {
+               reference r;
+               const reference *operator->() const { return &r; }
+            };
+
+            const_iterator() : tree(NULL), i(0) { }
+
+            const Key &key() const { return tree->keys[i]; }
+            const Value &value() const { return tree->values[i]; }
+            reference operator*() const { return reference(key(), value()); }
+            pointer operator->() const {
+               pointer p = { **this };
+               return p;
+            }
+
+            const_iterator &operator++() {
+               i = successor(i, tree->count);
+               return *this;
+            }
+            // stepping back from end() gives the largest entry
+            const_iterator &operator--() {
+               i = predecessor(i, tree->count);
+               return *this;
+            }
+            const_iterator operator++(int) {
+               const_iterator old(*this);
+               ++*this;
+               return old;
+            }
+            const_iterator operator--(int) {
+               const_iterator old(*this);
+               --*this;
+               return old;
+            }
+
+            bool operator==(const const_iterator &other) const {
+               return i == other.i;
+            }
+            bool operator!=(const const_iterator &other) const {
+               return i != other.i;
+            }
+      };
+      typedef const_iterator iterator;
+
+      const_iterator begin() const {
+         size_t i = 1;
+         while (2 * i <= count) i *= 2;
+         return const_iterator(this, count ? i : 0);
+      }
+      const_iterator end() const { return const_iterator(this, 0); }
+
+      // the first entry with a key not less than k (lower_bound) or
+      //    greater than k (upper_bound), or end() if there is none
+      const_iterator lower_bound(const Key &k) const {
+         return const_iterator(this, descend<false>(k));
+      }
+      const_iterator upper_bound(const Key &k) const {
+         return const_iterator(this, descend<true>(k));
+      }
+      const_iterator find(const Key &k) const {
+         size_t i = descend<false>(k);
+         return (i && !comp(k, keys[i])) ? const_iterator(this, i) : end();
+      }
+      bool search(const Key &k, Value &d) const {
+         size_t i = descend<false>(k);
+         if (!i || comp(k, keys[i])) return false;
+         d = values[i];
+         return true;
+      }
+
+      // call fn(key, value) for every entry (from lo to hi inclusive),
+      //    in key order
+      template <class F>
+      void for_each_in_range(const Key &lo, const Key &hi, F fn) const {
+         for (const_iterator it = lower_bound(lo); it != end(); ++it) {
+            if (comp(hi, it.key())) break;
+            fn(it.key(), it.value());
+         }
+      }
+      template <class F>
+      void for_each(F fn) const {
+         for (const_iterator it = begin(); it != end(); ++it)
+            fn(it.key(), it.value());
+      }
+};
+
+template <class Key, class Value, class Compare>
+template <class It>
+bool frozenavltree<Key, Value, Compare>::assign(It first, It last)
+// the entries are dealt out in order by an in order walk of the
+//    implicit tree
+{
+   count = distance(first, last);
+   keys.assign(count + 1, Key());
+   values.assign(count + 1, Value());
+   const Key *previous = NULL;
+   bool ok = fill(first, 1, previous);
+   if (ok && useprefix) {
+      prefixes.resize(count + 1);
+      for (size_t i = 1; i <= count; i++)
+         prefixes[i] = keyprefix<Key>::get(keys[i]);
+   }
+   if (!ok) {
+      count = 0;
+      vector<Key>().swap(keys);
+      vector<Value>().swap(values);
+   }
+   if (!ok || !useprefix) vector<uint64_t>().swap(prefixes);
+   return ok;
+}
+
+template <class Key, class Value, class Compare>
+template <class It>
+bool frozenavltree<Key, Value, Compare>::fill(It &it, size_t i,
+                                              const Key* &last)
+// fill the subtree at entry i from it, in order; last is the entry
+//    filled before, which must have a smaller key
+{
+   if (i > count) return true;
+   if (!fill(it, 2 * i, last)) return false;
+   keys[i] = (*it).first;
+   values[i] = (*it).second;
+   ++it;
+   if (last && !comp(*last, keys[i])) return false;
+   last = &keys[i];
+   return fill(it, 2 * i + 1, last);
+}
+
+template <class Key, class Value, class Compare>
+template <bool strict>
+size_t frozenavltree<Key, Value, Compare>::descend(const Key &k) const
+// the entry lower_bound (or with strict, upper_bound) finds, or 0
+// the descent goes right past every entry below k (or not above it)
+//    until it falls off the tree; the entry found is then the last
+//    one it went left at, whose number is what remains after dropping
+//    the trailing right turns (1 bits) and the final left turn
+// with 8 byte prefixes, the 16 entries four levels down sit in two
+//    cache lines, which are prefetched while the four levels above
+//    them are compared
+{
+   size_t i = 1;
+   if (useprefix) {
+      const uint64_t *p = prefixes.data();
+      uint64_t x = keyprefix<Key>::get(k);
+      while (i <= count) {
+         prefetch(p + 16 * i);
+         prefetch(p + 16 * i + 8);
+         uint64_t y = p[i];
+         bool right;
+         if (exactprefix) right = strict ? (y <= x) : (y < x);
+         else if (y != x) right = y < x;
+         else right = strict ? !comp(k, keys[i]) : comp(keys[i], k);
+         i = 2 * i + right;
+      }
+   } else {
+      const Key *p = keys.data();
+      while (i <= count) {
+         prefetch(p + 16 * i);
+         bool right = strict ? !comp(k, p[i]) : comp(p[i], k);
+         i = 2 * i + right;
+      }
+   }
+#ifdef __GNUC__
+   i >>= __builtin_ctzll(~(unsigned long long)i) + 1;
+#else
+   while (i & 1) i >>= 1;
+   i >>= 1;
+#endif
+   return i;
+}
+
+template <class Key, class Value, class Compare>
+size_t frozenavltree<Key, Value, Compare>::successor(size_t i, size_t n)
+// the leftmost entry of the right subtree, or else the nearest
+//    ancestor we are in the left subtree of (0 past the last entry)
+{
+   if (2 * i + 1 <= n) {
+      for (i = 2 * i + 1; 2 * i <= n; i *= 2) { }
+      return i;
+   }
+   while (i & 1) i >>= 1;
+   return i >> 1;
+}
+
+template <class Key, class Value, class Compare>
+size_t frozenavltree<Key, Value, Compare>::predecessor(size_t i, size_t n)
+// as successor, mirrored; from 0 (end) it gives the largest entry
+{
+   if (i == 0) {
+      for (i = n ? 1 : 0; i && 2 * i + 1 <= n; i = 2 * i + 1) { }
+      return i;
+   }
+   if (2 * i <= n) {
+      for (i = 2 * i; 2 * i + 1 <= n; i = 2 * i + 1) { }
+      return i;
+   }
+   while (i > 1 && !(i & 1)) i >>= 1;
+   return i >> 1;
+}
+
+#endif
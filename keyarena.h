@@ -0,0 +1,367 @@
+/*
+String keys kept in a contiguous arena, and an AVL tree map over them
+*/
+
+#ifndef KEYARENA_H
+#define KEYARENA_H 1
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include "avltree.h"
+#include "keyprefix.h"
+using namespace std;
+
+// a key as a tree node holds it: an arena entry number and length,
+//    and the key's first 8 bytes as an integer (see keyprefix.h), so
+//    a comparison only reads the arena when two prefixes tie
+struct arenakey {
+   uint64_t prefix;
+   uint32_t id;
+   uint32_t length;
+};
+
+// a string to look up, with its prefix worked out once per lookup
+struct arenaprobe {
+   const char *data;
+   size_t length;
+   uint64_t prefix;
+   explicit arenaprobe(const string &s) :
+      data(s.data()), length(s.size()), prefix(keyprefix<string>::get(s)) { }
+};
+
+// the bytes of every key, one after another
+// with compression each key is stored as the length it shares with the
+//    key appended before it and the bytes that follow; every
+//    restartinterval-th key is stored whole, so reading a key decodes
+//    at most restartinterval entries
+// keys are only ever appended (or the last one taken back), so the
+//    bytes of keys removed from a tree stay until the arena is rebuilt
+class keyarena {
+   private:
+      vector<char> blob;
+      // the offset of every key, or with compression of every
+      //    restartinterval-th key
+      vector<uint64_t> starts;
+      size_t count;
+      bool compressed;
+      unsigned interval;
+      // with compression, the last key appended and the one before it
+      //    (to undo an append), and the blob size before the last append
+      string last, undo;
+      size_t undobytes;
+#ifdef AVLTREE_STATS
+      mutable avlcounters::counter fullcompares;
+#endif
+
+      void putvarint(uint64_t v) {
+         for (; v >= 0x80; v >>= 7) blob.push_back((char)(v | 0x80));
+         blob.push_back((char)v);
+      }
+      uint64_t getvarint(size_t &pos) const {
+         uint64_t v = 0;
+         for (int shift = 0; ; shift += 7) {
+            unsigned char c = blob[pos++];
+            v |= (uint64_t)(c & 0x7f) << shift;
+            if (!(c & 0x80)) return v;
+         }
+      }
+
+      // compare byte strings that agree on their first 8 bytes
+      static int tail(const char *a, size_t alength,
+                      const char *b, size_t blength) {
+         size_t n = alength < blength ? alength : blength;
+         int c = memcmp(a + 8, b + 8, n - 8);
+         if (c) return c;
+         return (alength < blength) ? -1 : (alength > blength);
+      }
+
+      // arenas are referred to by the comparators of their trees, so
+      //    they can't be copied
+      keyarena(const keyarena &);
+      keyarena &operator=(const keyarena &);
+
+   public:
+      keyarena(bool compress = false, unsigned restartinterval = 16) :
+         count(0), compressed(compress),
+         interval(restartinterval ? restartinterval : 1), undobytes(0) {
+#ifdef AVLTREE_STATS
+         fullcompares = 0;
+#endif
+      }
+
+      arenakey append(const string &k);
+      // take back the last key appended (only once per append)
+      void poplast();
+      // the text of key id
+      void get(uint32_t id, string &out) const;
+
+      // strcmp style comparisons
+      int compare(const arenakey &a, const arenakey &b) const;
+      int compare(const arenakey &a, const arenaprobe &b) const;
+
+      size_t size() const { return count; }
+      bool compressing() const { return compressed; }
+      unsigned restartinterval() const { return interval; }
+      // the memory the arena holds
+      size_t bytes() const {
+         return blob.capacity() + starts.capacity() * sizeof(uint64_t) +
+                last.capacity() + undo.capacity();
+      }
+      void clear() {
+         blob.clear();
+         starts.clear();
+         count = 0;
+         last.clear();
+         undo.clear();
+         undobytes = 0;
+      }
+      // give back the spare capacity appending leaves behind
+      void shrink() {
+         blob.shrink_to_fit();
+         starts.shrink_to_fit();
+      }
+      void swap(keyarena &other) {
+         blob.swap(other.blob);
+         starts.swap(other.starts);
+         std::swap(count, other.count);
+         std::swap(compressed, other.compressed);
+         std::swap(interval, other.interval);
+         last.swap(other.last);
+         undo.swap(other.undo);
+         std::swap(undobytes, other.undobytes);
+      }
+      // how many comparisons had to read the arena (zero unless
+      //    compiled with AVLTREE_STATS)
+      unsigned long long arenacomparisons() const {
+#ifdef AVLTREE_STATS
+         return fullcompares.load(memory_order_relaxed);
+#else
+         return 0;
+#endif
+      }
+      void resetstats() { AVLSTAT(fullcompares = 0;) }
+};
+
+inline arenakey keyarena::append(const string &k)
+{
+   arenakey a;
+   a.prefix = keyprefix<string>::get(k);
+   a.id = (uint32_t)count;
+   a.length = (uint32_t)k.size();
+   if (!compressed) {
+      starts.push_back(blob.size());
+      blob.insert(blob.end(), k.begin(), k.end());
+   } else {
+      undobytes = blob.size();
+      size_t shared = 0;
+      if (count % interval == 0) {
+         starts.push_back(blob.size());
+      } else {
+         size_t n = min(last.size(), k.size());
+         while (shared < n && last[shared] == k[shared]) shared++;
+      }
+      putvarint(shared);
+      putvarint(k.size() - shared);
+      blob.insert(blob.end(), k.begin() + shared, k.end());
+      undo.swap(last);
+      last = k;
+   }
+   count++;
+   return a;
+}
+
+inline void keyarena::poplast()
+{
+   count--;
+   if (!compressed) {
+      blob.resize(starts.back());
+      starts.pop_back();
+   } else {
+      blob.resize(undobytes);
+      if (count % interval == 0) starts.pop_back();
+      last.swap(undo);
+   }
+}
+
+inline void keyarena::get(uint32_t id, string &out) const
+{
+   if (!compressed) {
+      size_t end = (id + 1 < count) ? starts[id + 1] : blob.size();
+      out.assign(blob.data() + starts[id], end - starts[id]);
+      return;
+   }
+   size_t pos = starts[id / interval];
+   out.clear();
+   for (size_t i = id - id % interval; ; i++) {
+      size_t shared = getvarint(pos);
+      size_t rest = getvarint(pos);
+      out.resize(shared);
+      out.append(blob.data() + pos, rest);
+      pos += rest;
+      if (i == id) return;
+   }
+}
+
+inline int keyarena::compare(const arenakey &a, const arenakey &b) const
+// when the prefixes tie and either key is 8 bytes or shorter, that key
+//    is a prefix of the other (the prefix pads with zeros), so the
+//    lengths decide
+{
+   if (a.prefix != b.prefix) return (a.prefix < b.prefix) ? -1 : 1;
+   if (a.length <= 8 || b.length <= 8)
+      return (a.length < b.length) ? -1 : (a.length > b.length);
+   AVLSTAT(avlcounters::bump(fullcompares);)
+   if (!compressed)
+      return tail(blob.data() + starts[a.id], a.length,
+                  blob.data() + starts[b.id], b.length);
+   static thread_local string x, y;
+   get(a.id, x);
+   get(b.id, y);
+   return tail(x.data(), x.size(), y.data(), y.size());
+}
+
+inline int keyarena::compare(const arenakey &a, const arenaprobe &b) const
+{
+   if (a.prefix != b.prefix) return (a.prefix < b.prefix) ? -1 : 1;
+   if (a.length <= 8 || b.length <= 8)
+      return (a.length < b.length) ? -1 : (a.length > b.length);
+   AVLSTAT(avlcounters::bump(fullcompares);)
+   if (!compressed)
+      return tail(blob.data() + starts[a.id], a.length, b.data, b.length);
+   static thread_local string x;
+   get(a.id, x);
+   return tail(x.data(), x.size(), b.data, b.length);
+}
+
+// orders arena keys by their text through the arena they live in, and
+//    compares them against probes directly
+struct arenakeyless {
+   typedef void is_transparent;
+   const keyarena *arena;
+
+   arenakeyless(const keyarena *a = NULL) : arena(a) { }
+   bool operator()(const arenakey &a, const arenakey &b) const {
+      return arena->compare(a, b) < 0;
+   }
+   bool operator()(const arenakey &a, const arenaprobe &b) const {
+      return arena->compare(a, b) < 0;
+   }
+   bool operator()(const arenaprobe &a, const arenakey &b) const {
+      return arena->compare(b, a) > 0;
+   }
+};
+
+// a map from strings to Value whose nodes hold arenakeys rather than
+//    strings: 16 bytes inline and the text in the arena, instead of a
+//    string object and (past the small string limit) a heap block of
+//    its own for every key
+// most comparisons are settled by the inline prefixes; that works well
+//    for keys that differ early, and not at all for keys that all
+//    start with the same 8 bytes
+template <class Value>
+class arenaavltree {
+   private:
+      typedef avltree<arenakey, Value, arenakeyless> tree;
+      keyarena arena;
+      tree t;
+      slaballocator *source;
+
+      // the tree's comparator refers to the arena
+      arenaavltree(const arenaavltree &);
+      arenaavltree &operator=(const arenaavltree &);
+
+   public:
+      // with compress, keys share their leading bytes with the key
+      //    stored before them (see keyarena)
+      // the tree's nodes are carved out of slabs obtained from source,
+      //    or from operator new if none is given
+      arenaavltree(bool compress = false, unsigned restartinterval = 16,
+                   slaballocator *src = NULL) :
+         arena(compress, restartinterval), t(arenakeyless(&arena), src),
+         source(src) { }
+
+      // as the avltree methods of the same names; the key is appended
+      //    to the arena first, and taken back unless it was added
+      bool insert(const string &k, const Value &d) {
+         if (t.insert(arena.append(k), d)) return true;
+         arena.poplast();
+         return false;
+      }
+      bool insert_or_assign(const string &k, const Value &d) {
+         if (t.insert_or_assign(arena.append(k), d)) return true;
+         arena.poplast();
+         return false;
+      }
+      bool remove(const string &k) { return t.remove(arenaprobe(k)); }
+      bool search(const string &k, Value &d) const {
+         return t.search(arenaprobe(k), d);
+      }
+      size_t size() const { return t.size(); }
+      void clear() {
+         t.clear();
+         arena.clear();
+      }
+
+      // call fn(key, value) for every entry, in key order
+      template <class F>
+      void for_each(F fn) {
+         string k;
+         for (typename tree::iterator it = t.begin(); it != t.end(); ++it) {
+            arena.get(it.key().id, k);
+            fn((const string &)k, it.value());
+         }
+      }
+
+      // rewrite the arena with just the keys still in the tree, in key
+      //    order (which is also the order that compresses best), and
+      //    rebuild the tree over it
+      // returns false (changing nothing) if memory runs out
+      bool compact();
+
+      // the memory the keys' text takes up in the arena
+      size_t arenabytes() const { return arena.bytes(); }
+      // the tree's operation counts, and how many of its comparisons
+      //    had to read the arena (all zero unless compiled with
+      //    AVLTREE_STATS)
+      avlstats stats() const { return t.stats(); }
+      unsigned long long arenacomparisons() const {
+         return arena.arenacomparisons();
+      }
+      void resetstats() {
+         t.resetstats();
+         arena.resetstats();
+      }
+};
+
+template <class Value>
+bool arenaavltree<Value>::compact()
+// the keys are copied into a second arena and a tree built over them,
+//    then both trade places with the old ones (the arenas trade
+//    contents, since the comparators refer to this one)
+{
+   keyarena rebuilt(arena.compressing(), arena.restartinterval());
+   vector< pair<arenakey, Value> > items;
+   try {
+      items.reserve(t.size());
+      string k;
+      for (typename tree::iterator it = t.begin(); it != t.end(); ++it) {
+         arena.get(it.key().id, k);
+         items.push_back(make_pair(rebuilt.append(k), it.value()));
+      }
+      rebuilt.shrink();
+   } catch (bad_alloc &) {
+      return false;
+   }
+   arena.swap(rebuilt);
+   tree fresh(arenakeyless(&arena), source);
+   if (!fresh.build_from_sorted(items.begin(), items.end())) {
+      arena.swap(rebuilt);
+      return false;
+   }
+   t.swap(fresh);
+   return true;
+}
+
+#endif
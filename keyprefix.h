@@ -0,0 +1,57 @@
+/*
+Fixed width, order preserving key prefixes
+*/
+
+#ifndef KEYPREFIX_H
+#define KEYPREFIX_H 1
+
+#include <string>
+#include <cstdint>
+#include <type_traits>
+using namespace std;
+
+// keyprefix<T>::get(k) maps a key to 64 bits such that
+//    get(a) < get(b) implies a < b under less<T>, so keys can be
+//    ordered by comparing plain integers and only ties need the real
+//    comparison; exact says a tie also means the keys are equal, in
+//    which case the real comparison is never needed
+// types without a specialization have no prefix (available is false)
+// specialize this for your own types
+template <class T, class Enable = void>
+struct keyprefix {
+   static const bool available = false;
+   static const bool exact = false;
+   static uint64_t get(const T &) { return 0; }
+};
+
+// integers of up to 64 bits are their own prefix, signed ones with
+//    the sign bit flipped so that negatives come first
+template <class T>
+struct keyprefix<T, typename enable_if<is_integral<T>::value &&
+                                       (sizeof(T) <= 8)>::type> {
+   static const bool available = true;
+   static const bool exact = true;
+   static uint64_t get(const T &k) {
+      if (is_signed<T>::value)
+         return (uint64_t)(int64_t)k ^ (1ULL << 63);
+      return (uint64_t)k;
+   }
+};
+
+// strings use their first 8 characters, big endian and zero padded;
+//    string::compare orders characters as unsigned char, and so does
+//    the prefix
+template <>
+struct keyprefix<string> {
+   static const bool available = true;
+   static const bool exact = false;
+   static uint64_t get(const string &k) {
+      uint64_t p = 0;
+      size_t n = k.size() < 8 ? k.size() : 8;
+      for (size_t i = 0; i < n; i++)
+         p |= (uint64_t)(unsigned char)k[i] << (56 - 8 * i);
+      return p;
+   }
+};
+
+#endif
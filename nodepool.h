@@ -0,0 +1,200 @@
+/*
+Slab allocator for tree nodes
+*/
+
+#ifndef NODEPOOL_H
+#define NODEPOOL_H 1
+
+#include <cstddef>
+#include <new>
+
+// source of the raw memory slabs a nodepool carves nodes out of
+// derive from this class to plug your own allocator into a tree
+class slaballocator {
+   public:
+      virtual ~slaballocator() { }
+      // return a block of at least the given number of bytes,
+      //    aligned for any fundamental type, or NULL on failure
+      virtual void *allocate(size_t bytes) = 0;
+      virtual void deallocate(void *p, size_t bytes) = 0;
+};
+
+// the default slab source: plain (non-throwing) operator new/delete
+class newdeleteallocator : public slaballocator {
+   public:
+      void *allocate(size_t bytes) {
+         return ::operator new(bytes, std::nothrow);
+      }
+      void deallocate(void *p, size_t) { ::operator delete(p); }
+
+      static newdeleteallocator *instance() {
+         static newdeleteallocator a;
+         return &a;
+      }
+};
+
+template <class T>
+class nodepool {
+   private:
+      // a node-sized slot, which doubles as a free list link
+      //    while the slot is not in use
+      union slot {
+         slot *next;
+         alignas(T) unsigned char storage[sizeof(T)];
+      };
+
+      // slabs are chained through a small header at their start
+      struct slab {
+         slab   *next;
+         size_t bytes;
+      };
+      static const size_t headerbytes =
+         (sizeof(slab) + alignof(slot) - 1) / alignof(slot) * alignof(slot);
+
+      // slabs start small and double up to this many slots
+      static const size_t firstslots = 16;
+      static const size_t maxslots = 4096;
+
+      slaballocator *source;
+      slab   *slabs;        // every slab we own
+      slot   *freelist;     // released slots, most recent first
+      slot   *cursor;       // next never-used slot in the newest slab
+      slot   *limit;        // end of the newest slab
+      size_t nextslots;     // slot count for the next slab
+      size_t used, total;
+
+      bool grow();
+
+      // pools own their slabs, so they can't be copied
+      nodepool(const nodepool &);
+      nodepool &operator=(const nodepool &);
+
+   public:
+      nodepool(slaballocator *src = NULL) :
+         source(src ? src : newdeleteallocator::instance()),
+         slabs(NULL), freelist(NULL), cursor(NULL), limit(NULL),
+         nextslots(firstslots), used(0), total(0) { }
+      ~nodepool() { release(); }
+
+      void *allocate();
+      void deallocate(void *p);
+      void release();
+      bool merge(nodepool &other);
+
+      slaballocator *allocator() const { return source; }
+      size_t inuse() const { return used; }
+      size_t capacity() const { return total; }
+};
+
+template <class T>
+bool nodepool<T>::grow()
+// get a new slab from the slab allocator and make it the
+//    one new slots are handed out from
+// returns false if the allocator is out of memory
+{
+   size_t bytes = headerbytes + nextslots * sizeof(slot);
+   void *mem = source->allocate(bytes);
+   if (!mem) return false;
+
+   slab *s = static_cast<slab*>(mem);
+   s->next = slabs;
+   s->bytes = bytes;
+   slabs = s;
+
+   cursor = reinterpret_cast<slot*>(static_cast<char*>(mem) + headerbytes);
+   limit = cursor + nextslots;
+   total += nextslots;
+   if (nextslots < maxslots) nextslots *= 2;
+   return true;
+}
+
+template <class T>
+void *nodepool<T>::allocate()
+// return uninitialized storage for one T,
+//    reusing a released slot when one is available
+// returns NULL if no memory could be obtained
+{
+   slot *s;
+   if (freelist) {
+      s = freelist;
+      freelist = s->next;
+   } else {
+      if ((cursor == limit) && !grow()) return NULL;
+      s = cursor++;
+   }
+   used++;
+   return s->storage;
+}
+
+template <class T>
+void nodepool<T>::deallocate(void *p)
+// put the slot at p back on the free list,
+// the T stored there must already have been destroyed
+{
+   if (!p) return;
+   slot *s = static_cast<slot*>(p);
+   s->next = freelist;
+   freelist = s;
+   used--;
+}
+
+template <class T>
+void nodepool<T>::release()
+// hand every slab back to the slab allocator at once,
+//    which is O(number of slabs) rather than O(number of nodes)
+// any T still living in the pool must already have been destroyed
+//    (or be trivially destructible)
+{
+   while (slabs) {
+      slab *s = slabs;
+      slabs = s->next;
+      source->deallocate(s, s->bytes);
+   }
+   freelist = NULL;
+   cursor = limit = NULL;
+   nextslots = firstslots;
+   used = total = 0;
+}
+
+template <class T>
+bool nodepool<T>::merge(nodepool &other)
+// take over all of other's slabs, so that anything allocated from
+//    other now belongs to (and is later released by) this pool,
+//    and leave other empty
+// only possible when both pools get their slabs from the same
+//    slab allocator; returns false (changing nothing) otherwise
+{
+   if (&other == this) return true;
+   if (source != other.source) return false;
+
+   // other's untouched slots become ordinary free slots here
+   while (other.cursor != other.limit) {
+      slot *s = other.cursor++;
+      s->next = other.freelist;
+      other.freelist = s;
+   }
+
+   if (other.freelist) {
+      slot *tail = other.freelist;
+      while (tail->next) tail = tail->next;
+      tail->next = freelist;
+      freelist = other.freelist;
+   }
+   if (other.slabs) {
+      slab *tail = other.slabs;
+      while (tail->next) tail = tail->next;
+      tail->next = slabs;
+      slabs = other.slabs;
+   }
+   used += other.used;
+   total += other.total;
+
+   other.slabs = NULL;
+   other.freelist = NULL;
+   other.cursor = other.limit = NULL;
+   other.nextslots = firstslots;
+   other.used = other.total = 0;
+   return true;
+}
+
+#endif
@@ -0,0 +1,67 @@
+/*
+Fork/join helpers for the parallel tree algorithms
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H 1
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+
+// run a() and b(), concurrently if fork is true
+// a runs on a new thread while b runs on the calling thread,
+//    and both have finished when this returns
+// if no thread can be started the two simply run one after the other
+template <class A, class B>
+void parallel_invoke(bool fork, A a, B b)
+{
+   if (fork) {
+      std::thread t;
+      try {
+         t = std::thread(a);
+      } catch (...) {
+         fork = false;
+      }
+      if (fork) {
+         b();
+         t.join();
+         return;
+      }
+   }
+   a();
+   b();
+}
+
+// the number of threads to use when the caller asks for 0 (automatic)
+inline unsigned defaultthreads()
+{
+   unsigned n = std::thread::hardware_concurrency();
+   return n ? n : 1;
+}
+
+template <class It, class Compare>
+void parallel_stable_sort(It first, It last, Compare comp, unsigned threads)
+// stable sort [first, last) with up to threads threads:
+//    the halves are sorted concurrently (recursively splitting the
+//    thread budget) and then merged
+// It must be a random access iterator
+{
+   typename std::iterator_traits<It>::difference_type n = last - first;
+   // below this size a thread costs more than it saves
+   const long serialcutoff = 1 << 14;
+   if ((threads < 2) || (n < serialcutoff)) {
+      std::stable_sort(first, last, comp);
+      return;
+   }
+
+   It middle = first + n / 2;
+   unsigned lthreads = threads / 2;
+   parallel_invoke(true,
+      [=]() { parallel_stable_sort(first, middle, comp, lthreads); },
+      [=]() { parallel_stable_sort(middle, last, comp, threads - lthreads); });
+   std::inplace_merge(first, middle, last, comp);
+}
+
+#endif
@@ -0,0 +1,458 @@
+/*
+Persistent (copy-on-write) AVL tree with O(1) snapshots
+*/
+
+#ifndef PERSISTENTAVLTREE_H
+#define PERSISTENTAVLTREE_H 1
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <functional>
+#include "nodepool.h"
+using namespace std;
+
+// an AVL tree map whose versions share structure
+//
+// snapshot() returns a read-only version of the tree as it is now, in
+//    O(1), by taking a reference to the root.  nodes are reference
+//    counted, and a write copies exactly the nodes on its path that
+//    are also referenced from somewhere else (a snapshot, or a copied
+//    parent); nodes only the tree itself uses are changed in place
+// a node is freed when its last reference goes, so an old version
+//    disappears as soon as the last snapshot of it is destroyed
+// the tree itself is not thread safe, but snapshots may be read,
+//    copied and destroyed on any thread while the tree is written
+template <class Key, class Value, class Compare = less<Key> >
+class persistentavltree {
+   private:
+      struct node {
+          atomic<long> refs;
+          node         *left, *right;
+          Key          key;
+          Value        data;
+          int          height;
+
+          node(const Key &k, const Value &d) : refs(1), key(k), data(d) { }
+      };
+
+      // the node storage, shared by the tree and all of its snapshots
+      //    (which may outlive it); nodes can be released from any
+      //    thread, so the pool is behind a lock
+      struct store {
+         mutex          lock;
+         nodepool<node> pool;
+         Compare        comp;
+
+         store(slaballocator *source, const Compare &c) :
+            pool(source), comp(c) { }
+         bool reserve(vector<void*> &spare, size_t needed);
+         void release(vector<void*> &spare);
+         void incref(node *n) { if (n) n->refs.fetch_add(1); }
+         void decref(node *n);
+      };
+
+      shared_ptr<store> nodes;
+      node *root;
+      size_t count;
+      vector<void*> spare;        // storage reserved for the next write
+
+      static int height(const node *n) { return n ? n->height : -1; }
+      static void updateheight(node *n);
+      bool reserve();
+      node *newnode(const Key &k, const Value &d);
+      node *writable(node *n);
+      node *rotateleft(node *n);
+      node *rotateright(node *n);
+      node *rebalance(node *n);
+      node *insert(node *n, const Key &k, const Value &d, bool assign,
+                   bool &changed, bool &inserted);
+      node *remove(node *n, const Key &k, bool &removed);
+      node *removesmallest(node *n, node* &smallest);
+
+      template <class Fn>
+      static void inorder(const node *n, Fn &fn);
+      static node *find(const store &s, node *n, const Key &k);
+
+   public:
+      // a read-only version of the tree
+      class version {
+         private:
+            shared_ptr<store> nodes;
+            node *root;
+            size_t count;
+
+            friend class persistentavltree;
+            version(const shared_ptr<store> &s, node *r, size_t c) :
+               nodes(s), root(r), count(c) { nodes->incref(root); }
+
+         public:
+            version(const version &other) :
+               nodes(other.nodes), root(other.root), count(other.count) {
+               nodes->incref(root);
+            }
+            version &operator=(const version &other) {
+               other.nodes->incref(other.root);
+               nodes->decref(root);
+               nodes = other.nodes;
+               root = other.root;
+               count = other.count;
+               return *this;
+            }
+            ~version() { nodes->decref(root); }
+
+            bool search(const Key &k, Value &d) const {
+               node *n = find(*nodes, root, k);
+               if (!n) return false;
+               d = n->data;
+               return true;
+            }
+            size_t size() const { return count; }
+            // call fn(key, value) for every entry in ascending key order
+            template <class Fn> void for_each(Fn fn) const {
+               inorder(root, fn);
+            }
+      };
+
+      persistentavltree(slaballocator *source = NULL,
+                        const Compare &c = Compare()) :
+         nodes(make_shared<store>(source, c)), root(NULL), count(0) { }
+      ~persistentavltree() {
+         nodes->decref(root);
+         nodes->release(spare);
+      }
+
+      // the tree can be copied in O(1) too: the copy shares every node
+      persistentavltree(const persistentavltree &other) :
+         nodes(other.nodes), root(other.root), count(other.count) {
+         nodes->incref(root);
+      }
+      persistentavltree &operator=(const persistentavltree &other) {
+         other.nodes->incref(other.root);
+         nodes->decref(root);
+         nodes->release(spare);
+         nodes = other.nodes;
+         root = other.root;
+         count = other.count;
+         return *this;
+      }
+
+      // a version that keeps the tree's current contents for as long
+      //    as it (or a copy of it) exists
+      version snapshot() const { return version(nodes, root, count); }
+
+      bool search(const Key &k, Value &d) const {
+         node *n = find(*nodes, root, k);
+         if (!n) return false;
+         d = n->data;
+         return true;
+      }
+      // each of these returns false if k was already present (insert),
+      //    absent (remove), or if memory ran out; the storage a write
+      //    could need is reserved before it starts, so running out
+      //    changes nothing
+      bool insert(const Key &k, const Value &d);
+      bool insert_or_assign(const Key &k, const Value &d);
+      bool remove(const Key &k);
+      size_t size() const { return count; }
+      template <class Fn> void for_each(Fn fn) const { inorder(root, fn); }
+};
+
+template <class Key, class Value, class Compare>
+bool persistentavltree<Key, Value, Compare>::store::reserve(
+   vector<void*> &spare, size_t needed)
+// top spare up to needed blocks of node storage, taking the lock once
+{
+   lock_guard<mutex> g(lock);
+   while (spare.size() < needed) {
+      void *mem = pool.allocate();
+      if (!mem) return false;
+      spare.push_back(mem);
+   }
+   return true;
+}
+
+template <class Key, class Value, class Compare>
+void persistentavltree<Key, Value, Compare>::store::release(
+   vector<void*> &spare)
+// hand unused reserved storage back to the pool
+{
+   lock_guard<mutex> g(lock);
+   for (size_t i = 0; i < spare.size(); i++) pool.deallocate(spare[i]);
+   spare.clear();
+}
+
+template <class Key, class Value, class Compare>
+void persistentavltree<Key, Value, Compare>::store::decref(node *n)
+// drop one reference to n, freeing it (and dropping its references
+//    to its children) if that was the last one
+{
+   while (n && (n->refs.fetch_sub(1) == 1)) {
+      node *left = n->left, *right = n->right;
+      n->~node();
+      {
+         lock_guard<mutex> g(lock);
+         pool.deallocate(n);
+      }
+      decref(left);
+      n = right;
+   }
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::find(const store &s, node *n,
+                                             const Key &k)
+// the node in the subtree rooted at n whose key matches k, or null
+{
+   while (n) {
+      if (s.comp(k, n->key)) n = n->left;
+      else if (s.comp(n->key, k)) n = n->right;
+      else return n;
+   }
+   return NULL;
+}
+
+template <class Key, class Value, class Compare>
+template <class Fn>
+void persistentavltree<Key, Value, Compare>::inorder(const node *n, Fn &fn)
+// visit the subtree rooted at n in ascending key order
+{
+   if (!n) return;
+   inorder(n->left, fn);
+   fn(n->key, n->data);
+   inorder(n->right, fn);
+}
+
+template <class Key, class Value, class Compare>
+void persistentavltree<Key, Value, Compare>::updateheight(node *n)
+// n's height is one greater than the height of its taller child
+{
+   int l = height(n->left), r = height(n->right);
+   n->height = (l > r ? l : r) + 1;
+}
+
+template <class Key, class Value, class Compare>
+bool persistentavltree<Key, Value, Compare>::reserve()
+// make sure the next write can't run out of memory half way through:
+//    a write copies at most the path plus two nodes per level for
+//    rotations, and adds at most one leaf
+// returns false if that much storage can't be had
+{
+   return nodes->reserve(spare, 3 * (height(root) + 2) + 1);
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::newnode(const Key &k,
+                                                const Value &d)
+// a new leaf with a single reference, in reserved storage
+{
+   void *mem = spare.back();
+   spare.pop_back();
+   node *n = new (mem) node(k, d);
+   n->left = n->right = NULL;
+   n->height = 0;
+   return n;
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::writable(node *n)
+// given the caller's reference to n, return a node the caller may
+//    modify in its place: n itself if nobody else references it,
+//    otherwise a copy (which references n's children too)
+{
+   if (n->refs.load() == 1) return n;
+   node *c = newnode(n->key, n->data);
+   c->left = n->left;
+   c->right = n->right;
+   c->height = n->height;
+   nodes->incref(c->left);
+   nodes->incref(c->right);
+   nodes->decref(n);
+   return c;
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::rotateleft(node *n)
+// rotate the writable n's right child up, returning the new root
+{
+   node *y = writable(n->right);
+   n->right = y->left;
+   y->left = n;
+   updateheight(n);
+   updateheight(y);
+   return y;
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::rotateright(node *n)
+// rotate the writable n's left child up, returning the new root
+{
+   node *x = writable(n->left);
+   n->left = x->right;
+   x->right = n;
+   updateheight(n);
+   updateheight(x);
+   return x;
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::rebalance(node *n)
+// update the height of the writable n, and rotate if its subtrees'
+//    heights differ by more than one
+// returns the new subtree root
+{
+   updateheight(n);
+   int balance = height(n->right) - height(n->left);
+   if (balance > 1) {
+      if (height(n->right->right) < height(n->right->left)) {
+         n->right = writable(n->right);
+         n->right = rotateright(n->right);
+      }
+      return rotateleft(n);
+   }
+   if (balance < -1) {
+      if (height(n->left->left) < height(n->left->right)) {
+         n->left = writable(n->left);
+         n->left = rotateleft(n->left);
+      }
+      return rotateright(n);
+   }
+   return n;
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::insert(node *n, const Key &k,
+                                               const Value &d, bool assign,
+                                               bool &changed, bool &inserted)
+// add k below n (or replace its value, if assign is set), taking the
+//    caller's reference to n and returning the new subtree root
+// unless assign is set, k must not be present yet
+// changed is false if nothing needed to change, in which case n itself
+//    is returned
+{
+   const Compare &comp = nodes->comp;
+   changed = inserted = false;
+   if (!n) {
+      changed = inserted = true;
+      return newnode(k, d);
+   }
+
+   bool left = comp(k, n->key);
+   if (!left && !comp(n->key, k)) {
+      if (!assign) return n;
+      node *w = writable(n);
+      w->data = d;
+      changed = true;
+      return w;
+   }
+
+   // make n writable first, so the child link we hand down is ours
+   node *w = writable(n);
+   node* &child = left ? w->left : w->right;
+   child = insert(child, k, d, assign, changed, inserted);
+   return changed ? rebalance(w) : w;
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::removesmallest(node *n,
+                                                       node* &smallest)
+// detach the smallest node of the (writable, non-empty) subtree n,
+//    returning the new subtree root
+{
+   if (!n->left) {
+      smallest = n;
+      node *r = n->right;
+      n->right = NULL;
+      return r;
+   }
+   n->left = removesmallest(writable(n->left), smallest);
+   return rebalance(n);
+}
+
+template <class Key, class Value, class Compare>
+typename persistentavltree<Key, Value, Compare>::node *
+persistentavltree<Key, Value, Compare>::remove(node *n, const Key &k,
+                                               bool &removed)
+// remove k (which must be present) from below n, taking the caller's
+//    reference to n and returning the new subtree root
+{
+   const Compare &comp = nodes->comp;
+   removed = false;
+   if (!n) return NULL;
+
+   bool left = comp(k, n->key);
+   bool match = !left && !comp(n->key, k);
+   node *w = writable(n);
+
+   if (!match) {
+      node* &child = left ? w->left : w->right;
+      child = remove(child, k, removed);
+      return removed ? rebalance(w) : w;
+   }
+
+   // w is ours alone now: detach its children and free it
+   node *l = w->left, *r = w->right;
+   if (l && r) {
+      node *smallest;
+      node *rest = removesmallest(writable(r), smallest);
+      smallest->left = l;
+      smallest->right = rest;
+      l = rebalance(smallest);
+      r = NULL;
+   }
+   w->left = w->right = NULL;
+   nodes->decref(w);
+   removed = true;
+   return l ? l : r;
+}
+
+template <class Key, class Value, class Compare>
+bool persistentavltree<Key, Value, Compare>::insert(const Key &k,
+                                                    const Value &d)
+// add k unless it's already present
+{
+   // look first, so that a duplicate doesn't copy the path
+   if (find(*nodes, root, k)) return false;
+   if (!reserve()) return false;
+   bool changed, inserted;
+   root = insert(root, k, d, false, changed, inserted);
+   if (inserted) count++;
+   return inserted;
+}
+
+template <class Key, class Value, class Compare>
+bool persistentavltree<Key, Value, Compare>::insert_or_assign(const Key &k,
+                                                              const Value &d)
+// add k or replace its value; returns true if k was added (or false
+//    if memory ran out, changing nothing)
+{
+   if (!reserve()) return false;
+   bool changed, inserted;
+   root = insert(root, k, d, true, changed, inserted);
+   if (inserted) count++;
+   return inserted;
+}
+
+template <class Key, class Value, class Compare>
+bool persistentavltree<Key, Value, Compare>::remove(const Key &k)
+// remove k, returning false if it wasn't there
+{
+   // look first, so that a missing key doesn't copy the path
+   if (!find(*nodes, root, k)) return false;
+   if (!reserve()) return false;
+   bool removed;
+   root = remove(root, k, removed);
+   if (removed) count--;
+   return removed;
+}
+
+#endif
@@ -0,0 +1,474 @@
+/*
+AVL tree map split into independently locked shards
+*/
+
+#ifndef SHARDEDAVLTREE_H
+#define SHARDEDAVLTREE_H 1
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <functional>
+#include "avltree.h"
+using namespace std;
+
+// a map spread over several avltrees (shards), each with its own lock
+//    and node pool, so writers to different shards never contend
+//
+// keys are assigned to shards either by range, each shard holding the
+//    keys from its lower boundary up to the next shard's, or by hash
+// range shards split online: automatically when one grows past a size
+//    limit, and on rebalance() when one has taken far more than its
+//    share of the traffic; they merge again with a neighbour once
+//    empty, or (with a size limit) once the two fit in half of it,
+//    so a moving window of keys doesn't leave a trail of shards
+//    behind; hash shards are fixed
+// ordered visits go through the shards in key order (range) or through
+//    a k-way merge of all of them (hash)
+// a split or merge changes the shard map, so every operation holds one
+//    stripe of a striped lock while it uses the map, and a change to
+//    the map takes all of the stripes; operations on different threads
+//    usually hold different stripes, so they don't share a cache line
+//    either
+// a split copies the upper half of the shard under the shard's own
+//    lock before taking the stripes, so the map is only held for the
+//    O(log n) split itself; a merge adopts the neighbour's nodes
+//    without copying them (see avltree::join)
+template <class Key, class Value, class Compare = less<Key>,
+          class Hash = hash<Key> >
+class shardedavltree {
+   private:
+      typedef avltree<Key, Value, Compare> tree;
+
+      struct shard {
+         mutex m;
+         tree t;
+         unsigned long ops;       // operations since the last rebalance
+         unsigned long writes;    // changes to t, to tell whether a copy
+                                  //    of it is still current
+         char padding[64];        // keeps the next allocation off the
+                                  //    cache lines the lock works on
+         shard(const Compare &c, slaballocator *source) :
+            t(c, source), ops(0), writes(0) { }
+      };
+      struct alignas(64) stripe {
+         mutex m;
+      };
+      static const unsigned nstripes = 64;
+
+      bool hashed;
+      vector< unique_ptr<shard> > shards;
+      vector<Key> bounds;         // bounds[i] is shard i + 1's lowest key
+      size_t maxshardsize;        // 0 for no limit
+      Compare comp;
+      Hash hasher;
+      slaballocator *source;
+      mutable stripe stripes[nstripes];
+
+      static unsigned mystripe();
+      size_t shardfor(const Key &k) const;
+      size_t shardindex(const shard *s) const;
+      void lockall() const;
+      void unlockall() const;
+      bool splitshard(shard *s, size_t minsize);
+      bool mergeshards(size_t i);
+      void mergeifsmall(shard *s);
+
+      // shards own their trees and locks, so the map can't be copied
+      shardedavltree(const shardedavltree &);
+      shardedavltree &operator=(const shardedavltree &);
+
+   public:
+      // range partitioned, with shard i + 1 starting at boundaries[i]
+      //    (ascending); with no boundaries there is a single shard to
+      //    begin with, which splits as it grows
+      // a shard holding more than maxshardsize entries (if not 0) is
+      //    split in two around its median key
+      // every shard's pool gets its slabs from source (see avltree)
+      explicit shardedavltree(const vector<Key> &boundaries = vector<Key>(),
+                              size_t maxshardsize = 0,
+                              const Compare &c = Compare(),
+                              slaballocator *source = NULL);
+      // hash partitioned into a fixed number of shards
+      explicit shardedavltree(size_t hashshards, const Hash &h = Hash(),
+                              const Compare &c = Compare(),
+                              slaballocator *source = NULL);
+
+      // as the avltree methods of the same names
+      bool insert(const Key &k, const Value &d);
+      bool insert_or_assign(const Key &k, const Value &d);
+      bool remove(const Key &k);
+      bool search(const Key &k, Value &d) const;
+      size_t size() const;
+      size_t shardcount() const;
+
+      // call fn(key, value) for every entry (from lo to hi inclusive),
+      //    in key order; fn must not call back into this map
+      // range shards are visited one after another, each under its own
+      //    lock, so the visit is not a snapshot across shards; hash
+      //    shards are merged and so are all locked for the whole visit
+      template <class F> void for_each(F fn);
+      template <class F> void for_each_in_range(const Key &lo, const Key &hi,
+                                                F fn);
+
+      // split the busiest range shard if it has had more than twice
+      //    its share of the operations since the last call (and has at
+      //    least two entries), then start counting afresh; also merge
+      //    every pair of neighbouring shards that may be merged
+      // returns true if a shard was split
+      bool rebalance();
+
+   private:
+      template <class F>
+      void visit(const Key *lo, const Key *hi, F fn);
+};
+
+template <class Key, class Value, class Compare, class Hash>
+shardedavltree<Key, Value, Compare, Hash>::shardedavltree(
+   const vector<Key> &boundaries, size_t maxsize, const Compare &c,
+   slaballocator *src) :
+   hashed(false), bounds(boundaries), maxshardsize(maxsize), comp(c),
+   source(src)
+{
+   for (size_t i = 0; i <= bounds.size(); i++)
+      shards.push_back(unique_ptr<shard>(new shard(comp, source)));
+}
+
+template <class Key, class Value, class Compare, class Hash>
+shardedavltree<Key, Value, Compare, Hash>::shardedavltree(
+   size_t hashshards, const Hash &h, const Compare &c, slaballocator *src) :
+   hashed(true), maxshardsize(0), comp(c), hasher(h), source(src)
+{
+   if (hashshards == 0) hashshards = 1;
+   for (size_t i = 0; i < hashshards; i++)
+      shards.push_back(unique_ptr<shard>(new shard(comp, source)));
+}
+
+template <class Key, class Value, class Compare, class Hash>
+unsigned shardedavltree<Key, Value, Compare, Hash>::mystripe()
+// each thread is given a stripe the first time it needs one,
+//    round robin, so a few threads never share one
+{
+   static atomic<unsigned> next(0);
+   static thread_local unsigned mine = next++ % nstripes;
+   return mine;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+size_t shardedavltree<Key, Value, Compare, Hash>::shardfor(const Key &k) const
+// the shard k belongs to (the caller holds a stripe)
+{
+   if (hashed) return hasher(k) % shards.size();
+   // the number of boundaries not above k
+   size_t lo = 0, hi = bounds.size();
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (comp(k, bounds[mid])) hi = mid;
+      else lo = mid + 1;
+   }
+   return lo;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+void shardedavltree<Key, Value, Compare, Hash>::lockall() const
+{
+   for (unsigned i = 0; i < nstripes; i++) stripes[i].m.lock();
+}
+
+template <class Key, class Value, class Compare, class Hash>
+void shardedavltree<Key, Value, Compare, Hash>::unlockall() const
+{
+   for (unsigned i = nstripes; i > 0; i--) stripes[i - 1].m.unlock();
+}
+
+template <class Key, class Value, class Compare, class Hash>
+size_t shardedavltree<Key, Value, Compare, Hash>::shardindex(
+   const shard *s) const
+// where s is in the map, or shards.size() if it has been merged away
+//    (the caller holds a stripe)
+{
+   size_t i = 0;
+   while ((i < shards.size()) && (shards[i].get() != s)) i++;
+   return i;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+bool shardedavltree<Key, Value, Compare, Hash>::splitshard(shard *s,
+                                                           size_t minsize)
+// split range shard s around its median key if it holds more than
+//    minsize entries, called with no locks held
+// the upper half is copied into the new shard's own pool under s's
+//    lock, which holds up only s's operations; then, with all the
+//    stripes, s is split (in O(log n)) and the new shard put in the
+//    map, unless s was written to in between, in which case the copy
+//    is stale and the split is left to a later call
+// the half split off s still uses s's pool, so it is freed under s's
+//    lock once the stripes are released
+{
+   unique_ptr<shard> upper(new shard(comp, source));
+   Key median;
+   unsigned long seen;
+   {
+      lock_guard<mutex> map(stripes[mystripe()].m);
+      if (shardindex(s) == shards.size()) return false;
+      lock_guard<mutex> lock(s->m);
+      size_t n = s->t.size();
+      if ((n <= minsize) || (n < 2)) return false;
+      Value unused;
+      if (!s->t.select((n - 1) / 2, median, unused)) return false;
+      vector< pair<Key, Value> > items;
+      try {
+         items.reserve(n - (n - 1) / 2 - 1);
+         for (typename tree::iterator it = s->t.upper_bound(median);
+              it != s->t.end(); ++it)
+            items.push_back(make_pair(it.key(), it.value()));
+      } catch (bad_alloc &) {
+         return false;
+      }
+      if (!upper->t.build_from_sorted(items.begin(), items.end()))
+         return false;
+      seen = s->writes;
+   }
+
+   tree greater(comp, source);
+   lockall();
+   size_t i = shardindex(s);
+   bool split = (i < shards.size()) && (s->writes == seen);
+   if (split) {
+      bounds.insert(bounds.begin() + i, upper->t.begin().key());
+      shards.insert(shards.begin() + i + 1, std::move(upper));
+      lock_guard<mutex> lock(s->m);
+      s->t.split(median, greater);
+      s->writes++;
+      s->ops /= 2;
+      shards[i + 1]->ops = s->ops;
+   }
+   // s can't be merged away while we hold its lock, since a merge
+   //    takes the locks of both of its shards
+   if (split) s->m.lock();
+   unlockall();
+   if (split) {
+      greater.clear();
+      s->m.unlock();
+   }
+   return split;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+bool shardedavltree<Key, Value, Compare, Hash>::mergeshards(size_t i)
+// move range shard i + 1's entries into shard i and drop it from the
+//    map (all stripes held), if either is empty or, with a size
+//    limit, the two fit in half of it (so the merged shard is well
+//    short of splitting again)
+{
+   shard *low = shards[i].get(), *high = shards[i + 1].get();
+   {
+      lock_guard<mutex> a(low->m), b(high->m);
+      size_t n = low->t.size(), m = high->t.size();
+      if ((n != 0) && (m != 0) &&
+          (!maxshardsize || (n + m > maxshardsize / 2)))
+         return false;
+      if (!low->t.join(high->t)) return false;
+      low->writes++;
+      low->ops += high->ops;
+   }
+   bounds.erase(bounds.begin() + i);
+   shards.erase(shards.begin() + i + 1);
+   return true;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+void shardedavltree<Key, Value, Compare, Hash>::mergeifsmall(shard *s)
+// called with no locks held after a remove left shard s empty, or at
+//    a quarter of the size limit; try merging it with the neighbour
+//    on either side
+{
+   lockall();
+   size_t i = shardindex(s);
+   if ((i < shards.size()) && (shards.size() > 1)) {
+      if (!((i + 1 < shards.size()) && mergeshards(i)) && (i > 0))
+         mergeshards(i - 1);
+   }
+   unlockall();
+}
+
+template <class Key, class Value, class Compare, class Hash>
+bool shardedavltree<Key, Value, Compare, Hash>::insert(const Key &k,
+                                                       const Value &d)
+{
+   shard *s;
+   bool inserted, big;
+   {
+      lock_guard<mutex> map(stripes[mystripe()].m);
+      s = shards[shardfor(k)].get();
+      lock_guard<mutex> lock(s->m);
+      s->ops++;
+      s->writes++;
+      inserted = s->t.insert(k, d);
+      big = inserted && maxshardsize && (s->t.size() > maxshardsize);
+   }
+   if (big) splitshard(s, maxshardsize);
+   return inserted;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+bool shardedavltree<Key, Value, Compare, Hash>::insert_or_assign(
+   const Key &k, const Value &d)
+{
+   shard *s;
+   bool inserted, big;
+   {
+      lock_guard<mutex> map(stripes[mystripe()].m);
+      s = shards[shardfor(k)].get();
+      lock_guard<mutex> lock(s->m);
+      s->ops++;
+      s->writes++;
+      inserted = s->t.insert_or_assign(k, d);
+      big = inserted && maxshardsize && (s->t.size() > maxshardsize);
+   }
+   if (big) splitshard(s, maxshardsize);
+   return inserted;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+bool shardedavltree<Key, Value, Compare, Hash>::remove(const Key &k)
+// a remove that leaves its shard empty, or just a quarter full, tries
+//    to merge it with a neighbour
+{
+   shard *s;
+   bool removed, small;
+   {
+      lock_guard<mutex> map(stripes[mystripe()].m);
+      s = shards[shardfor(k)].get();
+      lock_guard<mutex> lock(s->m);
+      s->ops++;
+      s->writes++;
+      removed = s->t.remove(k);
+      size_t n = s->t.size();
+      small = removed && !hashed &&
+              ((n == 0) || (maxshardsize && (n == maxshardsize / 4)));
+   }
+   if (small) mergeifsmall(s);
+   return removed;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+bool shardedavltree<Key, Value, Compare, Hash>::search(const Key &k,
+                                                       Value &d) const
+{
+   lock_guard<mutex> map(stripes[mystripe()].m);
+   shard *s = shards[shardfor(k)].get();
+   lock_guard<mutex> lock(s->m);
+   s->ops++;
+   return s->t.search(k, d);
+}
+
+template <class Key, class Value, class Compare, class Hash>
+size_t shardedavltree<Key, Value, Compare, Hash>::size() const
+{
+   lock_guard<mutex> map(stripes[mystripe()].m);
+   size_t n = 0;
+   for (size_t i = 0; i < shards.size(); i++) {
+      lock_guard<mutex> lock(shards[i]->m);
+      n += shards[i]->t.size();
+   }
+   return n;
+}
+
+template <class Key, class Value, class Compare, class Hash>
+size_t shardedavltree<Key, Value, Compare, Hash>::shardcount() const
+{
+   lock_guard<mutex> map(stripes[mystripe()].m);
+   return shards.size();
+}
+
+template <class Key, class Value, class Compare, class Hash>
+bool shardedavltree<Key, Value, Compare, Hash>::rebalance()
+// with every stripe held no operation is running, so the counters can
+//    be read without taking the shard locks
+{
+   if (hashed) return false;
+   lockall();
+   for (size_t i = 0; i + 1 < shards.size(); )
+      if (!mergeshards(i)) i++;
+   unsigned long total = 0;
+   size_t busiest = 0;
+   for (size_t i = 0; i < shards.size(); i++) {
+      total += shards[i]->ops;
+      if (shards[i]->ops > shards[busiest]->ops) busiest = i;
+   }
+   shard *hot = NULL;
+   if (shards[busiest]->ops * shards.size() > 2 * total)
+      hot = shards[busiest].get();
+   for (size_t i = 0; i < shards.size(); i++) shards[i]->ops = 0;
+   unlockall();
+   return hot && splitshard(hot, 1);
+}
+
+template <class Key, class Value, class Compare, class Hash>
+template <class F>
+void shardedavltree<Key, Value, Compare, Hash>::visit(const Key *lo,
+                                                      const Key *hi, F fn)
+// the ordered visit behind for_each and for_each_in_range, with null
+//    lo or hi meaning no bound on that side
+{
+   typedef typename tree::iterator iterator;
+   lock_guard<mutex> map(stripes[mystripe()].m);
+
+   if (!hashed) {
+      size_t first = lo ? shardfor(*lo) : 0;
+      size_t last = hi ? shardfor(*hi) : shards.size() - 1;
+      for (size_t i = first; i <= last; i++) {
+         lock_guard<mutex> lock(shards[i]->m);
+         tree &t = shards[i]->t;
+         for (iterator it = lo ? t.lower_bound(*lo) : t.begin();
+              it != t.end(); ++it) {
+            if (hi && comp(*hi, it.key())) break;
+            fn(it.key(), it.value());
+         }
+      }
+      return;
+   }
+
+   // k-way merge: a heap of each shard's next entry, smallest on top
+   for (size_t i = 0; i < shards.size(); i++) shards[i]->m.lock();
+   typedef pair<iterator, size_t> cursor;
+   const Compare &c = comp;
+   auto later = [&c](const cursor &a, const cursor &b) {
+      return c(b.first.key(), a.first.key());
+   };
+   priority_queue<cursor, vector<cursor>, decltype(later)> heap(later);
+   for (size_t i = 0; i < shards.size(); i++) {
+      tree &t = shards[i]->t;
+      iterator it = lo ? t.lower_bound(*lo) : t.begin();
+      if (it != t.end()) heap.push(cursor(it, i));
+   }
+   while (!heap.empty()) {
+      cursor top = heap.top();
+      heap.pop();
+      if (hi && comp(*hi, top.first.key())) break;
+      fn(top.first.key(), top.first.value());
+      if (++top.first != shards[top.second]->t.end()) heap.push(top);
+   }
+   for (size_t i = shards.size(); i > 0; i--) shards[i - 1]->m.unlock();
+}
+
+template <class Key, class Value, class Compare, class Hash>
+template <class F>
+void shardedavltree<Key, Value, Compare, Hash>::for_each(F fn)
+{
+   visit(NULL, NULL, fn);
+}
+
+template <class Key, class Value, class Compare, class Hash>
+template <class F>
+void shardedavltree<Key, Value, Compare, Hash>::for_each_in_range(
+   const Key &lo, const Key &hi, F fn)
+{
+   if (comp(hi, lo)) return;
+   visit(&lo, &hi, fn);
+}
+
+#endif
@@ -6,17 +6,21 @@ S#: 546853797
 
 #include "avltree.h"
 #include <iostream>
+#include <vector>
+
+// the interactive tree maps key words to data words
+typedef avltree<string, string> wordtree;
 
 char getcommand();
 void printmenu();
-bool processcommand(char cmd, avltree *&tree);
+bool processcommand(char cmd, wordtree *&tree);
 string numtostring(unsigned int a);
 int getnumber();
 void clearcinbuffer();
 
 int main()
 {
-   avltree *T = new avltree;
+   wordtree *T = new wordtree;
    
    printmenu();
    char cmd = getcommand();
@@ -67,7 +71,7 @@ void printmenu()
    cout << "   or Q to quit." << endl;
 }
 
-bool processcommand(char cmd, avltree *&tree)
+bool processcommand(char cmd, wordtree *&tree)
 {
    string k, d;
    int n;
@@ -82,7 +86,10 @@ bool processcommand(char cmd, avltree *&tree)
                 cout << "(" << k << "," << d << ") ";
                 if (tree->insert(k, d)) 
                    cout << "was inserted successfully" << endl;
-                else cout << "was not inserted correctly" << endl;
+                else if (tree->search(k, d))
+                   cout << "was not inserted (that key is already in the tree)"
+                        << endl;
+                else cout << "was not inserted (out of memory)" << endl;
                 break;
       case 'S': cout << "Enter the key you wish to search for" << endl;
                 cin >> k;
@@ -104,14 +111,14 @@ bool processcommand(char cmd, avltree *&tree)
                 break; 
       case 'N': cout << "Creating a new tree...\n";
                 delete tree;
-                tree = new avltree;
+                tree = new wordtree;
                 if (tree != NULL)
                    cout << "SUCCESS!\n";
                 break;
       case 'G': cout << "Enter the number of nodes you wish"
                      << " to generate." << endl;
                 delete tree;
-                tree = new avltree;
+                tree = new wordtree;
                 if (tree == NULL) break; //problem creating a new tree
                 do {
                   n = getnumber();
@@ -119,8 +126,16 @@ bool processcommand(char cmd, avltree *&tree)
                   if (n < 1) cout << "Invalid input, please enter a "
                                   << "positive integer.\n";
                 } while (n < 1);
-                for(int i = 0; i < n;i++) {
-                  tree->insert(numtostring(i),"genericdata");
+                {
+                  //build the whole tree at once rather than
+                  //inserting the keys one at a time
+                  vector< pair<string, string> > items;
+                  items.reserve(n);
+                  for(int i = 0; i < n;i++) {
+                    items.push_back(make_pair(numtostring(i),
+                                              string("genericdata")));
+                  }
+                  tree->build_from_unsorted(items.begin(), items.end());
                 }
                 cout << "Tree of " << n 
                      << " random items (with search keys 0-" << n-1 